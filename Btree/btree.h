@@ -1,12 +1,30 @@
 #ifndef B_TREE_BTREE_H
 #define B_TREE_BTREE_H
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <limits>
 #include <memory>
+#include <mutex>
+#include <new>
 #include <optional>
+#include <thread>
+#include <type_traits>
+#include <vector>
 
 #include "file.h"
+#include "iterator.h"
 #include "node.h"
 #include "buffer_manager.h"
+#if defined(VMCACHE)
+#include "vm_buffer_manager.h"
+#endif
+#include "wal.h"
 #include "../include/types.hpp"
 
 #ifdef NO_BUFFER
@@ -19,21 +37,61 @@ struct Metadata {
                   // for header
   record_t record_count{0};  // Number of records inserted into the btree
   const pagenum_t root_id{ROOT_PAGE_NUM};
+  pagenum_t free_page{0};  // Head of the list of free pages, 0 if empty
+  uint64_t clean{0};  // Set if the header was written at a clean shutdown
+  // Above every record number in the btree so far. Deleted records keep their
+  // numbers, so this stays ahead of record_count.
+  record_t next_record{0};
   uint8_t padding[
 #ifdef NO_BUFFER
       PAGE_SIZE
 #else
       sizeof(decltype(std::declval<Page>().page_data))
 #endif
-      - sizeof(root_id) - sizeof(record_count) - sizeof(count)];
+      - sizeof(next_record) - sizeof(clean) - sizeof(free_page) - sizeof(root_id) - sizeof(record_count) - sizeof(count)];
  public:
   inline static constexpr pagenum_t get_root_page_num() {
     return ROOT_PAGE_NUM;
   };
-  pagenum_t get_page_count() const noexcept { return count; };
-  pagenum_t get_next_page_num() noexcept { return ++count; };
-  auto get_record_count() const noexcept { return record_count; }
-  void inc_record_count() noexcept { record_count++; }
+  // The counters are shared by all threads working on the tree.
+  pagenum_t get_page_count() const noexcept {
+    return __atomic_load_n(&count, __ATOMIC_RELAXED);
+  };
+  pagenum_t get_next_page_num() noexcept {
+    return __atomic_add_fetch(&count, 1, __ATOMIC_RELAXED);
+  };
+  auto get_record_count() const noexcept {
+    return __atomic_load_n(&record_count, __ATOMIC_RELAXED);
+  }
+  void inc_record_count() noexcept {
+    __atomic_add_fetch(&record_count, 1, __ATOMIC_RELAXED);
+  }
+  void add_record_count(record_t n) noexcept {
+    __atomic_add_fetch(&record_count, n, __ATOMIC_RELAXED);
+  }
+  void dec_record_count() noexcept {
+    __atomic_sub_fetch(&record_count, 1, __ATOMIC_RELAXED);
+  }
+  record_t get_next_record() const noexcept {
+    return __atomic_load_n(&next_record, __ATOMIC_RELAXED);
+  }
+  // Make sure that next_record is above record_number.
+  void use_record(record_t record_number) noexcept {
+    record_t next = get_next_record();
+    while (next <= record_number &&
+           !__atomic_compare_exchange_n(&next_record, &next, record_number + 1, true, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) {
+    }
+  }
+  // Used by recovery only.
+  void set_page_count(pagenum_t n) noexcept { count = n; }
+  void set_record_count(record_t n) noexcept { record_count = n; }
+  void set_next_record(record_t n) noexcept { next_record = n; }
+  // The free list is protected by Btree::free_list_latch.
+  pagenum_t get_free_page() const noexcept { return free_page; }
+  void set_free_page(pagenum_t page_num) noexcept { free_page = page_num; }
+  bool is_clean() const noexcept { return clean != 0; }
+  void set_clean(bool c) noexcept { clean = c; }
   Metadata(){ for(auto &c : padding) c = 0xff; }
 };
 
@@ -44,74 +102,228 @@ static_assert(sizeof(Metadata) <=
               sizeof(decltype(std::declval<Page>().page_data)));
 #endif
 
+// Child references of inner nodes are swizzled while the child is in the buffer
+// pool (see Swip), so a descent through resident nodes skips the page table
+// and does not pin the nodes it passes. The root stays pinned for the lifetime
+// of the tree. With the virtual-memory-assisted pool (VMCACHE), page numbers
+// are translated by address arithmetic and references are not swizzled.
+//
+// With pin_inner, every inner node holds a pin of its own for as long as it is
+// part of the tree, so CLOCK only ever evicts leaves. Inner nodes are written
+// back by checkpoints and at shutdown. The pool must have room for them on top
+// of the leaves it caches (see get_pinned_pages).
 template <class T>
-class Btree {
+class Btree : private Swizzler {
  public:
-  Btree(std::shared_ptr<File> file, pagenum_t page_count);
-  ~Btree(){ buf_mgr.Finalize(); }
+#if defined(VMCACHE)
+  using Pool = VmBufferManager;
+#else
+  using Pool = BufferManager;
+#endif
+
+  // With a wal, every change to a page is logged, and the log is replayed on
+  // open. The log is truncated at shutdown. With pin_inner, the inner nodes
+  // are read in and pinned on open. The tree caches its pages in a buffer
+  // pool of its own with page_count pages, or in pool, which it may share
+  // with other trees (not with VMCACHE, whose pools cache one file each).
+  Btree(std::shared_ptr<File> file, pagenum_t page_count, Wal *wal = nullptr,
+        bool pin_inner = false)
+      : Btree(file, std::make_shared<Pool>(page_count), wal, pin_inner) {}
+  Btree(std::shared_ptr<File> file, std::shared_ptr<Pool> pool, Wal *wal = nullptr,
+        bool pin_inner = false);
+  ~Btree(){
+    stop_checkpointer();
+    buf_mgr->UnpinPage(root_frame);
+    // Writes back the pages of the tree and gives their frames to the other
+    // users of the pool.
+    buf_mgr->UnregisterFile(file.get());
+    write_header(true);
+    if (wal) {
+      wal->Truncate();
+    }
+  }
 
-  typedef Node<T> node;
-  static_assert(sizeof(node) <= PAGE_SIZE, "sizeof(node) must not be greater than PAGE_SIZE");
-  static_assert(sizeof(node) <= sizeof(decltype(std::declval<Page>().page_data)));
-  // typedef Iterator<T> iterator;
+  typedef NodeHeader node;
+  typedef InnerNode<T> inner_node;
+  typedef LeafNode<T> leaf_node;
+  typedef EntryTraits<T> traits;
+  typedef typename traits::key_type key_type;
+  static_assert(sizeof(inner_node) <= NODE_SIZE, "an inner node must fit in a page");
+  static_assert(sizeof(leaf_node) <= NODE_SIZE, "a leaf node must fit in a page");
+  typedef Iterator<T> iterator;
+
+  // Iterators over the entries in key order, see Iterator. readahead is the
+  // number of leaves to read ahead (at most kMaxReadahead).
+  iterator begin(size_t readahead = 0);
+  iterator end() { return iterator(); }
+  iterator lower_bound(const T &start, size_t readahead = 0);
 
-  // iterator begin();
   std::optional<T> find(const T &object);
-  // iterator end();
 
   void insert(const T &value);
-  void remove(const T &value);
-  void scan(const T &object, int scan_sz, char*& values_out);
-  auto get_record_count() { return get_header()->get_record_count(); }
+  // Build the tree bottom-up from values (sorted first if they are not).
+  // Leaves are packed to fill_factor and written sequentially, then every
+  // inner level is built from the level below. The tree must be empty and no
+  // other operation may run concurrently.
+  void bulk_load(std::vector<T> &values, double fill_factor = 1.0);
+  // Remove the entry with the key of value. Returns false if there is none.
+  bool remove(const T &value);
+  // Append up to count entries, starting at the first entry not less than
+  // start, to out. Returns the number of entries appended.
+  size_t scan(const T &start, size_t count, std::vector<T> &out);
+  auto get_record_count() { return header.get_record_count(); }
+  // Above every record number inserted so far, including those of entries
+  // removed since, so that new records do not reuse their numbers.
+  record_t get_next_record() { return header.get_next_record(); }
+  // Number of pages the tree keeps pinned in the buffer pool: the root and,
+  // with pin_inner, the other inner nodes. Each takes sizeof(Page) of DRAM.
+  size_t get_pinned_pages() const { return pinned_inner.load(std::memory_order_relaxed) + 1; }
+
+  // Fuzzy checkpoint (see BufferManager::Checkpoint) while other threads keep
+  // working. With a wal, replay starts at the checkpoint from then on. sync
+  // runs between the two, e.g. to sync another file whose writes are logged.
+  void checkpoint(const std::function<void()> &sync = {});
+  // Take a checkpoint every interval in a background thread until the tree
+  // is closed.
+  void start_checkpointer(std::chrono::milliseconds interval, std::function<void()> sync = {});
+  // Wait for the checkpointer to finish. Owners whose sync callback uses
+  // members destroyed before the tree must call this first.
+  void stop_checkpointer();
  private:
   // Variables
   static constexpr int MAX_LEVEL = 8;
-  BufferManager buf_mgr;
+  static constexpr size_t kMaxReadahead = 16;
+  std::shared_ptr<Pool> buf_mgr;
   std::shared_ptr<File> file;
-  std::vector<std::pair<PageId, Page *>> pagelist{};
-  node *stack[MAX_LEVEL];
-  uint16_t insert_pos[MAX_LEVEL] = {0};
-  uint16_t stack_idx;
+  // The header counters live in memory and bypass the buffer pool. The header
+  // page is written when the tree is opened, marked as not clean, and at
+  // shutdown, marked as clean. A tree that was not shut down cleanly gets its
+  // counters back from recover_header().
+  Metadata header;
+  std::mutex free_list_latch;  // Protects the free list in header
+  Wal *wal;
+  Page *root_frame{nullptr};  // Pinned until the tree is closed
+  const bool pin_inner;
+  std::atomic<size_t> pinned_inner{0};  // Inner nodes other than the root
+
+  std::mutex checkpoint_latch;  // Serializes checkpoints
+  std::thread checkpointer;
+  std::mutex checkpointer_latch;
+  std::condition_variable checkpointer_wakeup;
+  bool checkpointer_stop{false};
+
+  // Payloads of the log records of the tree. Each starts with the page it
+  // applies to.
+  struct LogPage {
+    pagenum_t page;
+    uint32_t unused;
+    // Followed by the page image
+  };
+  struct LogEntry {
+    pagenum_t page;
+    uint32_t unused;
+    key_type key;
+    typename traits::value_type value;
+  };
+  static_assert(sizeof(LogPage) % sizeof(uint64_t) == 0);
 
   // Functions
-  void new_node(node *&n);
-  void read_node(long page_id, node *&n);
+  template <class N, class... Args>
+  Page *new_node(N *&n, Args... args);
+  pagenum_t allocate_page();
+  void free_node(node &n);
+  Page *read_node(long page_id, node *&n);
   void write_node(long page_id);
-  int insert(node &ptr, const T &value);
-  int remove(node &ptr, const T &value);
-  void split(node &parent, int pos);
-  void split_root();
-  void decrease_height(node &ptr, node &node_in_underflow, int pos);
-  bool merge_with_parent(node &ptr, node &node_in_underflow, int pos);
-  void merge_leaf(node &ptr, node &node_in_underflow, int pos);
-  bool steal_sibling(node &node_in_underflow, node &ptr, int pos);
-  T succesor(node &ptr);
+  Page *read_child(inner_node &parent, Page *frame_parent, uint64_t version_parent, uint16_t pos,
+                   node *&child, bool &need_restart);
+  node *root_node() { return std::launder(reinterpret_cast<node *>(root_frame->GetRealPage())); }
+  void adopt_children(inner_node &n);
+  void pin_inner_nodes();
+  void keep_inner(Page *frame);
+  void release_inner(node &n);
+  // Swizzler
+  bool Unswizzle(Page *frame) override;
+  void UnswizzleCopy(char *page_data) override;
+  bool descend_optimistic(const key_type &key, uint16_t level, node *&node_cur,
+                          Page *&frame_cur, uint64_t &version_cur);
+  bool find_optimistic(const T &object, std::optional<T> &ret);
+  iterator seek(const key_type &key, size_t readahead);
+  void position(const key_type &key, bool after, iterator &it);
+  void copy_leaf(const leaf_node &leaf, iterator &it);
+  bool hop_right(iterator &it);
+  size_t read_ahead(const key_type &key, size_t count);
+  bool insert_optimistic(const T &value);
+  bool remove_optimistic(const key_type &key, bool &removed);
+  void split(inner_node &parent, node &child, int pos);
+  void split_root(node &root);
+  key_type split_half(node &full, node &sibling);
+  static bool is_full(const node &n) {
+    return n.is_leaf() ? static_cast<const leaf_node &>(n).is_full()
+                       : static_cast<const inner_node &>(n).is_full();
+  }
+  // Log a change to a page and set the page's LSN. The caller holds the page's
+  // write latch, so the LSNs of a page increase with its changes.
+  void log_image(node &n);
+  void log_entry(LogType type, leaf_node &leaf, const key_type &key,
+                 const typename traits::value_type &value);
+  void redo();
+  void merge(inner_node &parent, node &left, node &right, int pos);
+  void collapse_root(node &root, node &child);
+  // A node below a quarter of its capacity is merged with a sibling if the
+  // result stays within three quarters of the capacity, so that it does not
+  // split again soon after.
+  static bool is_underfull(const node &n) {
+    return n.count < (n.is_leaf() ? leaf_node::kOrder : inner_node::kOrder) / 4;
+  }
+  static bool can_merge(const node &left, const node &right) {
+    return left.is_leaf()
+               ? left.count + right.count <= leaf_node::kOrder * 3 / 4
+               : left.count + right.count + 1 <= inner_node::kOrder * 3 / 4;
+  }
 
   // Header Metadata methods
-  void flush_header();
-  auto get_header();
-  void increment_record_and_flush();
+  Metadata *get_header() { return &header; }
+  void read_header();
+  void write_header(bool clean);
+  void recover_header();
   auto get_root_page_num(){ return Metadata::get_root_page_num(); }
 
+  // Pages pinned by the calling thread during the current operation. The tree
+  // is shared by all threads, so the traversal state must be thread-local.
+  static inline std::vector<std::pair<PageId, Page *>> &pagelist() {
+    thread_local std::vector<std::pair<PageId, Page *>> pinned = [] {
+      std::vector<std::pair<PageId, Page *>> v;
+      v.reserve(MAX_LEVEL * 4);
+      return v;
+    }();
+    return pinned;
+  }
+
+  // Frames the calling thread holds write-latched while it allocates pages for
+  // a split. Evicting a page to make room may have to unswizzle a reference in
+  // one of them (see Unswizzle).
+  static inline std::vector<Page *> &latched_frames() {
+    thread_local std::vector<Page *> latched;
+    return latched;
+  }
+
   inline Page *BufMgrPinPage(PageId pid, uint16_t page_mode) {
-    Page *page = buf_mgr.PinPage(pid, page_mode);
+    Page *page = buf_mgr->PinPage(pid, page_mode);
     DCHECK_NOTNULL(page);
-    pagelist.emplace_back(pid, page);
+    pagelist().emplace_back(pid, page);
     return page;
   }
 
   inline void UnpinAllPages() {
-    for (auto &p : pagelist) {
-      buf_mgr.UnpinPage(p.second);
+    auto &pinned = pagelist();
+    for (auto &p : pinned) {
+      buf_mgr->UnpinPage(p.second);
     }
-    pagelist.clear();
+    pinned.clear();
   }
 
-  enum state {
-    BT_OVERFLOW,
-    BT_UNDERFLOW,
-    NORMAL,
-  };
+  friend class Iterator<T>;
+
 public:
   Btree() = delete;
   Btree(const Btree&) = delete;
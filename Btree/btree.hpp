@@ -3,84 +3,282 @@ static_assert(false, "Not implemented");
 #endif
 
 template <class T>
-Btree<T>::Btree(std::shared_ptr<File> file, pagenum_t page_count)
-    : buf_mgr{page_count}, file{file} {
+Btree<T>::Btree(std::shared_ptr<File> file, std::shared_ptr<Pool> pool, Wal *wal, bool pin_inner)
+    : buf_mgr{std::move(pool)}, file{file}, wal{wal}, pin_inner{pin_inner} {
 #ifndef NO_BUFFER
-  // Use BufferManager::RegisterFile to register this file's both BaseFiles with
-  // the buffer manager.
-  buf_mgr.RegisterFile(file.get());
+  buf_mgr->RegisterFile(file.get(), wal, this);
 #endif
-  pagelist.reserve(page_count);
   if (file->is_empty()) {
-    node *header_page = nullptr;
-    read_node(0, header_page);
-    new (header_page) Metadata();
     node *root = nullptr;
     read_node(get_root_page_num(), root);
-    new (root) node(get_root_page_num());
+    new (root) leaf_node(get_root_page_num());
+    log_image(*root);
     write_node(get_root_page_num());
-    flush_header();
-    UnpinAllPages();
   } else {
-    get_header();
+    read_header();
+    if (wal) {
+      redo();
+    }
+    if (!header.is_clean()) {
+      recover_header();
+    }
+  }
+  // The counters on disk are stale from now on until the next clean shutdown.
+  write_header(false);
+  UnpinAllPages();
+  root_frame = buf_mgr->PinPage(PageId(file->GetId(), get_root_page_num()), PAGE_READ);
+  if (pin_inner) {
+    pin_inner_nodes();
   }
 }
 
 template <class T>
-void Btree<T>::flush_header() {
-  write_node(0);
+void Btree<T>::read_header() {
+  std::unique_ptr<Page, decltype(&std::free)> buf{
+      std::launder(reinterpret_cast<Page *>(std::aligned_alloc(ALIGNMENT, sizeof(Page)))),
+      &std::free};
+  CHECK(file->load(0, *buf)) << "Can't read the header page.";
+  std::memcpy(static_cast<void *>(&header), buf->GetRealPage(), sizeof(Metadata));
 }
+
+// Write the header page through to the file. It is synced, so that it is on
+// disk before any page written after it.
 template <class T>
-auto Btree<T>::get_header() {
-  node *header_page = nullptr;
-  read_node(0, header_page);
-  return std::launder(reinterpret_cast<Metadata *>(header_page));
+void Btree<T>::write_header(bool clean) {
+  std::unique_ptr<Page, decltype(&std::free)> buf{
+      std::launder(reinterpret_cast<Page *>(std::aligned_alloc(ALIGNMENT, sizeof(Page)))),
+      &std::free};
+  {
+    std::lock_guard<std::mutex> guard(free_list_latch);
+    header.set_clean(clean);
+    std::memcpy(buf->GetRealPage(), static_cast<void *>(&header), sizeof(Metadata));
+  }
+  CHECK(file->flush(0, *buf)) << "Can't write the header page.";
+  file->sync();
 }
+
+// Rebuild the header counters of a tree that was not shut down cleanly. The
+// tree is walked level by level from the root: the entries in the leaves are
+// counted, the next record number is taken past the highest one found, and
+// every page up to the last one reachable that is not part of the tree goes
+// onto a new free list.
 template <class T>
-void Btree<T>::increment_record_and_flush() {
-  get_header()->inc_record_count();
-  flush_header();
+void Btree<T>::recover_header() {
+  LOG(INFO) << "The B-tree was not shut down cleanly, recovering its header.";
+  record_t records = 0;
+  record_t next_record = 0;
+  std::vector<bool> reachable(get_root_page_num() + 1);
+  std::vector<pagenum_t> level{get_root_page_num()};
+  std::vector<pagenum_t> next;
+  while (!level.empty()) {
+    next.clear();
+    for (pagenum_t page_num : level) {
+      if (page_num >= reachable.size()) {
+        reachable.resize(page_num + 1);
+      }
+      reachable[page_num] = true;
+      node *n = nullptr;
+      read_node(page_num, n);
+      if (n->is_leaf()) {
+        auto *leaf = static_cast<leaf_node *>(n);
+        records += leaf->size();
+        for (uint16_t i = 0; i < leaf->size(); ++i) {
+          next_record = std::max<record_t>(next_record, leaf->values[i] + 1);
+        }
+      } else {
+        auto *inner = static_cast<inner_node *>(n);
+        next.insert(next.end(), inner->children, inner->children + inner->size() + 1);
+      }
+      UnpinAllPages();
+    }
+    level.swap(next);
+  }
+
+  header.set_record_count(records);
+  header.set_next_record(next_record);
+  header.set_page_count(reachable.size() - 1);
+  header.set_free_page(0);
+  for (pagenum_t page_num = reachable.size() - 1; page_num > get_root_page_num(); --page_num) {
+    if (!reachable[page_num]) {
+      node *n = nullptr;
+      read_node(page_num, n);
+      free_node(*n);
+      UnpinAllPages();
+    }
+  }
 }
 
-/*
 template <class T>
-typename Btree<T>::iterator Btree<T>::begin() {
-  node aux = read_node(header.get_root_page_num());
-  while (aux.children[0] != 0) {
-    pagenum_t page_num = aux.children[0];
-    aux = read_node(page_num);
+void Btree<T>::log_image(node &n) {
+  if (!wal) {
+    return;
   }
-  iterator it(file);
-  it.currentPosition = aux;
-  return it;
+  LogPage head{n.page_id, 0};
+  if (!n.is_inner()) {
+    n.lsn = wal->Append(LogType::kBtreePageImage, &head, sizeof(head), &n, NODE_SIZE);
+    return;
+  }
+  // Inner nodes are logged with page numbers in place of swizzled references.
+  thread_local uint64_t image[NODE_SIZE / sizeof(uint64_t)];
+  std::memcpy(image, &n, NODE_SIZE);
+  UnswizzleCopy(reinterpret_cast<char *>(image));
+  n.lsn = wal->Append(LogType::kBtreePageImage, &head, sizeof(head), image, NODE_SIZE);
 }
 
 template <class T>
-typename Btree<T>::iterator Btree<T>::end() {
-  thread_local iterator it(file); // We can reuse this sentinel
-  return it;
+void Btree<T>::log_entry(LogType type, leaf_node &leaf, const key_type &key,
+                         const typename traits::value_type &value) {
+  if (!wal) {
+    return;
+  }
+  LogEntry entry{leaf.page_id, 0, key, value};
+  leaf.lsn = wal->Append(type, &entry, sizeof(entry));
+}
+
+// Redo pass of recovery. Every record describes a completed change to one
+// page, so there is nothing to undo. A record is applied only to a page that
+// does not contain it yet, i.e., whose LSN is lower than the record's.
+template <class T>
+void Btree<T>::redo() {
+  size_t applied = 0;
+  wal->Replay([&](LogType type, const char *payload, uint32_t size, lsn_t lsn) {
+    if (type != LogType::kBtreePageImage && type != LogType::kBtreeLeafInsert &&
+        type != LogType::kBtreeLeafRemove) {
+      return;
+    }
+    LogPage head;
+    std::memcpy(&head, payload, sizeof(head));
+    node *n = nullptr;
+    read_node(head.page, n);
+    if (n->lsn < lsn) {
+      if (type == LogType::kBtreePageImage) {
+        DCHECK(size == sizeof(head) + NODE_SIZE);
+        std::memcpy(static_cast<void *>(n), payload + sizeof(head), NODE_SIZE);
+      } else {
+        LogEntry entry;
+        std::memcpy(&entry, payload, sizeof(entry));
+        auto *leaf = static_cast<leaf_node *>(n);
+        auto pos = leaf->lower_bound(entry.key);
+        if (type == LogType::kBtreeLeafInsert) {
+          leaf->insert(pos, traits::make(entry.key, entry.value));
+        } else if (pos < leaf->size() && leaf->keys[pos] == entry.key) {
+          leaf->remove(pos);
+        }
+      }
+      n->lsn = lsn;
+      write_node(head.page);
+      applied++;
+    }
+    UnpinAllPages();
+  });
+  LOG_IF(INFO, applied > 0) << "Redid " << applied << " B-tree log records.";
 }
-*/
 
 template <class T>
-void Btree<T>::new_node(node *&n) {
-  auto page_num = get_header()->get_next_page_num();
-  flush_header();
+void Btree<T>::checkpoint(const std::function<void()> &sync) {
+  std::lock_guard<std::mutex> guard(checkpoint_latch);
+  lsn_t lsn = buf_mgr->Checkpoint(file.get());
+  if (sync) {
+    sync();
+  }
+  if (wal) {
+    wal->Checkpoint(lsn);
+  }
+}
+
+template <class T>
+void Btree<T>::start_checkpointer(std::chrono::milliseconds interval, std::function<void()> sync) {
+  CHECK(!checkpointer.joinable()) << "The checkpointer is already running.";
+  checkpointer = std::thread([this, interval, sync = std::move(sync)] {
+    std::unique_lock<std::mutex> guard(checkpointer_latch);
+    while (!checkpointer_wakeup.wait_for(guard, interval, [this] { return checkpointer_stop; })) {
+      guard.unlock();
+      checkpoint(sync);
+      guard.lock();
+    }
+  });
+}
+
+template <class T>
+void Btree<T>::stop_checkpointer() {
+  if (!checkpointer.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> guard(checkpointer_latch);
+    checkpointer_stop = true;
+  }
+  checkpointer_wakeup.notify_one();
+  checkpointer.join();
+}
+
+// Allocate a page and construct an N (inner_node or leaf_node) in it. args
+// follow the page number in N's constructor. The node is returned
+// write-latched, and the caller releases the latch once the node is complete.
+template <class T>
+template <class N, class... Args>
+Page *Btree<T>::new_node(N *&n, Args... args) {
+  auto page_num = allocate_page();
   auto pid = PageId(file->GetId(), page_num);
   Page *buf_page = BufMgrPinPage(pid, PAGE_WRITE);
   buf_page->SetDirty(true);
-  n = std::launder(reinterpret_cast<node *>(buf_page->GetRealPage()));
-  new (n) node(page_num);
+  // A reused page may still be read by optimistic readers that reached it
+  // before it was freed. Constructing the node under the write latch bumps the
+  // version, so they restart.
+  bool need_restart;
+  do {
+    need_restart = false;
+    buf_page->latch.WriteLockOrRestart(need_restart);
+  } while (need_restart);
+  n = new (buf_page->GetRealPage()) N(page_num, args...);
+  if constexpr (std::is_same_v<N, inner_node>) {
+    if (pin_inner) {
+      keep_inner(buf_page);
+    }
+  }
+  return buf_page;
+}
+
+// Take a page from the free list, or extend the file if it is empty.
+template <class T>
+pagenum_t Btree<T>::allocate_page() {
+  std::lock_guard<std::mutex> guard(free_list_latch);
+  pagenum_t page_num = header.get_free_page();
+  if (page_num != 0) {
+    node *free = nullptr;
+    read_node(page_num, free);
+    DCHECK(free->level == NodeHeader::kFreeLevel) << "Page " << page_num << " is not free";
+    header.set_free_page(free->right);
+  } else {
+    page_num = header.get_next_page_num();
+  }
+  return page_num;
+}
+
+// Put the page of n on the free list. The caller holds n's write latch and has
+// unlinked n from the tree.
+template <class T>
+void Btree<T>::free_node(node &n) {
+  std::lock_guard<std::mutex> guard(free_list_latch);
+  pagenum_t page_num = n.page_id;
+  buf_mgr->SetSwipOwner(buf_mgr->FrameOf(&n), nullptr);
+  new (&n) NodeHeader(page_num, NodeHeader::kFreeLevel);
+  n.right = header.get_free_page();
+  header.set_free_page(page_num);
+  log_image(n);
+  write_node(page_num);
 }
 
 template <class T>
-void Btree<T>::read_node(long page_id, node *&n) {
+Page *Btree<T>::read_node(long page_id, node *&n) {
 #if defined(NO_BUFFER)
   file->load(page_id, *n);
+  return nullptr;
 #else
   auto pid = PageId(file->GetId(), page_id);
   Page *buf_page = BufMgrPinPage(pid, PAGE_READ);
   n = std::launder(reinterpret_cast<node *>(buf_page->GetRealPage()));
+  return buf_page;
 #endif
 }
 
@@ -95,41 +293,407 @@ void Btree<T>::write_node(long page_id) {
 #endif
 }
 
+// Follow the child reference at pos of parent, which was read optimistically
+// at version_parent. A swizzled reference leads to the child's frame without a
+// page table lookup or a pin: the child stays in its frame until the reference
+// is unswizzled under the parent's latch, which fails the caller's validation
+// of the parent. Otherwise the child is pinned and, if the parent's latch can
+// be taken, the reference is swizzled. That changes the parent's version, so
+// need_restart is set either way. The caller read-locks the child and then
+// validates the parent. With VMCACHE the child is only pinned: the pool finds
+// its frame without a page table anyway.
 template <class T>
-std::optional<T> Btree<T>::find(
-    const T &object) {
-  node *root = nullptr;
-  node *child = nullptr;
-  node *node_cur = nullptr;
-  std::optional<T> ret{};
+Page *Btree<T>::read_child(inner_node &parent, Page *frame_parent, uint64_t version_parent,
+                           uint16_t pos, node *&child, bool &need_restart) {
+  pagenum_t ref = parent.children[pos];
+  // The reference must be validated before it is followed.
+  frame_parent->latch.CheckOrRestart(version_parent, need_restart);
+  if (need_restart) return nullptr;
+  if (Swip::is_swizzled(ref)) {
+    Page *frame = buf_mgr->GetFrame(Swip::frame_index(ref));
+    child = std::launder(reinterpret_cast<node *>(frame->GetRealPage()));
+    return frame;
+  }
 
-  stack_idx = 0;
-  read_node(get_root_page_num(), root);
-  stack[stack_idx++] = root;
-  while (stack_idx > 0) {
-    node_cur = stack[--stack_idx];
-    DCHECK(stack_idx < MAX_LEVEL);
-    int pos = 0;
-    if (node_cur->children[0] != 0) { // node_cur is an internal node.
-      while (pos < node_cur->count && node_cur->data[pos] <= object) {
-        pos++;
+  Page *frame = read_node(ref, child);
+#if !defined(VMCACHE)
+  frame_parent->latch.UpgradeToWriteLockOrRestart(version_parent, need_restart);
+  if (!need_restart) {
+    buf_mgr->SetSwipOwner(frame, frame_parent);
+    parent.children[pos] = Swip::make(buf_mgr->GetFrameIndex(frame));
+    frame_parent->latch.WriteUnlock();
+  }
+  need_restart = true;
+#endif
+  return frame;
+}
+
+// Record n as the owner of the swizzled references that were moved into it
+// from another node. The caller holds the write latches of both nodes.
+template <class T>
+void Btree<T>::adopt_children(inner_node &n) {
+  Page *frame = buf_mgr->FrameOf(&n);
+  for (uint16_t i = 0; i <= n.size(); ++i) {
+    if (Swip::is_swizzled(n.children[i])) {
+      buf_mgr->SetSwipOwner(buf_mgr->GetFrame(Swip::frame_index(n.children[i])), frame);
+    }
+  }
+}
+
+// Read in and pin every inner node below the root, level by level, and swizzle
+// the references to them. Runs while no other operation does, on open and
+// after a bulk load.
+template <class T>
+void Btree<T>::pin_inner_nodes() {
+  std::vector<Page *> level{root_frame};
+  std::vector<Page *> next;
+  while (!level.empty()) {
+    next.clear();
+    for (Page *frame : level) {
+      auto *n = std::launder(reinterpret_cast<node *>(frame->GetRealPage()));
+      if (n->level < 2) {
+        continue;
       }
-      DCHECK(pos < MAX_CHILDREN);
-      read_node(node_cur->children[pos], child);
-      stack[stack_idx++] = child;
-    } else { // node_cur is a leaf node.
-      while (pos < node_cur->count && node_cur->data[pos] < object) {
-        pos++;
+      auto *inner = static_cast<inner_node *>(n);
+      for (uint16_t pos = 0; pos <= inner->size(); ++pos) {
+        pagenum_t ref = inner->children[pos];
+        Page *frame_child;
+        if (Swip::is_swizzled(ref)) {
+          frame_child = buf_mgr->GetFrame(Swip::frame_index(ref));
+        } else {
+          node *child = nullptr;
+          frame_child = read_node(ref, child);
+#if !defined(VMCACHE)
+          buf_mgr->SetSwipOwner(frame_child, frame);
+          inner->children[pos] = Swip::make(buf_mgr->GetFrameIndex(frame_child));
+#endif
+        }
+        keep_inner(frame_child);
+        next.push_back(frame_child);
       }
-      DCHECK(pos < MAX_CHILDREN);
-      ret.emplace(node_cur->data[pos]);
+      UnpinAllPages();
+    }
+    level.swap(next);
+  }
+  LOG(INFO) << "Pinned " << get_pinned_pages() << " B-tree pages ("
+            << get_pinned_pages() * sizeof(Page) / 1024 << " KiB).";
+}
+
+// Take the pin an inner node holds while it is part of the tree. The caller
+// holds a pin on frame.
+template <class T>
+void Btree<T>::keep_inner(Page *frame) {
+  buf_mgr->RepinPage(frame);
+  pinned_inner.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Release the pin of an inner node that is about to be freed. The caller holds
+// its write latch.
+template <class T>
+void Btree<T>::release_inner(node &n) {
+  if (pin_inner && n.is_inner()) {
+    buf_mgr->UnpinPage(buf_mgr->FrameOf(&n));
+    pinned_inner.fetch_sub(1, std::memory_order_relaxed);
+  }
+}
+
+// Called by the buffer manager before it evicts the page in frame, which it
+// holds write-latched. A node is only evicted after its children, and the
+// reference in its parent goes back to the page number under the parent's
+// latch. Gives up if another thread holds the parent's latch or the parent
+// just took over the reference.
+template <class T>
+bool Btree<T>::Unswizzle(Page *frame) {
+  auto *n = std::launder(reinterpret_cast<node *>(frame->GetRealPage()));
+  if (n->is_inner()) {
+    auto *inner = static_cast<inner_node *>(n);
+    for (uint16_t i = 0; i <= inner->size(); ++i) {
+      if (Swip::is_swizzled(inner->children[i])) {
+        return false;
+      }
+    }
+  }
+
+  Page *owner = buf_mgr->GetSwipOwner(frame);
+  if (!owner) {
+    return true;
+  }
+  const auto &latched = latched_frames();
+  const bool latched_here = std::find(latched.begin(), latched.end(), owner) != latched.end();
+  if (!latched_here) {
+    bool need_restart = false;
+    owner->latch.WriteLockOrRestart(need_restart);
+    if (need_restart) {
+      return false;
+    }
+  }
+  bool unswizzled = buf_mgr->GetSwipOwner(frame) == owner;
+  if (unswizzled) {
+    auto *parent = std::launder(reinterpret_cast<node *>(owner->GetRealPage()));
+    if (parent->is_inner()) {
+      auto *inner = static_cast<inner_node *>(parent);
+      const pagenum_t swip = Swip::make(buf_mgr->GetFrameIndex(frame));
+      for (uint16_t i = 0; i <= inner->size(); ++i) {
+        if (inner->children[i] == swip) {
+          // Not a change of the page: it is written and logged with page
+          // numbers anyway.
+          inner->children[i] = frame->GetPageId().GetPageID();
+          break;
+        }
+      }
+    }
+    buf_mgr->SetSwipOwner(frame, nullptr);
+  }
+  if (!latched_here) {
+    owner->latch.WriteUnlock();
+  }
+  return unswizzled;
+}
+
+// Called by the buffer manager on a copy of a page about to be written. The
+// copy is validated afterwards, so it may be inconsistent here.
+template <class T>
+void Btree<T>::UnswizzleCopy(char *page_data) {
+  auto *n = std::launder(reinterpret_cast<node *>(page_data));
+  if (!n->is_inner()) {
+    return;
+  }
+  auto *inner = static_cast<inner_node *>(n);
+  for (uint16_t i = 0; i <= inner->size(); ++i) {
+    pagenum_t ref = inner->children[i];
+    if (Swip::is_swizzled(ref) && Swip::frame_index(ref) < buf_mgr->GetFrameCount()) {
+      inner->children[i] = buf_mgr->GetFrame(Swip::frame_index(ref))->GetPageId().GetPageID();
     }
   }
-  
+}
+
+template <class T>
+std::optional<T> Btree<T>::find(const T &object) {
+  std::optional<T> ret{};
+  while (!find_optimistic(object, ret)) {
+    UnpinAllPages();
+    ret.reset();
+  }
   UnpinAllPages();
   return ret;
 }
 
+// Optimistic descent from the root to the node on the given level (0 for the
+// leaves) that covers key. Every node is read without latching and validated
+// against its version before the next hop is taken (optimistic lock coupling).
+// On success the node is returned with the version it was read at, and the
+// caller validates what it reads from the node against that version. Nodes
+// reached through swizzled references are not pinned, so the caller pins the
+// node before that validation if it keeps it. Returns false if a concurrent
+// writer invalidated the descent.
+template <class T>
+bool Btree<T>::descend_optimistic(const key_type &key, uint16_t level, node *&node_cur,
+                                  Page *&frame_cur, uint64_t &version_cur) {
+  bool need_restart = false;
+  frame_cur = root_frame;
+  node_cur = root_node();
+  version_cur = frame_cur->latch.ReadLockOrRestart(need_restart);
+  if (need_restart) return false;
+
+  while (node_cur->level > level) {
+    auto *inner = static_cast<inner_node *>(node_cur);
+    node *child = nullptr;
+    Page *frame_child = read_child(*inner, frame_cur, version_cur, inner->upper_bound(key), child,
+                                   need_restart);
+    if (need_restart) return false;
+    uint64_t version_child = frame_child->latch.ReadLockOrRestart(need_restart);
+    if (need_restart) return false;
+    frame_cur->latch.ReadUnlockOrRestart(version_cur, need_restart);
+    if (need_restart) return false;
+
+    node_cur = child;
+    frame_cur = frame_child;
+    version_cur = version_child;
+  }
+  return true;
+}
+
+template <class T>
+bool Btree<T>::find_optimistic(const T &object, std::optional<T> &ret) {
+  const key_type key = traits::key(object);
+  node *node_cur = nullptr;
+  Page *frame_cur = nullptr;
+  uint64_t version_cur = 0;
+  if (!descend_optimistic(key, 0, node_cur, frame_cur, version_cur)) return false;
+
+  auto *leaf = static_cast<leaf_node *>(node_cur);
+  auto pos = leaf->lower_bound(key);
+  if (pos < leaf->size() && leaf->keys[pos] == key) {
+    ret.emplace(leaf->get(pos));
+  }
+  bool need_restart = false;
+  frame_cur->latch.ReadUnlockOrRestart(version_cur, need_restart);
+  return !need_restart;
+}
+
+template <class T>
+typename Btree<T>::iterator Btree<T>::begin(size_t readahead) {
+  return seek(std::numeric_limits<key_type>::min(), readahead);
+}
+
+template <class T>
+typename Btree<T>::iterator Btree<T>::lower_bound(const T &start, size_t readahead) {
+  return seek(traits::key(start), readahead);
+}
+
+template <class T>
+typename Btree<T>::iterator Btree<T>::seek(const key_type &key, size_t readahead) {
+  iterator it;
+  it.tree = this;
+  it.readahead = std::min(readahead, kMaxReadahead);
+  position(key, false, it);
+  if (it.readahead > 0) {
+    it.prefetched = read_ahead(key, it.readahead);
+  }
+  if (it.at_end()) {
+    it.next_leaf();
+  }
+  return it;
+}
+
+// Position it on the first entry not less than key, or greater than key if
+// after is set. The leaf is copied into it and stays pinned.
+template <class T>
+void Btree<T>::position(const key_type &key, bool after, iterator &it) {
+  it.release();
+  while (true) {
+    node *node_cur = nullptr;
+    Page *frame_cur = nullptr;
+    uint64_t version_cur = 0;
+    bool need_restart = !descend_optimistic(key, 0, node_cur, frame_cur, version_cur);
+    if (!need_restart) {
+      auto *leaf = static_cast<leaf_node *>(node_cur);
+      copy_leaf(*leaf, it);
+      it.index = after ? leaf->upper_bound(key) : leaf->lower_bound(key);
+      // The leaf may have been reached through a swizzled reference, so it is
+      // pinned before the validation that keeps it in its frame.
+      buf_mgr->RepinPage(frame_cur);
+      frame_cur->latch.ReadUnlockOrRestart(version_cur, need_restart);
+      if (need_restart) {
+        buf_mgr->UnpinPage(frame_cur);
+      }
+    }
+    if (!need_restart) {
+      it.frame = frame_cur;
+      it.version = version_cur;
+    }
+    UnpinAllPages();
+    if (!need_restart) break;
+  }
+  it.resume_key = key;
+  it.resume_after = after;
+  if (!it.entries.empty()) {
+    it.resume_key = traits::key(it.entries.back());
+    it.resume_after = true;
+  }
+}
+
+// Copy the entries and the sibling link of a leaf into the iterator. The leaf
+// may be read optimistically; the caller validates the copy.
+template <class T>
+void Btree<T>::copy_leaf(const leaf_node &leaf, iterator &it) {
+  uint16_t n = leaf.size();
+  it.entries.resize(n);
+  for (uint16_t i = 0; i < n; ++i) {
+    it.entries[i] = leaf.get(i);
+  }
+  it.page = leaf.page_id;
+  it.right = leaf.right;
+  it.index = 0;
+}
+
+// Move it to the right sibling of its current leaf. The sibling link was
+// copied from the current leaf, so it is only followed if that leaf did not
+// change since: a merge may have freed the sibling. Returns false if it did
+// change, and the caller positions it again from the root.
+template <class T>
+bool Btree<T>::hop_right(iterator &it) {
+  const pagenum_t right = it.right;
+  while (true) {
+    bool need_restart = false;
+    node *node_cur = nullptr;
+    Page *frame = read_node(right, node_cur);
+    uint64_t version = frame->latch.ReadLockOrRestart(need_restart);
+    if (!need_restart) {
+      // Past the validation below the page is a live leaf, as sibling links
+      // only ever point to leaves.
+      copy_leaf(*static_cast<leaf_node *>(node_cur), it);
+      frame->latch.ReadUnlockOrRestart(version, need_restart);
+    }
+    if (!need_restart) {
+      bool changed = false;
+      it.frame->latch.ReadUnlockOrRestart(it.version, changed);
+      if (changed) {
+        UnpinAllPages();
+        return false;
+      }
+      DCHECK(node_cur->is_leaf()) << "Sibling link to inner page " << it.page;
+      buf_mgr->UnpinPage(it.frame);
+      buf_mgr->RepinPage(frame);
+      it.frame = frame;
+      it.version = version;
+      if (!it.entries.empty()) {
+        it.resume_key = traits::key(it.entries.back());
+        it.resume_after = true;
+      }
+    }
+    UnpinAllPages();
+    if (!need_restart) return true;
+  }
+}
+
+// Ask the buffer manager to read up to count leaves that follow the leaf
+// covering key. They are taken from the leaf's parent, so readahead stops at
+// the parent's last child. Leaves with swizzled references are resident and
+// skipped. Returns the number of leaves covered.
+template <class T>
+size_t Btree<T>::read_ahead(const key_type &key, size_t count) {
+  thread_local std::vector<PageId> pages;
+  size_t covered = 0;
+  while (true) {
+    pages.clear();
+    covered = 0;
+    node *node_cur = nullptr;
+    Page *frame_cur = nullptr;
+    uint64_t version_cur = 0;
+    bool need_restart = !descend_optimistic(key, 1, node_cur, frame_cur, version_cur);
+    if (!need_restart && !node_cur->is_leaf()) {
+      auto *parent = static_cast<inner_node *>(node_cur);
+      uint16_t n = parent->size();
+      for (uint16_t pos = parent->upper_bound(key) + 1; pos <= n && covered < count; ++pos, ++covered) {
+        if (!Swip::is_swizzled(parent->children[pos])) {
+          pages.emplace_back(file->GetId(), parent->children[pos]);
+        }
+      }
+      frame_cur->latch.ReadUnlockOrRestart(version_cur, need_restart);
+    }
+    UnpinAllPages();
+    if (!need_restart) break;
+  }
+  buf_mgr->Prefetch(pages);
+  return covered;
+}
+
+template <class T>
+size_t Btree<T>::scan(const T &start, size_t count, std::vector<T> &out) {
+  // Read ahead the leaves the scan spans if they are half full.
+  size_t leaves = count / (leaf_node::kOrder / 2);
+  size_t n = 0;
+  auto it = lower_bound(start, leaves);
+  while (n < count && it != end()) {
+    out.push_back(*it);
+    if (++n < count) {
+      ++it;
+    }
+  }
+  return n;
+}
+
 /*
 template <class T>
 typename Btree<T>::iterator Btree<T>::find(
@@ -156,55 +720,209 @@ typename Btree<T>::iterator Btree<T>::find(
 
 template <class T>
 void Btree<T>::insert(const T &value) {
-  node *root = nullptr;
-  node *node_cur = nullptr;
-  node *child = nullptr;
-  node *parent = nullptr;
-  uint16_t pos = 0;
+  while (!insert_optimistic(value)) {
+    UnpinAllPages();
+  }
+  header.inc_record_count();
+  header.use_record(traits::value(value));
+  UnpinAllPages();
+}
 
-  stack_idx = 0;
-  read_node(get_root_page_num(), root);
-  stack[stack_idx] = root;
+// One optimistic descent for insert. Full nodes are split eagerly on the way
+// down (parent and node write-latched), after which the descent restarts, so a
+// leaf insert never has to propagate splits upwards. Only the leaf is
+// write-latched for the insert itself. Returns false if the caller must retry.
+template <class T>
+bool Btree<T>::insert_optimistic(const T &value) {
+  bool need_restart = false;
+  node *node_cur = root_node();
+  Page *frame_cur = root_frame;
+  uint64_t version_cur = frame_cur->latch.ReadLockOrRestart(need_restart);
+  if (need_restart) return false;
 
-  // Step 1, insert value to the leaf node.
-  while (true) {
-    DCHECK(stack_idx < MAX_LEVEL);
-    node_cur = stack[stack_idx];
+  inner_node *parent = nullptr;
+  Page *frame_parent = nullptr;
+  uint64_t version_parent = 0;
+  uint16_t pos = 0;  // Position of node_cur in parent
+  const key_type key = traits::key(value);
 
-    pos = 0;
-    while (pos < node_cur->count && node_cur->data[pos] < value) {
-      pos++;
+  while (true) {
+    if (is_full(*node_cur)) {
+      if (parent) {
+        frame_parent->latch.UpgradeToWriteLockOrRestart(version_parent, need_restart);
+        if (need_restart) return false;
+      }
+      frame_cur->latch.UpgradeToWriteLockOrRestart(version_cur, need_restart);
+      if (need_restart) {
+        if (parent) frame_parent->latch.WriteUnlock();
+        return false;
+      }
+      if (parent) {
+        split(*parent, *node_cur, pos);
+        frame_parent->latch.WriteUnlock();
+      } else {
+        // The root always lives in ROOT_PAGE_NUM, so a node without a parent
+        // is the root.
+        split_root(*node_cur);
+      }
+      frame_cur->latch.WriteUnlock();
+      return false;
     }
-    DCHECK(pos < MAX_CHILDREN);
-    insert_pos[stack_idx] = pos;
-    if (node_cur->children[pos] != 0) {
-      long page_id = node_cur->children[pos];
-      read_node(page_id, child);
-      stack[++stack_idx] = child; 
-    } else {
-      node_cur->insert_in_node(pos, value);
-      write_node(node_cur->page_id);
+    if (node_cur->is_leaf()) {
       break;
     }
+
+    if (parent) {
+      frame_parent->latch.ReadUnlockOrRestart(version_parent, need_restart);
+      if (need_restart) return false;
+    }
+    parent = static_cast<inner_node *>(node_cur);
+    frame_parent = frame_cur;
+    version_parent = version_cur;
+
+    pos = parent->upper_bound(key);
+    frame_cur = read_child(*parent, frame_parent, version_parent, pos, node_cur, need_restart);
+    if (need_restart) return false;
+    version_cur = frame_cur->latch.ReadLockOrRestart(need_restart);
+    if (need_restart) return false;
+  }
+
+  frame_cur->latch.UpgradeToWriteLockOrRestart(version_cur, need_restart);
+  if (need_restart) return false;
+  if (parent) {
+    frame_parent->latch.ReadUnlockOrRestart(version_parent, need_restart);
+    if (need_restart) {
+      frame_cur->latch.WriteUnlock();
+      return false;
+    }
   }
 
-  DCHECK(stack_idx < MAX_LEVEL);
-  // Step 2, check if there is any node that needs to be split.
-  while (stack_idx > 0) {
-    node_cur = stack[stack_idx];
-    parent = stack[stack_idx - 1];
-    pos = insert_pos[stack_idx - 1];
+  auto *leaf = static_cast<leaf_node *>(node_cur);
+  leaf->insert(leaf->lower_bound(key), value);
+  log_entry(LogType::kBtreeLeafInsert, *leaf, key, traits::value(value));
+  write_node(leaf->page_id);
+  frame_cur->latch.WriteUnlock();
+  return true;
+}
 
-    if (node_cur->is_overflow()) {
-      split(*parent, pos);
+template <class T>
+void Btree<T>::bulk_load(std::vector<T> &values, double fill_factor) {
+  CHECK(get_record_count() == 0) << "Bulk loading requires an empty tree.";
+  CHECK(fill_factor > 0.0 && fill_factor <= 1.0) << "Invalid fill factor " << fill_factor;
+  if (!std::is_sorted(values.begin(), values.end())) {
+    std::sort(values.begin(), values.end());
+  }
+  if (values.empty()) {
+    return;
+  }
+
+  // Entries per leaf and keys per inner node.
+  const size_t per_leaf = std::max(2, static_cast<int>(leaf_node::kOrder * fill_factor));
+  const size_t per_inner = std::max(2, static_cast<int>(inner_node::kOrder * fill_factor));
+
+  // New pages are assembled in an aligned staging area and written to the file
+  // in sequential batches. They bypass the buffer pool, which cannot hold them
+  // yet. The root stays in ROOT_PAGE_NUM, so it is built separately and
+  // installed through the buffer pool at the end.
+  constexpr size_t kBatchPages = 256;
+  std::unique_ptr<Page, decltype(&std::free)> staging{
+      std::launder(reinterpret_cast<Page *>(std::aligned_alloc(ALIGNMENT, sizeof(Page) * kBatchPages))),
+      &std::free};
+  std::memset(static_cast<void *>(staging.get()), 0, sizeof(Page) * kBatchPages);
+  std::vector<std::pair<long, Page *>> batch;
+  auto flush_staging = [&]() {
+    if (!batch.empty()) {
+      CHECK(file->flush_batch(batch)) << "Can't write bulk loaded pages.";
+      batch.clear();
+    }
+  };
+  auto stage_page = [&](pagenum_t page_num) {
+    if (batch.size() == kBatchPages) {
+      flush_staging();
+    }
+    Page *page = &staging.get()[batch.size()];
+    batch.emplace_back(page_num, page);
+    return page->GetRealPage();
+  };
+  auto root_image = std::make_unique<uint64_t[]>(NODE_SIZE / sizeof(uint64_t));
+
+  Metadata *header = get_header();
+
+  // (First key, page number) of every node of the level built last.
+  std::vector<std::pair<key_type, pagenum_t>> level;
+
+  // Leaf level. Entries are spread evenly, so no leaf is much emptier than
+  // the others. Leaf pages are allocated contiguously, which makes every
+  // right sibling the next page.
+  size_t n = values.size();
+  size_t num_nodes = (n + per_leaf - 1) / per_leaf;
+  for (size_t k = 0; k < num_nodes; ++k) {
+    size_t begin = k * n / num_nodes;
+    size_t end = (k + 1) * n / num_nodes;
+    leaf_node *leaf;
+    if (num_nodes > 1) {
+      pagenum_t page_num = header->get_next_page_num();
+      leaf = new (stage_page(page_num)) leaf_node(page_num);
+      leaf->right = (k + 1 < num_nodes) ? page_num + 1 : 0;
+    } else {
+      leaf = new (root_image.get()) leaf_node(get_root_page_num());
+    }
+    for (size_t i = begin; i < end; ++i) {
+      leaf->keys[i - begin] = traits::key(values[i]);
+      leaf->values[i - begin] = traits::value(values[i]);
     }
-    --stack_idx;
+    leaf->count = end - begin;
+    level.emplace_back(leaf->keys[0], leaf->page_id);
   }
-  if (stack[0]->is_overflow()) {
-    split_root();
+
+  // Inner levels, up to the root.
+  std::vector<std::pair<key_type, pagenum_t>> parents;
+  for (uint16_t height = 1; level.size() > 1; ++height) {
+    n = level.size();
+    num_nodes = (n + per_inner) / (per_inner + 1);
+    parents.clear();
+    for (size_t k = 0; k < num_nodes; ++k) {
+      size_t begin = k * n / num_nodes;
+      size_t end = (k + 1) * n / num_nodes;
+      inner_node *inner;
+      if (num_nodes > 1) {
+        pagenum_t page_num = header->get_next_page_num();
+        inner = new (stage_page(page_num)) inner_node(page_num, height);
+      } else {
+        inner = new (root_image.get()) inner_node(get_root_page_num(), height);
+      }
+      inner->children[0] = level[begin].second;
+      for (size_t j = begin + 1; j < end; ++j) {
+        inner->keys[inner->count] = level[j].first;
+        inner->children[++inner->count] = level[j].second;
+      }
+      parents.emplace_back(level[begin].first, inner->page_id);
+    }
+    level.swap(parents);
+  }
+  flush_staging();
+
+  node *root = nullptr;
+  Page *frame = read_node(get_root_page_num(), root);
+  bool need_restart;
+  do {
+    need_restart = false;
+    frame->latch.WriteLockOrRestart(need_restart);
+  } while (need_restart);
+  std::memcpy(static_cast<void *>(root), root_image.get(), NODE_SIZE);
+  // The other pages are already synced.
+  log_image(*root);
+  write_node(get_root_page_num());
+  frame->latch.WriteUnlock();
+
+  header->add_record_count(values.size());
+  for (const T &value : values) {
+    header->use_record(traits::value(value));
   }
-  increment_record_and_flush();
   UnpinAllPages();
+  if (pin_inner) {
+    pin_inner_nodes();
+  }
 }
 
 /*
@@ -230,305 +948,282 @@ int Btree<T>::insert(node &ptr, const T &value) {
 }
 */
 
+// Move the upper half of a full node into its new, empty sibling and return
+// the separator key for the parent. For inner nodes the middle key moves up.
 template <class T>
-void Btree<T>::split(node &parent, int pos) {
-  node *ptr_child1 = nullptr;
-  node *ptr_child2 = nullptr;
-  this->read_node(parent.children[pos], ptr_child1);
-  node &child1 = *ptr_child1;
-  this->new_node(ptr_child2);
-  node &child2 = *ptr_child2;
-
-  bool is_leaf = (child1.children[0] == 0);
-
-  int iter = 0;
-  int i;
-  for (i = 0; iter < MIN_NUM_CHILDREN; i++) {
-    iter++;
+typename Btree<T>::key_type Btree<T>::split_half(node &full, node &sibling) {
+  int count = full.count;
+  int mid = count / 2;
+  if (full.is_leaf()) {
+    auto &from = static_cast<leaf_node &>(full);
+    auto &to = static_cast<leaf_node &>(sibling);
+    std::copy(from.keys + mid, from.keys + count, to.keys);
+    std::copy(from.values + mid, from.values + count, to.values);
+    to.count = count - mid;
+    from.count = mid;
+    to.right = from.right;
+    from.right = to.page_id;
+    return to.keys[0];
   }
-  child1.count = iter;
-
-  parent.insert_in_node(pos, child1.data[iter]);
+  auto &from = static_cast<inner_node &>(full);
+  auto &to = static_cast<inner_node &>(sibling);
+  std::copy(from.keys + mid + 1, from.keys + count, to.keys);
+  std::copy(from.children + mid + 1, from.children + count + 1, to.children);
+  to.count = count - mid - 1;
+  from.count = mid;
+  return from.keys[mid];
+}
 
-  if (!is_leaf) {
-    iter++;
+// Split child (the child at pos of parent) in half. The caller holds the
+// write latches of both parent and child; the new sibling is not reachable
+// before the parent latch is released.
+template <class T>
+void Btree<T>::split(inner_node &parent, node &child, int pos) {
+  node *sibling = nullptr;
+  Page *frame_sibling = nullptr;
+  latched_frames() = {buf_mgr->FrameOf(&parent), buf_mgr->FrameOf(&child)};
+  if (child.is_leaf()) {
+    leaf_node *leaf = nullptr;
+    frame_sibling = new_node(leaf);
+    sibling = leaf;
   } else {
-    child2.right = child1.right;
-    child1.right = child2.page_id;
-    parent.children[pos + 1] = child2.page_id;
+    inner_node *inner = nullptr;
+    frame_sibling = new_node(inner, child.level);
+    sibling = inner;
   }
+  latched_frames().clear();
 
-  for (i = 0; iter < BTREE_ORDER + 1; i++) {
-    child2.children[i] = child1.children[iter];
-    child2.data[i] = child1.data[iter];
-    child2.count++;
-    iter++;
+  parent.insert(pos, split_half(child, *sibling), sibling->page_id);
+  if (!sibling->is_leaf()) {
+    adopt_children(static_cast<inner_node &>(*sibling));
   }
-  child2.children[i] = child1.children[iter];
-
-  parent.children[pos] = child1.page_id;
-  parent.children[pos + 1] = child2.page_id;
 
+  log_image(parent);
+  log_image(child);
+  log_image(*sibling);
   write_node(parent.page_id);
-  write_node(child1.page_id);
-  write_node(child2.page_id);
+  write_node(child.page_id);
+  write_node(sibling->page_id);
+  frame_sibling->latch.WriteUnlock();
 }
 
+// Split the root in place: its entries move to two new children so that the
+// root stays in ROOT_PAGE_NUM. The caller holds the root's write latch.
 template <class T>
-void Btree<T>::split_root() {
-  node *ptr_child1 = nullptr;
-  node *ptr_child2 = nullptr;
-  node *ptr_node_in_overflow = nullptr;
-
-  this->read_node(get_root_page_num(), ptr_node_in_overflow);
-  node &node_in_overflow = *ptr_node_in_overflow;
-  this->new_node(ptr_child1);
-  node &child1 = *ptr_child1;
-  this->new_node(ptr_child2);
-  node &child2 = *ptr_child2;
-
-  int iter = 0;
-  int i;
-  for (i = 0; iter < MIN_NUM_CHILDREN; i++) {
-    child1.children[i] = node_in_overflow.children[iter];
-    child1.data[i] = node_in_overflow.data[iter];
-    child1.count++;
-    iter++;
-  }
-  child1.children[i] = node_in_overflow.children[iter];
-
-  node_in_overflow.data[0] = node_in_overflow.data[iter];
-
-  child1.right = child2.page_id;
-
-  if (node_in_overflow.children[0] != 0) {
-    iter++;  // the middle element
+void Btree<T>::split_root(node &root) {
+  node *child1 = nullptr;
+  node *child2 = nullptr;
+  Page *frame1 = nullptr;
+  Page *frame2 = nullptr;
+  latched_frames() = {buf_mgr->FrameOf(&root)};
+  if (root.is_leaf()) {
+    leaf_node *leaf1 = nullptr, *leaf2 = nullptr;
+    frame1 = new_node(leaf1);
+    frame2 = new_node(leaf2);
+    std::copy_n(static_cast<leaf_node &>(root).keys, root.count, leaf1->keys);
+    std::copy_n(static_cast<leaf_node &>(root).values, root.count, leaf1->values);
+    child1 = leaf1;
+    child2 = leaf2;
+  } else {
+    inner_node *inner1 = nullptr, *inner2 = nullptr;
+    frame1 = new_node(inner1, root.level);
+    frame2 = new_node(inner2, root.level);
+    std::copy_n(static_cast<inner_node &>(root).keys, root.count, inner1->keys);
+    std::copy_n(static_cast<inner_node &>(root).children, root.count + 1, inner1->children);
+    child1 = inner1;
+    child2 = inner2;
   }
+  latched_frames().clear();
+  child1->count = root.count;
 
-  for (i = 0; iter < BTREE_ORDER + 1; i++) {
-    child2.children[i] = node_in_overflow.children[iter];
-    child2.data[i] = node_in_overflow.data[iter];
-    child2.count++;
-    iter++;
+  key_type separator = split_half(*child1, *child2);
+  if (!child1->is_leaf()) {
+    adopt_children(static_cast<inner_node &>(*child1));
+    adopt_children(static_cast<inner_node &>(*child2));
   }
-  child2.children[i] = node_in_overflow.children[iter];
 
-  node_in_overflow.children[0] = child1.page_id;
-  node_in_overflow.children[1] = child2.page_id;
-  node_in_overflow.count = 1;
+  auto *new_root = new (&root) inner_node(root.page_id, root.level + 1);
+  new_root->children[0] = child1->page_id;
+  new_root->insert(0, separator, child2->page_id);
 
-  write_node(node_in_overflow.page_id);
-  write_node(child1.page_id);
-  write_node(child2.page_id);
+  log_image(*new_root);
+  log_image(*child1);
+  log_image(*child2);
+  write_node(new_root->page_id);
+  write_node(child1->page_id);
+  write_node(child2->page_id);
+  frame2->latch.WriteUnlock();
+  frame1->latch.WriteUnlock();
 }
-/*
 template <class T>
-void Btree<T>::remove(const T &value) {
-  node root = read_node(header.root_id);
-  int state = remove(root, value);
-  /// root = read_node(header.root_id);
-  if (state == BT_UNDERFLOW && root.count == 0) {
-    header.root_id = root.children[0];
-    write_node(root.page_id, root);
-    file->flush(0, *get_header_buf(header));
+bool Btree<T>::remove(const T &value) {
+  bool removed = false;
+  while (!remove_optimistic(traits::key(value), removed)) {
+    UnpinAllPages();
   }
+  if (removed) {
+    header.dec_record_count();
+  }
+  UnpinAllPages();
+  return removed;
 }
 
+// One optimistic descent for remove, the counterpart of insert_optimistic.
+// Underfull nodes are merged with a sibling under the same parent on the way
+// down (parent, node and sibling write-latched), after which the descent
+// restarts, so removing from a leaf never has to propagate merges upwards. An
+// inner root left with a single child absorbs that child. Sets removed if the
+// key was found. Returns false if the caller must retry.
 template <class T>
-int Btree<T>::remove(node &ptr, const T &value) {
-  int pos = 0;
-  while (pos < ptr.count && ptr.data[pos] < value) {
-    pos++;
-  }
-  if (ptr.children[pos] != 0) {
-    if (ptr.data[pos] == value && pos != ptr.count) {
-      node next = read_node(ptr.children[pos + 1]);
-      ptr.data[pos] = succesor(next);
-      write_node(ptr.page_id, ptr);
-      pos++;
+bool Btree<T>::remove_optimistic(const key_type &key, bool &removed) {
+  bool need_restart = false;
+  node *node_cur = root_node();
+  Page *frame_cur = root_frame;
+  uint64_t version_cur = frame_cur->latch.ReadLockOrRestart(need_restart);
+  if (need_restart) return false;
+
+  inner_node *parent = nullptr;
+  Page *frame_parent = nullptr;
+  uint64_t version_parent = 0;
+  uint16_t pos = 0;  // Position of node_cur in parent
+
+  while (true) {
+    if (!parent && !node_cur->is_leaf() && node_cur->count == 0) {
+      node *child = nullptr;
+      Page *frame_child = read_child(*static_cast<inner_node *>(node_cur), frame_cur, version_cur, 0,
+                                     child, need_restart);
+      if (need_restart) return false;
+      frame_cur->latch.UpgradeToWriteLockOrRestart(version_cur, need_restart);
+      if (need_restart) return false;
+      frame_child->latch.WriteLockOrRestart(need_restart);
+      if (need_restart) {
+        frame_cur->latch.WriteUnlock();
+        return false;
+      }
+      collapse_root(*node_cur, *child);
+      frame_child->latch.WriteUnlock();
+      frame_cur->latch.WriteUnlock();
+      return false;
     }
-    node child = read_node(ptr.children[pos]);
-    int state = remove(child, value);
-    if (state == BT_UNDERFLOW) {
-      node node_in_underflow = child;
-      bool can_steal = steal_sibling(node_in_underflow, ptr, pos);
-      if (!can_steal) {
-        if (node_in_underflow.children[0] == 0) {  // si el underflow es leaf
-          merge_leaf(ptr, node_in_underflow, pos);
-        } else {
-          bool can_merge = merge_with_parent(ptr, node_in_underflow, pos);
-          if (!can_merge) decrease_height(ptr, node_in_underflow, pos);
+    if (parent && is_underfull(*node_cur) && parent->size() > 0) {
+      // Merge with the right sibling, or with the left one for the last child.
+      uint16_t left_pos = pos < parent->size() ? pos : pos - 1;
+      node *sibling = nullptr;
+      Page *frame_sibling = read_child(*parent, frame_parent, version_parent,
+                                       left_pos == pos ? pos + 1 : left_pos, sibling, need_restart);
+      if (need_restart) return false;
+      uint64_t version_sibling = frame_sibling->latch.ReadLockOrRestart(need_restart);
+      if (need_restart) return false;
+      node *left = left_pos == pos ? node_cur : sibling;
+      node *right = left_pos == pos ? sibling : node_cur;
+      bool mergeable = can_merge(*left, *right);
+      frame_sibling->latch.CheckOrRestart(version_sibling, need_restart);
+      if (need_restart) return false;
+      if (mergeable) {
+        frame_parent->latch.UpgradeToWriteLockOrRestart(version_parent, need_restart);
+        if (need_restart) return false;
+        frame_cur->latch.UpgradeToWriteLockOrRestart(version_cur, need_restart);
+        if (need_restart) {
+          frame_parent->latch.WriteUnlock();
+          return false;
         }
+        frame_sibling->latch.UpgradeToWriteLockOrRestart(version_sibling, need_restart);
+        if (need_restart) {
+          frame_cur->latch.WriteUnlock();
+          frame_parent->latch.WriteUnlock();
+          return false;
+        }
+        merge(*parent, *left, *right, left_pos);
+        frame_sibling->latch.WriteUnlock();
+        frame_cur->latch.WriteUnlock();
+        frame_parent->latch.WriteUnlock();
+        return false;
       }
     }
-  } else if (ptr.data[pos] == value) {
-    ptr.delete_in_node(pos);
-    write_node(ptr.page_id, ptr);
-  }
+    if (node_cur->is_leaf()) {
+      break;
+    }
 
-  return ptr.is_underflow() ? BT_UNDERFLOW : NORMAL;
-}
+    if (parent) {
+      frame_parent->latch.ReadUnlockOrRestart(version_parent, need_restart);
+      if (need_restart) return false;
+    }
+    parent = static_cast<inner_node *>(node_cur);
+    frame_parent = frame_cur;
+    version_parent = version_cur;
 
-template <class T>
-void Btree<T>::decrease_height(node &ptr, node &node_in_underflow,
-                                            int pos) {
-  if (pos != ptr.count) {
-    node child = read_node(ptr.children[pos]);
-    if (child.count < floor(BTREE_ORDER / 2.0)) {
-      node sibling = read_node(ptr.children[pos + 1]);
-      sibling.insert_in_node(0, ptr.data[pos]);
-      int last = node_in_underflow.count;
-      sibling.children[0] = node_in_underflow.children[last];
+    pos = parent->upper_bound(key);
+    frame_cur = read_child(*parent, frame_parent, version_parent, pos, node_cur, need_restart);
+    if (need_restart) return false;
+    version_cur = frame_cur->latch.ReadLockOrRestart(need_restart);
+    if (need_restart) return false;
+  }
 
-      for (int i = last - 1; i >= 0; --i) {
-        sibling.insert_in_node(0, node_in_underflow.data[i]);
-        sibling.children[0] = node_in_underflow.children[i];
-      }
-      ptr.delete_in_node(pos);
-      ptr.children[pos] = sibling.page_id;
-      write_node(sibling.page_id, sibling);
-      write_node(ptr.page_id, ptr);
-      return;
+  frame_cur->latch.UpgradeToWriteLockOrRestart(version_cur, need_restart);
+  if (need_restart) return false;
+  if (parent) {
+    frame_parent->latch.ReadUnlockOrRestart(version_parent, need_restart);
+    if (need_restart) {
+      frame_cur->latch.WriteUnlock();
+      return false;
     }
   }
-  node sibling = read_node(ptr.children[pos - 1]);
-  int last = sibling.count;
-  sibling.insert_in_node(last, ptr.data[pos - 1]);
-  sibling.children[last + 1] = node_in_underflow.children[0];
-  for (int i = 0; i < node_in_underflow.count; i++) {
-    last = sibling.count;
-    sibling.insert_in_node(last, node_in_underflow.data[i]);
-    sibling.children[last + 1] = node_in_underflow.children[i + 1];
-  }
-  ptr.delete_in_node(pos - 1);
-  ptr.children[pos - 1] = sibling.page_id;
-
-  write_node(sibling.page_id, sibling);
-  write_node(ptr.page_id, ptr);
-}
-
-template <class T>
-bool Btree<T>::merge_with_parent(node &ptr,
-                                              node &node_in_underflow,
-                                              int pos) {
-  if (pos != 0) {
-    node sibling = read_node(ptr.children[pos - 1]);
-    if (sibling.count - 1 >= floor(BTREE_ORDER / 2.0)) {
-      T jesus = ptr.data[pos - 1];
-      node_in_underflow.insert_in_node(0, jesus);
-      ptr.data[pos - 1] = sibling.data[sibling.count - 1];
-      node_in_underflow.children[0] = sibling.children[sibling.count];
-      sibling.delete_in_node(sibling.count - 1);
-      write_node(sibling.page_id, sibling);
-      write_node(ptr.page_id, ptr);
-      write_node(node_in_underflow.page_id, node_in_underflow);
-      return true;
-    }
-  } else if (pos != BTREE_ORDER) {
-    node sibling = read_node(ptr.children[pos + 1]);
-    if (sibling.count - 1 >= floor(BTREE_ORDER / 2.0)) {
-      T jesus = ptr.data[pos];
-      node_in_underflow.insert_in_node(0, jesus);
-      ptr.data[pos] = sibling.data[0];
-      node_in_underflow.children[1] = sibling.children[0];
-      sibling.children[0] = sibling.children[1];
-      sibling.delete_in_node(0);
-
-      write_node(sibling.page_id, sibling);
-      write_node(ptr.page_id, ptr);
-      write_node(node_in_underflow.page_id, node_in_underflow);
-      return true;
-    }
-  }
-  return false;
-}
-
-template <class T>
-void Btree<T>::merge_leaf(node &ptr, node &node_in_underflow,
-                                       int pos) {
-  if (pos - 1 >= 0) {  // right se une a left
-    node sibling = read_node(ptr.children[pos - 1]);
-    for (int i = 0; i < node_in_underflow.count; i++) {
-      int pos_in = sibling.count;
-      sibling.insert_in_node(pos_in, node_in_underflow.data[i]);
-    }
-    sibling.right = node_in_underflow.right;
-    ptr.delete_in_node(pos - 1);
-
-    write_node(sibling.page_id, sibling);
-    write_node(ptr.page_id, ptr);
-  } else {  // left se une a la right
-    node sibling = read_node(ptr.children[1]);
-    for (int i = 0; i < sibling.count; i++) {
-      int pos_in = node_in_underflow.count;
-      node_in_underflow.insert_in_node(pos_in, sibling.data[i]);
-    }
-    node_in_underflow.right = sibling.right;
-    ptr.delete_in_node(0);
-    write_node(node_in_underflow.page_id, node_in_underflow);
-    write_node(ptr.page_id, ptr);
-  }
-}
-
-template <class T>
-bool Btree<T>::steal_sibling(node &node_in_underflow, node &ptr,
-                                          int pos) {
-  if (node_in_underflow.children[0] == 0) {  // verificar que es hoja
-    if (pos != ptr.count) {
-      node sibling = read_node(ptr.children[pos + 1]);  // hno de la derecha
-      if (sibling.count - 1 >= floor(BTREE_ORDER / 2.0)) {
-        T jesus = sibling.data[0];
-        T jesus2 = sibling.data[1];
-        sibling.delete_in_node(0);
-        node_in_underflow.insert_in_node(sibling.count - 1, jesus);
-        ptr.data[pos] = jesus2;
-        write_node(sibling.page_id, sibling);
-        write_node(node_in_underflow.page_id, node_in_underflow);
-        write_node(ptr.page_id, ptr);
-        return true;
-      }
-    }
-    if (pos > 0) {
-      node sibling = read_node(ptr.children[pos - 1]);  // hno de la izquierda
-      if (sibling.count - 1 >= floor(BTREE_ORDER / 2.0)) {
-        T jesus = sibling.data[sibling.count - 1];
-        sibling.delete_in_node(sibling.count - 1);
-        node_in_underflow.insert_in_node(0, jesus);
-        ptr.data[pos - 1] = jesus;
-        write_node(sibling.page_id, sibling);
-        write_node(node_in_underflow.page_id, node_in_underflow);
-        write_node(ptr.page_id, ptr);
-        return true;
-      }
-    }
+
+  auto *leaf = static_cast<leaf_node *>(node_cur);
+  auto slot = leaf->lower_bound(key);
+  if (slot < leaf->size() && leaf->keys[slot] == key) {
+    leaf->remove(slot);
+    log_entry(LogType::kBtreeLeafRemove, *leaf, key, {});
+    write_node(leaf->page_id);
+    removed = true;
   }
-  return false;
+  frame_cur->latch.WriteUnlock();
+  return true;
 }
 
+// Merge right, the child at pos + 1 of parent, into left, the child at pos,
+// and free right. The caller holds the write latches of all three nodes.
 template <class T>
-T Btree<T>::succesor(node &ptr) {
-  while (ptr.children[0] != 0) {
-    ptr = read_node(ptr.children[0]);
-  }
-  if (ptr.count == 1) {
-    if (ptr.right == -1) return NULL;
-    ptr = read_node(ptr.right);
-    return ptr.data[0];
+void Btree<T>::merge(inner_node &parent, node &left, node &right, int pos) {
+  if (left.is_leaf()) {
+    auto &to = static_cast<leaf_node &>(left);
+    auto &from = static_cast<leaf_node &>(right);
+    std::copy_n(from.keys, from.count, to.keys + to.count);
+    std::copy_n(from.values, from.count, to.values + to.count);
+    to.count += from.count;
+    to.right = from.right;
   } else {
-    return ptr.data[1];
+    // The separator moves down between the keys of both nodes.
+    auto &to = static_cast<inner_node &>(left);
+    auto &from = static_cast<inner_node &>(right);
+    to.keys[to.count] = parent.keys[pos];
+    std::copy_n(from.keys, from.count, to.keys + to.count + 1);
+    std::copy_n(from.children, from.count + 1, to.children + to.count + 1);
+    to.count += from.count + 1;
+    adopt_children(to);
   }
+  parent.remove(pos);
+
+  log_image(parent);
+  log_image(left);
+  write_node(parent.page_id);
+  write_node(left.page_id);
+  release_inner(right);
+  free_node(right);
 }
 
+// Replace an inner root that has a single child with that child, so that the
+// root stays in ROOT_PAGE_NUM. The caller holds the write latches of both.
 template <class T>
-void scan(const T &object, int scan_sz, char*& values_out) {
-  if (!values_out) {
-    return;
-  }
-  auto iter = find(object);
-  for(int i = 0; i < scan_sz; ++i) {
-      auto pair = *iter;
-      memcpy(values_out + i * sizeof(pair), &pair, sizeof(pair));
-      ++iter;
+void Btree<T>::collapse_root(node &root, node &child) {
+  pagenum_t root_page = root.page_id;
+  std::memcpy(static_cast<void *>(&root), &child, NODE_SIZE);
+  root.page_id = root_page;
+  if (root.is_inner()) {
+    adopt_children(static_cast<inner_node &>(root));
   }
+  log_image(root);
+  write_node(root_page);
+  release_inner(child);
+  free_node(child);
 }
-*/
\ No newline at end of file
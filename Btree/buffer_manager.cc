@@ -1,40 +1,117 @@
 #include "buffer_manager.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <thread>
+
 #define MAX_BUFFER_PAGES (0xFFFFFFu)
 
 // Initialize a new buffer manager
-BufferManager::BufferManager(pagenum_t page_count) {
+BufferManager::BufferManager(pagenum_t page_count, pagenum_t capacity) {
   CHECK(page_count <= MAX_BUFFER_PAGES) << "Max allowed number of buffer pages is " << MAX_BUFFER_PAGES << ", requested " << page_count;
+  CHECK(capacity <= page_count) << "The capacity of a buffer pool cannot exceed its " << page_count << " pages.";
   // Initialize the page_count member variable.
   this->page_count = page_count;
+  this->resizable = capacity > 0;
+  if (!resizable) {
+    capacity = page_count;
+  }
+  this->capacity.store(capacity, std::memory_order_relaxed);
+  this->clean_target = std::max<uint32_t>(capacity / 8, 1);
+  this->max_prefetch = std::min<uint32_t>(capacity / 16, kMaxPrefetch);
+  this->checkpoint_batch = std::clamp<uint32_t>(capacity / 16, 1, kMaxCheckpointBatch);
 
-  // Malloc the desired amount of memory specified by page_count and store the address in member variable page_frames.
-  this->page_frames = std::launder(reinterpret_cast<Page *>(std::aligned_alloc(ALIGNMENT, sizeof(Page) * page_count)));
-
-  // Clear the allocated memory to 0.
-  std::memset(page_frames, 0, sizeof(Page) * page_count);
+  // Reserve the frames as anonymous memory, which is zeroed and, unless it is
+  // made of hugetlbfs pages (see HugePages), only backed once touched, so
+  // that frames out of use cost no memory.
+  void *frames = HugePages::Map(sizeof(Page) * page_count, frames_backing);
+  this->page_frames = std::launder(reinterpret_cast<Page *>(frames));
+  partitions = NumaPartitions(page_count, sizeof(Page), frames_backing);
+  partitions.Bind(frames, sizeof(Page));
 
-  // Use placement new to initialize each frame
-  // and add the page frames to LRU queue which will later be used by PinPage.
+  // Use placement new to initialize each frame in use; the others are parked.
+  // The frames in use are spread over the NUMA partitions.
+  parked.reset(new std::atomic<bool>[page_count]);
+  parked_latches.reset(new uint64_t[page_count]());
+  for (uint32_t p = 0; p < partitions.GetCount(); ++p) {
+    const uint32_t in_use = partitions.Begin(p) + partitions.Share(p, capacity);
+    for (uint32_t i = partitions.Begin(p); i < partitions.End(p); ++i) {
+      parked[i].store(i >= in_use, std::memory_order_relaxed);
+      if (i < in_use) {
+        new (&page_frames[i]) Page();
+      }
+    }
+  }
+  if (partitions.GetCount() > 1) {
+    policy = std::make_unique<PartitionedPolicy>(partitions);
+  } else {
+    policy = EvictionPolicy::Make(page_count);
+  }
+  parked_frames.resize(partitions.GetCount());
+  for (uint32_t i = page_count; i-- > 0;) {
+    if (IsParked(i)) {
+      policy->Withdraw(i);
+      parked_frames[partitions.Of(i)].push_back(i);
+    }
+  }
+  policy->SetCapacity(capacity);
+  files.reset(new std::atomic<FileEntry *>[kMaxFiles]);
+  for (size_t i = 0; i < kMaxFiles; ++i) {
+    files[i].store(nullptr, std::memory_order_relaxed);
+  }
+  swip_owners.reset(new std::atomic<uint32_t>[page_count]);
   for (uint32_t i = 0; i < page_count; ++i) {
-    new (&page_frames[i]) Page();
+    swip_owners[i].store(kNoOwner, std::memory_order_relaxed);
   }
 
-  this->page_cur = 0;
+#if defined(IO_URING)
+  // Page frames are written back from in place, register them as fixed buffers.
+  // Registering pins the memory, so resizable pools do not.
+  if (UringEngine::Enabled() && !resizable) {
+    UringEngine::RegisterBuffers(page_frames, sizeof(Page) * page_count);
+  }
+#endif
 }
 
 void BufferManager::Finalize() {
-  // Flush all dirty pages.
+  if (!page_frames) {
+    return;
+  }
+  if (cleaner.joinable()) {
+    cleaner_stop = true;
+    cleaner.join();
+  }
+
+  // Flush the dirty pages of every file still registered. Nothing runs
+  // concurrently any more.
+  for (auto &entry : file_entries) {
+    if (!entry->closing.load(std::memory_order_relaxed)) {
+      WriteBack(entry->file->GetId(), *entry);
+    }
+  }
+
+  BufferStats stats = GetStats();
+  LOG(INFO) << "Buffer pool (" << policy->Name() << ", " << GetCapacity() << " pages): hits=" << stats.hits
+            << " misses=" << stats.misses << " evictions=" << stats.evictions
+            << " hit ratio=" << stats.HitRatio();
+  LOG_IF(INFO, partitions.GetCount() > 1) << "Buffer pool NUMA partitions: " << partitions.GetCount()
+                                          << ", remote hits=" << stats.remote_hits;
+
+#if defined(IO_URING)
+  if (UringEngine::Enabled() && !resizable) {
+    UringEngine::UnregisterBuffers(page_frames, sizeof(Page) * page_count);
+  }
+#endif
   for (uint32_t i = 0; i < page_count; ++i) {
-    if (page_frames[i].IsDirty()) {
-      PageId pid = page_frames[i].GetPageId();
-      bool success = file->flush(pid.GetPageID(), page_frames[i]);
-      LOG_IF(ERROR, !success) << "Can't flush the page while destructing the buffer manager.";
+    if (!IsParked(i)) {
+      page_frames[i].~Page();
     }
-    page_frames[i].~Page();
   }
 
   // Free page frames.
-  std::free(page_frames);
+  HugePages::Unmap(page_frames, sizeof(Page) * page_count, frames_backing);
+  page_frames = nullptr;
 }
 
 Page* BufferManager::PinPage(PageId page_id, uint16_t page_mode) {
@@ -43,70 +120,618 @@ Page* BufferManager::PinPage(PageId page_id, uint16_t page_mode) {
     return nullptr;
   }
 
+  Shard &shard = GetShard(page_id);
   Page* page_frame = nullptr;
-  auto it = page_table.find(page_id.GetValue());
-  
+
   // Check if the page already exists in the buffer pool (using the PageID - Page* mapping). 
-  // If so, return it.
-  if (it != page_table.end()) {
-    page_frame = it->second;
-    page_frame->SetUsed(page_mode);
+  // If so, pin and return it. Pins are taken under the shard latch, so a frame
+  // cannot be evicted between the lookup and the pin.
+  {
+    std::lock_guard<std::mutex> guard(shard.latch);
+    auto it = shard.page_table.find(page_id.GetValue());
+    if (it != shard.page_table.end()) {
+      page_frame = it->second;
+      page_frame->IncPinCount();
+      shard.hits.fetch_add(1, std::memory_order_relaxed);
+    } else {
+      shard.misses.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+  if (page_frame) {
+    if (partitions.GetCount() > 1 && partitions.Of(GetFrameIndex(page_frame)) != partitions.Local()) {
+      shard.remote_hits.fetch_add(1, std::memory_order_relaxed);
+    }
+    policy->Access(GetFrameIndex(page_frame), page_mode);
+    // Wait for the thread that is reading the page in.
+    while (page_frame->IsLoading()) {
+      std::this_thread::yield();
+    }
     return page_frame;
   }
 
-  // If not, find a free page frame [p] using CLOCK algorithm and
+  // If not, find a free page frame [p] using the eviction policy and
   // setup the PageID - [p] mapping
-next_page:
-  page_frame = &page_frames[page_cur];
-
-  // If the page frame is recently used, set it unused.
-  if (page_frame->IsUsed()) {
-    page_frame->SetIdle();
-    page_cur = (++page_cur >= page_count) ? 0 : page_cur;
-    goto next_page;
+  ghosts.Missed(page_id.GetValue());
+  FileEntry *entry = GetFile(page_id.GetFileID());
+  if (!entry) {
+    LOG(ERROR) << "The file is not registered.";
+    return nullptr;
   }
+  Page *victim = EvictFrame();
 
-  // If the page frame is dirty, flush the page inside before loading a new page.
-  if (page_frame->IsDirty()) {
-    PageId pid = page_frame->GetPageId();
-    if (pid.GetFileID() != fid) {
-      LOG(ERROR) << "The file is not registered.";
-      return nullptr;
+  {
+    std::lock_guard<std::mutex> guard(shard.latch);
+    auto [it, inserted] = shard.page_table.try_emplace(page_id.GetValue(), victim);
+    page_frame = it->second;
+    if (inserted) {
+      // Publish the mapping before the read, so that concurrent misses on the
+      // same page wait for this load instead of reading their own copy.
+      page_frame->page_id = page_id;
+      page_frame->SetLoading(true);
+    } else {
+      // Another thread brought the page in meanwhile; give the victim back.
+      victim->latch.WriteUnlock();
+      victim->DecPinCount();
+      page_frame->IncPinCount();
     }
-    bool success = file->flush(pid.GetPageID(), *page_frame);
-    LOG_IF(ERROR, !success) << "Can't flush the dirty page evicted from the LRU queue.";
   }
-
-  // Update the PageId - page frame mapping.
-  page_table.erase(page_frame->GetPageId().GetValue());
-
-  // Load the page into the page frame from storage
-  if (page_id.GetFileID() != fid) {
-    LOG(ERROR) << "The file is not registered.";
-    return nullptr;
+  if (page_frame != victim) {
+    policy->Free(GetFrameIndex(victim));
+    policy->Access(GetFrameIndex(page_frame), page_mode);
+    while (page_frame->IsLoading()) {
+      std::this_thread::yield();
+    }
+    return page_frame;
   }
 
-  if (!file->load(page_id.GetPageID(), *page_frame)) {
-    LOG(ERROR) << "Can't load the page into the page frame.";
-    return nullptr;
-  }
+  policy->Admit(GetFrameIndex(page_frame), page_id.GetValue(), page_mode);
+
+  // Load the page into the page frame from storage. Loading goes through a
+  // bounce buffer because reading straight into the frame would also overwrite
+  // its header (pin count, reference count, flags), which other threads may
+  // inspect at any time.
+  thread_local Page bounce;
+  CHECK(entry->file->load(page_id.GetPageID(), bounce)) << "Can't load the page into the page frame.";
+  std::memcpy(page_frame->GetRealPage(), bounce.GetRealPage(), sizeof(bounce.page_data));
 
   // Update the page frame metadata.
-  page_frame->page_id = page_id;
-  page_frame->SetUsed(page_mode);
   page_frame->SetDirty(false);
-  page_table.try_emplace(page_id.GetValue(), page_frame);
+  page_frame->latch.WriteUnlock();
+  page_frame->SetLoading(false);
+  return page_frame;
+}
 
+Page *BufferManager::PinResident(PageId page_id) {
+  Shard &shard = GetShard(page_id);
+  Page *page_frame = nullptr;
+  {
+    std::lock_guard<std::mutex> guard(shard.latch);
+    auto it = shard.page_table.find(page_id.GetValue());
+    if (it == shard.page_table.end()) {
+      return nullptr;
+    }
+    page_frame = it->second;
+    page_frame->IncPinCount();
+  }
+  while (page_frame->IsLoading()) {
+    std::this_thread::yield();
+  }
   return page_frame;
 }
 
+Page *BufferManager::EvictFrame(bool wait) {
+  // Take a frame exclusively if nobody uses it. The write latch makes
+  // optimistic readers of the old page restart, and keeps writers that reach
+  // the page through a swip out. The file of the page is referenced until the
+  // page is gone.
+  FileEntry *entry = nullptr;
+  auto claim = [this, &entry](uint32_t index) {
+    Page *page_frame = &page_frames[index];
+    if (IsParked(index) || page_frame->GetPinCount() > 0) {
+      return false;
+    }
+    PageId pid = page_frame->GetPageId();
+    entry = nullptr;
+    if (pid.IsValid() && !(entry = AcquireFile(pid))) {
+      return false;
+    }
+    if (!page_frame->TryPinUnused()) {
+      ReleaseFile(entry);
+      return false;
+    }
+    if (IsParked(index)) {  // Parked after the check above
+      page_frame->DecPinCount();
+      ReleaseFile(entry);
+      return false;
+    }
+    bool need_restart = false;
+    page_frame->latch.WriteLockOrRestart(need_restart);
+    if (need_restart) {
+      page_frame->DecPinCount();
+      ReleaseFile(entry);
+      return false;
+    }
+    // The frame may have been given another page since pid was read.
+    if (page_frame->GetPageId().GetValue() != pid.GetValue() ||
+        (entry && entry->swizzler && !entry->swizzler->Unswizzle(page_frame))) {
+      page_frame->latch.WriteUnlock();
+      page_frame->DecPinCount();
+      ReleaseFile(entry);
+      return false;
+    }
+    return true;
+  };
+
+  // The policy offers every frame once per round, and a used frame is passed
+  // over at most PAGE_READ times by CLOCK; give up if all frames stay pinned
+  // for much longer.
+  const uint64_t max_rounds = uint64_t{PAGE_READ + 1} * 1024;
+  for (uint64_t rounds = 0;;) {
+    uint32_t index = policy->Victim(claim);
+    if (index == EvictionPolicy::kNoFrame) {
+      if (!wait) {
+        return nullptr;
+      }
+      LOG_IF(FATAL, ++rounds > max_rounds) << "All " << GetCapacity() << " buffer pages are pinned.";
+      std::this_thread::yield();
+      continue;
+    }
+    Page *page_frame = &page_frames[index];
+
+    PageId pid = page_frame->GetPageId();
+    if (!pid.IsValid()) {  // Free frame
+      return page_frame;
+    }
+
+    // If the page frame is dirty, flush the page inside before loading a new
+    // page. The page stays mapped while it is written, so that no other thread
+    // can read a stale copy from storage.
+    if (page_frame->IsDirty()) {
+      page_frame->SetWriting(true);
+      page_frame->SetDirty(false);
+      FlushLogFor(entry->wal, std::initializer_list<std::pair<long, Page *>>{{pid.GetPageID(), page_frame}});
+      bool success = entry->file->flush(pid.GetPageID(), *page_frame);
+      LOG_IF(ERROR, !success) << "Can't flush the dirty page evicted by the buffer manager.";
+      page_frame->SetWriting(false);
+    }
+
+    // Update the PageId - page frame mapping, unless somebody pinned or
+    // dirtied the page while it was being written, or swizzled it again.
+    // Swizzling takes a pin, which is only released after the owner is set.
+    {
+      Shard &shard = GetShard(pid);
+      std::lock_guard<std::mutex> guard(shard.latch);
+      if (page_frame->GetPinCount() != 1 || page_frame->IsDirty() || GetSwipOwner(page_frame)) {
+        page_frame->latch.WriteUnlock();
+        page_frame->DecPinCount();
+        ReleaseFile(entry);
+        continue;
+      }
+      shard.page_table.erase(pid.GetValue());
+      shard.evictions.fetch_add(1, std::memory_order_relaxed);
+      page_frame->page_id = PageId();
+    }
+    ReleaseFile(entry);
+    ghosts.Evicted(pid.GetValue());
+    policy->Evicted(index);
+    return page_frame;
+  }
+}
+
 void BufferManager::UnpinPage(Page *page) {
+  page->DecPinCount();
+}
+
+void BufferManager::Prefetch(const std::vector<PageId> &page_ids) {
+  thread_local std::vector<Page *> frames;
+  thread_local std::vector<std::pair<long, Page *>> batch;
+  thread_local std::unique_ptr<Page[]> bounce;
+  if (!bounce) {
+    bounce.reset(new Page[kMaxPrefetch]);
+  }
+  frames.clear();
+  batch.clear();
+
+  // All pages are read from the file of the first one.
+  FileEntry *entry = nullptr;
+  fileid_t fid = 0;
+  for (PageId page_id : page_ids) {
+    if (frames.size() == max_prefetch) {
+      break;
+    }
+    if (!page_id.IsValid() || (entry && page_id.GetFileID() != fid)) {
+      continue;
+    }
+    if (!entry) {
+      fid = page_id.GetFileID();
+      if (!(entry = GetFile(fid))) {
+        return;
+      }
+    }
+    Shard &shard = GetShard(page_id);
+    {
+      std::lock_guard<std::mutex> guard(shard.latch);
+      if (shard.page_table.find(page_id.GetValue()) != shard.page_table.end()) {
+        continue;
+      }
+    }
+    // Claim a frame and publish the mapping with the loading flag set, as
+    // PinPage does, so that threads asking for the page wait for the batch.
+    Page *victim = EvictFrame();
+    std::lock_guard<std::mutex> guard(shard.latch);
+    auto [it, inserted] = shard.page_table.try_emplace(page_id.GetValue(), victim);
+    if (!inserted) {
+      victim->latch.WriteUnlock();
+      victim->DecPinCount();
+      policy->Free(GetFrameIndex(victim));
+      continue;
+    }
+    victim->page_id = page_id;
+    victim->SetLoading(true);
+    policy->Admit(GetFrameIndex(victim), page_id.GetValue(), PAGE_READ);
+    batch.emplace_back(page_id.GetPageID(), &bounce[frames.size()]);
+    frames.push_back(victim);
+  }
+  if (frames.empty()) {
+    return;
+  }
 
+  CHECK(entry->file->load_batch(batch)) << "Can't prefetch pages into the buffer pool.";
+  for (size_t i = 0; i < frames.size(); ++i) {
+    std::memcpy(frames[i]->GetRealPage(), batch[i].second->GetRealPage(), sizeof(Page::page_data));
+    frames[i]->SetDirty(false);
+    frames[i]->latch.WriteUnlock();
+    frames[i]->SetLoading(false);
+    frames[i]->DecPinCount();
+  }
 }
 
-void BufferManager::RegisterFile(File *file) {
+BufferStats BufferManager::GetStats() const {
+  BufferStats stats;
+  for (auto &shard : shards) {
+    stats.hits += shard.hits.load(std::memory_order_relaxed);
+    stats.misses += shard.misses.load(std::memory_order_relaxed);
+    stats.evictions += shard.evictions.load(std::memory_order_relaxed);
+    stats.remote_hits += shard.remote_hits.load(std::memory_order_relaxed);
+  }
+  return stats;
+}
+
+void BufferManager::RegisterFile(File *file, Wal *wal, Swizzler *swizzler) {
   assert(file);
-  this->file = file;
-  this->fid = file->GetId();
+  std::lock_guard<std::mutex> guard(files_latch);
+  const fileid_t fid = file->GetId();
+  FileEntry *entry = files[fid].load(std::memory_order_relaxed);
+  if (!entry) {
+    entry = file_entries.emplace_back(new FileEntry).get();
+    files[fid].store(entry, std::memory_order_release);
+  }
+  CHECK(entry->closing.load()) << "File ID " << fid << " is registered already.";
+  entry->file = file;
+  entry->wal = wal;
+  entry->swizzler = swizzler;
+  entry->closing.store(false);
+  if (page_count > 0 && !cleaner.joinable()) {
+    cleaner = std::thread(&BufferManager::CleanerLoop, this);
+  }
+}
+
+void BufferManager::UnregisterFile(File *file) {
+  std::lock_guard<std::mutex> guard(files_latch);
+  const fileid_t fid = file->GetId();
+  FileEntry *entry = files[fid].load(std::memory_order_relaxed);
+  CHECK(entry && !entry->closing.load() && entry->file == file) << "The file is not registered.";
+
+  // Keep eviction and the cleaner away from the file's frames, and wait for
+  // those that are working on one.
+  entry->closing.store(true);
+  while (entry->users.load() > 0) {
+    std::this_thread::yield();
+  }
+  WriteBack(fid, *entry);
+
+  // Give the frames back. Each is pinned while its page is dropped, so that
+  // it is not claimed before the policy forgot the page.
+  std::lock_guard<std::mutex> resize_guard(resize_latch);
+  for (uint32_t i = 0; i < page_count; ++i) {
+    Page *page_frame = &page_frames[i];
+    if (IsParked(i)) {
+      continue;
+    }
+    PageId pid = page_frame->GetPageId();
+    if (!pid.IsValid() || pid.GetFileID() != fid) {
+      continue;
+    }
+    page_frame->IncPinCount();
+    {
+      Shard &shard = GetShard(pid);
+      std::lock_guard<std::mutex> shard_guard(shard.latch);
+      shard.page_table.erase(pid.GetValue());
+      page_frame->page_id = PageId();
+    }
+    page_frame->SetDirty(false);
+    swip_owners[i].store(kNoOwner, std::memory_order_relaxed);
+    policy->Free(i);
+    page_frame->ResetPinCount();
+  }
+}
+
+void BufferManager::WriteBack(fileid_t fid, FileEntry &entry) {
+  std::vector<std::pair<long, Page *>> dirty_pages;
+  for (uint32_t i = 0; i < page_count; ++i) {
+    if (IsParked(i)) {
+      continue;
+    }
+    PageId pid = page_frames[i].GetPageId();
+    if (pid.IsValid() && pid.GetFileID() == fid && page_frames[i].IsDirty()) {
+      if (entry.swizzler) {
+        entry.swizzler->UnswizzleCopy(page_frames[i].GetRealPage());
+      }
+      page_frames[i].SetDirty(false);
+      dirty_pages.emplace_back(pid.GetPageID(), &page_frames[i]);
+    }
+  }
+  FlushLogFor(entry.wal, dirty_pages);
+  bool success = entry.file->flush_batch(dirty_pages);
+  LOG_IF(ERROR, !success) << "Can't flush the pages of a file leaving the buffer pool.";
+}
+
+void BufferManager::CleanerLoop() {
+  while (!cleaner_stop.load(std::memory_order_relaxed)) {
+    if (CleanBatch() == 0) {
+      std::this_thread::sleep_for(std::chrono::microseconds(500));
+    }
+  }
+}
+
+size_t BufferManager::CleanBatch() {
+  // A page to write back, with the file of the page referenced.
+  struct Item {
+    FileEntry *entry;
+    Page *frame;
+    Page *copy;
+  };
+  thread_local std::vector<Item> items;
+  thread_local std::vector<std::pair<long, Page *>> batch;
+  thread_local std::unique_ptr<Page[]> copies;
+  thread_local std::vector<uint32_t> upcoming;
+  if (!copies) {
+    copies.reset(new Page[kMaxCleanBatch]);
+  }
+  items.clear();
+  upcoming.clear();
+
+  policy->Upcoming(clean_target, upcoming);
+  for (uint32_t index : upcoming) {
+    if (items.size() == kMaxCleanBatch) {
+      break;
+    }
+    Page *page_frame = &page_frames[index];
+    if (IsParked(index) || !page_frame->IsDirty() || page_frame->GetPinCount() > 0) {
+      continue;
+    }
+    PageId pid = page_frame->GetPageId();
+    FileEntry *entry = pid.IsValid() ? AcquireFile(pid) : nullptr;
+    if (!entry) {
+      continue;
+    }
+    // Pin the frame so that it is not evicted while being written. Threads
+    // that reach the page through a swip may still change it, so a copy is
+    // written. Latched pages are left for a later round: the cleaner must not
+    // wait for a writer that may itself wait for a frame.
+    if (!page_frame->TryPinUnused()) {
+      ReleaseFile(entry);
+      continue;
+    }
+    if (IsParked(index) || page_frame->IsLoading() || page_frame->GetPageId().GetValue() != pid.GetValue()) {
+      page_frame->DecPinCount();
+      ReleaseFile(entry);
+      continue;
+    }
+    page_frame->SetWriting(true);
+    Page *copy = &copies[items.size()];
+    if (!CopyForWrite(page_frame, *copy, false, entry->swizzler)) {
+      page_frame->SetWriting(false);
+      page_frame->DecPinCount();
+      ReleaseFile(entry);
+      continue;
+    }
+    items.push_back({entry, page_frame, copy});
+  }
+
+  // One batch per file.
+  std::sort(items.begin(), items.end(), [](const Item &a, const Item &b) { return a.entry < b.entry; });
+  for (auto first = items.begin(); first != items.end();) {
+    auto last = std::find_if(first, items.end(), [&](const Item &i) { return i.entry != first->entry; });
+    batch.clear();
+    for (auto it = first; it != last; ++it) {
+      batch.emplace_back(it->frame->GetPageId().GetPageID(), it->copy);
+    }
+    FlushLogFor(first->entry->wal, batch);
+    bool success = first->entry->file->flush_batch(batch);
+    LOG_IF(ERROR, !success) << "Background write-back failed.";
+    for (auto it = first; it != last; ++it) {
+      if (!success) it->frame->SetDirty(true);
+      it->frame->SetWriting(false);
+      it->frame->DecPinCount();
+      ReleaseFile(it->entry);
+    }
+    first = last;
+  }
+  return items.size();
+}
+
+bool BufferManager::CopyForWrite(Page *frame, Page &copy, bool wait, Swizzler *swizzler) {
+  bool need_restart;
+  do {
+    need_restart = false;
+    uint64_t version = frame->latch.ReadLockOrRestart(need_restart);
+    if (need_restart) {
+      if (!wait) {
+        return false;
+      }
+      std::this_thread::yield();
+      continue;
+    }
+    if (!frame->IsDirty()) {
+      return false;
+    }
+    // Clear the dirty flag before copying, so that a change after the copy
+    // marks the page dirty again. Swips are translated before validating, as
+    // the pages they point to may be evicted once the frame changes.
+    frame->SetDirty(false);
+    std::memcpy(copy.GetRealPage(), frame->GetRealPage(), sizeof(Page::page_data));
+    if (swizzler) {
+      swizzler->UnswizzleCopy(copy.GetRealPage());
+    }
+    frame->latch.ReadUnlockOrRestart(version, need_restart);
+    if (need_restart) {
+      frame->SetDirty(true);
+    }
+  } while (need_restart);
+  return true;
 }
 
+lsn_t BufferManager::Checkpoint(File *file) {
+  const fileid_t fid = file->GetId();
+  FileEntry *entry = GetFile(fid);
+  CHECK(entry && entry->file == file) << "The file is not registered.";
+  Wal *wal = entry->wal;
+
+  // Every change logged up to here was made under the page's write latch, and
+  // the page was marked dirty before the latch was released. So a page that is
+  // neither dirty nor latched below holds no such change that is not on disk.
+  lsn_t checkpoint_lsn = wal ? wal->CurrentLsn() : 0;
+
+  std::vector<std::pair<long, Page *>> batch;
+  std::vector<Page *> frames;
+  std::unique_ptr<Page[]> copies(new Page[checkpoint_batch]);
+  auto write_batch = [&] {
+    if (batch.empty()) {
+      return;
+    }
+    FlushLogFor(wal, batch);
+    bool success = file->flush_batch(batch);
+    LOG_IF(ERROR, !success) << "Checkpoint write-back failed.";
+    for (Page *page_frame : frames) {
+      if (!success) page_frame->SetDirty(true);
+      page_frame->DecPinCount();
+    }
+    batch.clear();
+    frames.clear();
+  };
+
+  for (uint32_t i = 0; i < page_count; ++i) {
+    Page *page_frame = &page_frames[i];
+    if (IsParked(i)) {
+      continue;
+    }
+    PageId pid = page_frame->GetPageId();
+    if (!pid.IsValid() || pid.GetFileID() != fid ||
+        (!page_frame->IsDirty() && !page_frame->IsWriting() && !page_frame->latch.IsLocked())) {
+      continue;
+    }
+    // The pin keeps the page in its frame, and keeps the cleaner and eviction
+    // from writing it, until the copy is written.
+    page_frame = PinResident(pid);
+    if (!page_frame) {
+      continue;  // Evicted meanwhile, and written back if it was dirty
+    }
+
+    // A write-back by the cleaner or by eviction may still be under way. Wait
+    // for it, so that the sync below covers it, and so that its older copy
+    // does not reach the disk after the copy taken here. Our pin keeps new
+    // write-backs from starting.
+    while (page_frame->IsWriting()) {
+      std::this_thread::yield();
+    }
+    if (!CopyForWrite(page_frame, copies[batch.size()], true, entry->swizzler)) {
+      page_frame->DecPinCount();
+      continue;
+    }
+
+    batch.emplace_back(pid.GetPageID(), &copies[batch.size()]);
+    frames.push_back(page_frame);
+    if (batch.size() == checkpoint_batch) {
+      write_batch();
+    }
+  }
+  write_batch();
+  // Pages evicted during the checkpoint were written without a sync.
+  file->sync();
+  return checkpoint_lsn;
+}
+
+void BufferManager::SetCapacity(uint32_t capacity) {
+  CHECK(resizable) << "The buffer pool has a fixed size.";
+  capacity = std::clamp<uint32_t>(capacity, 1, page_count);
+  std::lock_guard<std::mutex> guard(resize_latch);
+  // Discarding a frame's memory requires frames to cover whole OS pages.
+  const bool can_discard = sizeof(Page) % sysconf(_SC_PAGESIZE) == 0 && HugePages::CanDiscard(frames_backing);
+
+  // The NUMA partitions keep frames in use in proportion to their sizes: a
+  // shrink takes the frames of the partition with the most in use first, a
+  // grow gives frames to the one with the fewest.
+  auto in_use = [this](uint32_t p) {
+    return uint64_t{partitions.Size(p) - static_cast<uint32_t>(parked_frames[p].size())} * page_count /
+           partitions.Size(p);
+  };
+
+  uint32_t current = GetCapacity();
+  // Shrink: evict the pages of frames nobody uses and park the frames. The
+  // frame stays pinned and latched until its memory is gone.
+  for (; current > capacity; --current) {
+    uint32_t fullest = 0;
+    for (uint32_t p = 1; p < partitions.GetCount(); ++p) {
+      if (in_use(p) > in_use(fullest)) fullest = p;
+    }
+    Page *page_frame;
+    {
+      NumaPartitions::LocalScope scope(fullest);
+      page_frame = EvictFrame(false);
+    }
+    if (!page_frame) {
+      break;
+    }
+    uint32_t index = GetFrameIndex(page_frame);
+    parked[index].store(true);
+    policy->Withdraw(index);
+    // Discarding the memory clears the latch. Readers may still validate
+    // against its version, so it must go on from there when the frame is used
+    // again.
+    parked_latches[index] = page_frame->latch.Save();
+    if (can_discard) {
+      madvise(page_frame, sizeof(Page), MADV_DONTNEED);
+    }
+    parked_frames[partitions.Of(index)].push_back(index);
+  }
+  // Grow: turn parked frames back into free frames. A thread the CLOCK hand
+  // offered the frame to before it was parked may still hold a pin on it for
+  // a moment.
+  for (; current < capacity; ++current) {
+    uint32_t emptiest = partitions.GetCount();
+    for (uint32_t p = 0; p < partitions.GetCount(); ++p) {
+      if (!parked_frames[p].empty() && (emptiest == partitions.GetCount() || in_use(p) < in_use(emptiest))) {
+        emptiest = p;
+      }
+    }
+    uint32_t index = parked_frames[emptiest].back();
+    parked_frames[emptiest].pop_back();
+    Page *page_frame = &page_frames[index];
+    while (!page_frame->TryPinUnused()) {
+      std::this_thread::yield();
+    }
+    page_frame->page_id = PageId();
+    page_frame->latch.Restore(parked_latches[index]);
+    page_frame->last_used.store(0, std::memory_order_relaxed);
+    page_frame->SetDirty(false);
+    page_frame->SetLoading(false);
+    page_frame->SetWriting(false);
+    swip_owners[index].store(kNoOwner, std::memory_order_relaxed);
+    parked[index].store(false);
+    policy->Free(index);
+    page_frame->DecPinCount();
+  }
+  this->capacity.store(current, std::memory_order_relaxed);
+  policy->SetCapacity(current);
+}
@@ -3,34 +3,60 @@
 #define B_TREE_BUFFER_H
 
 #include <algorithm>
+#include <atomic>
 #include <list>
 #include <memory>
 #include <map>
 #include <unordered_map>
 #include <mutex>
+#include <thread>
+#include <vector>
 
 #include "file.h"
+#include "wal.h"
+#include "../include/eviction_policy.hpp"
+#include "../include/huge_pages.hpp"
+#include "../include/memory_broker.hpp"
+#include "../include/numa_partitions.hpp"
 #include "../include/types.hpp"
 #include "absl/container/flat_hash_map.h"
 
-struct LRUNode {
-	pagenum_t page_frame_id;
-	LRUNode * next;
-	LRUNode * pre;
-};
-
-struct LRUQueue {
-	LRUNode * front;
-	LRUNode * back;
+// Hooks of a buffer pool user that refers to resident pages by their frame
+// index from inside other pages (pointer swizzling, see Btree).
+class Swizzler {
+ public:
+  virtual ~Swizzler() = default;
+  // Remove the references to the page in frame, which is about to be evicted.
+  // The frame is exclusively pinned and write-latched. Returns false if the
+  // page has to stay in the pool for now.
+  virtual bool Unswizzle(Page *frame) = 0;
+  // Turn the references in page_data, a copy of a page about to be written,
+  // back into page numbers.
+  virtual void UnswizzleCopy(char *page_data) = 0;
 };
 
-class BufferManager {
+// A buffer pool may cache the pages of any number of files, keyed by PageId
+// (file ID and page number), so that several trees, e.g., one per thread,
+// draw their frames from one page budget.
+//
+// With NumaPartitions enabled, the frames are split into one partition per
+// NUMA node, and misses take frames of the local node first.
+//
+// A pool may also be resizable (see ResizablePool): it reserves address space
+// for page_count frames, and only uses as many as its current capacity. The
+// memory of the frames out of use is given back to the OS, unless the frames
+// are hugetlbfs pages.
+class BufferManager : public ResizablePool {
  public:
   // Buffer manager constructor
   // @page_count: number of pages in the buffer pool
-  explicit BufferManager(pagenum_t page_count);
-  ~BufferManager() = default;
+  // @capacity: frames in use at first if the pool is resizable, 0 for a pool
+  // of fixed size
+  // Frames are replaced by the policy selected with EvictionPolicy::SetDefault.
+  explicit BufferManager(pagenum_t page_count, pagenum_t capacity = 0);
+  ~BufferManager() { Finalize(); }
 
+  // Write back the pages of the files still registered and free the pool.
   void Finalize();
 
   // Default constructor: construct a dummy BM
@@ -47,31 +73,227 @@ class BufferManager {
   // @page: Page to unpin
   void UnpinPage(Page *page);
 
-  // Add the file ID - BaseFile* mappings to support multiple tables
-  // @file: pointer to the File object
-  void RegisterFile(File *file);
+  // Take another pin on a page. The caller holds a pin on it, or validates
+  // afterwards that the frame still holds the page (see Btree::position).
+  void RepinPage(Page *page) { page->IncPinCount(); }
+
+  // Read pages into the buffer pool ahead of use (readahead) without pinning
+  // them. Resident pages are skipped; the misses are read with one batch.
+  // Neither counts as a hit or a miss.
+  // @page_ids: IDs of the pages to read, best in ascending order
+  void Prefetch(const std::vector<PageId> &page_ids);
+
+  // Cache the pages of file in the pool. Also starts the background cleaner.
+  // @file: pointer to the File object; its ID must not be registered
+  // @wal: log of the file's pages, nullptr if they are not logged. Before a
+  // dirty page is written back, the log is flushed up to the page's LSN, which
+  // pages of a logged file keep in their first bytes.
+  // @swizzler: hooks of the file's user if it swizzles references, see below
+  void RegisterFile(File *file, Wal *wal = nullptr, Swizzler *swizzler = nullptr);
+
+  // Write back the dirty pages of file and drop its pages from the pool, so
+  // that their frames go to the other files. Nobody may use the pages any
+  // more; pins still held on them (e.g., by pinned inner nodes) are dropped.
+  void UnregisterFile(File *file);
+
+  // Fuzzy checkpoint: write back every page that is dirty when the checkpoint
+  // starts while other threads go on reading and changing pages. A page is
+  // copied under its optimistic latch and the copy is written, so the frame is
+  // never written while it is being changed. Pages changed after the copy stay
+  // dirty. When Checkpoint returns, every page change logged up to the returned
+  // LSN is on disk (0 without a log). Only the pages of file are written.
+  lsn_t Checkpoint(File *file);
+
+  // Pointer swizzling. A page may refer to a resident page of the same file by
+  // its frame index (a swip) while the frame keeps the page. The frame of the
+  // page holding the swip is its owner. A frame is write-latched from eviction
+  // until it holds its next page, so optimistic readers that reach it through
+  // a stale swip always fail validation, and it is only evicted once the
+  // swizzler of its file removed the swip. Pages are written back from copies
+  // passed through the swizzler.
+  uint32_t GetFrameIndex(const Page *frame) const { return frame - page_frames; }
+  Page *GetFrame(uint32_t index) const { return &page_frames[index]; }
+  uint32_t GetFrameCount() const { return page_count; }
+  // The frame of a page, given its page data.
+  Page *FrameOf(const void *page_data) const {
+    return &page_frames[(static_cast<const char *>(page_data) - reinterpret_cast<const char *>(page_frames)) / sizeof(Page)];
+  }
+  // Counters of the pins since the pool was created. Pages reached through
+  // swips do not go through the pool and are not counted.
+  BufferStats GetStats() const override;
+  const char *GetPolicyName() const { return policy->Name(); }
+
+  // ResizablePool. Shrinking evicts pages, and stops early if the frames left
+  // are pinned.
+  uint32_t GetMaxCapacity() const override { return page_count; }
+  uint32_t GetCapacity() const override { return capacity.load(std::memory_order_relaxed); }
+  void SetCapacity(uint32_t capacity) override;
+  GhostCache &GetGhostCache() override { return ghosts; }
+
+  Page *GetSwipOwner(const Page *frame) const {
+    uint32_t owner = swip_owners[GetFrameIndex(frame)].load(std::memory_order_acquire);
+    return owner == kNoOwner ? nullptr : &page_frames[owner];
+  }
+  void SetSwipOwner(const Page *frame, const Page *owner) {
+    swip_owners[GetFrameIndex(frame)].store(owner ? GetFrameIndex(owner) : kNoOwner, std::memory_order_release);
+  }
 
  private:
-  // File ID - BaseFile* mapping
-  // std::map<uint16_t, File*> file_map;
+  // Background write-back. The cleaner writes back dirty pages in the frames
+  // the eviction policy is about to offer, so that eviction finds clean victims
+  // and foreground threads rarely write. Each round is one sorted, vectored batch
+  // followed by a single fsync.
+  void CleanerLoop();
+  size_t CleanBatch();
+  // Upper bound of the pages the cleaner writes in one batch.
+  static constexpr uint32_t kMaxCleanBatch = 64;
+
+  // Copy the page in frame for writing it back and clear its dirty flag. The
+  // copy is taken under the frame's optimistic latch and retried if the page
+  // changes meanwhile; a change after it marks the page dirty again. Swips in
+  // the copy are turned back into page numbers. Returns false if the page is
+  // not dirty, or if it is latched and !wait.
+  bool CopyForWrite(Page *frame, Page &copy, bool wait, Swizzler *swizzler);
 
-  // The file that this buffer manager works on.
-  File *file;
+  // Upper bound of the pages a single Prefetch call reads. Prefetched frames
+  // stay pinned until the batch completes, so this is kept small relative to
+  // the pool.
+  static constexpr uint32_t kMaxPrefetch = 64;
+  uint32_t max_prefetch;
 
-  // FID of the file that this buffer manager works on.
-  fileid_t fid;
+  // Upper bound of the pages a checkpoint writes in one batch. Their frames
+  // stay pinned until the batch is written.
+  static constexpr uint32_t kMaxCheckpointBatch = 64;
+  uint32_t checkpoint_batch;
 
-  // Page ID (file-local) - Page frame mapping
-  absl::flat_hash_map<pageid_t, Page*> page_table;
+  // Number of frames ahead of eviction the cleaner keeps clean.
+  uint32_t clean_target;
+  std::thread cleaner;
+  std::atomic<bool> cleaner_stop{false};
+
+  // A registered file. Eviction and the cleaner work on frames of any file,
+  // outside the pins of the file's users: they take a reference on the file
+  // of a frame's page first (AcquireFile), and UnregisterFile waits for those
+  // references to go away. Entries are kept, and reused when a file with the
+  // same ID is registered, until the pool is freed, so that a thread may look
+  // at the entry of a page it found in a frame at any time.
+  struct FileEntry {
+    File *file{nullptr};
+    Wal *wal{nullptr};
+    Swizzler *swizzler{nullptr};
+    std::atomic<bool> closing{true};  // Not registered (any more)
+    std::atomic<uint32_t> users{0};
+  };
+  static constexpr size_t kMaxFiles = size_t{1} << (8 * sizeof(fileid_t));
+  // Entry of each file ID, nullptr if none was ever registered
+  std::unique_ptr<std::atomic<FileEntry *>[]> files;
+  std::vector<std::unique_ptr<FileEntry>> file_entries;
+  std::mutex files_latch;  // Protects file_entries and (un)registering
+
+  // The entry of a registered file, nullptr if the file is not registered.
+  // For users of the file's pages, which keep it registered.
+  FileEntry *GetFile(fileid_t fid) const {
+    FileEntry *entry = files[fid].load(std::memory_order_acquire);
+    return entry && !entry->closing.load(std::memory_order_acquire) ? entry : nullptr;
+  }
+  // Take a reference on the file of page_id, see FileEntry. Returns nullptr
+  // if the file is not registered.
+  FileEntry *AcquireFile(PageId page_id) {
+    FileEntry *entry = files[page_id.GetFileID()].load(std::memory_order_acquire);
+    if (!entry) {
+      return nullptr;
+    }
+    entry->users.fetch_add(1);
+    if (entry->closing.load()) {
+      entry->users.fetch_sub(1);
+      return nullptr;
+    }
+    return entry;
+  }
+  static void ReleaseFile(FileEntry *entry) {
+    if (entry) {
+      entry->users.fetch_sub(1, std::memory_order_release);
+    }
+  }
+
+  // Write back the dirty pages of a file nobody else works on any more, with
+  // the swips in them turned back into page numbers in place.
+  void WriteBack(fileid_t fid, FileEntry &entry);
+
+  static constexpr uint32_t kNoOwner = ~uint32_t{0};
+  // Owner frame of each frame's swip, kNoOwner if the page is not swizzled.
+  std::unique_ptr<std::atomic<uint32_t>[]> swip_owners;
+
+  // Flush wal up to the highest LSN of the pages about to be written.
+  template <class Pages>
+  static void FlushLogFor(Wal *wal, const Pages &pages) {
+    if (!wal) {
+      return;
+    }
+    lsn_t lsn = 0;
+    for (auto &p : pages) {
+      lsn_t page_lsn;
+      std::memcpy(&page_lsn, p.second->GetRealPage(), sizeof(page_lsn));
+      lsn = std::max(lsn, page_lsn);
+    }
+    wal->Flush(lsn);
+  }
+
+  // Number of page table partitions, must be a power of two
+  static constexpr uint32_t kNumShards = 64;
+
+  // A partition of the Page ID (file-local) - Page frame mapping. Each shard
+  // has its own latch so that lookups of different pages do not contend. The
+  // counters of the pages in the shard are updated under the latch.
+  struct alignas(64) Shard {
+    std::mutex latch;
+    absl::flat_hash_map<pageid_t, Page*> page_table;
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> evictions{0};
+    std::atomic<uint64_t> remote_hits{0};
+  };
+  Shard shards[kNumShards];
+
+  inline Shard &GetShard(PageId page_id) {
+    auto h = page_id.GetPageID() ^ (uint32_t{page_id.GetFileID()} * 0x9e3779b9u);
+    return shards[(h ^ (h >> 16)) & (kNumShards - 1)];
+  }
+
+  // Pin the frame of page_id if the page is in the buffer pool.
+  Page *PinResident(PageId page_id);
+
+  // Find a victim frame using the eviction policy, write it back if dirty and
+  // remove it from the page table. Returns the frame pinned exclusively by the caller and
+  // write-latched; the caller releases the latch once the frame holds its next
+  // page. Returns nullptr if !wait and all frames are pinned.
+  Page *EvictFrame(bool wait = true);
 
   // Number of page frames
-  uint32_t page_count;
+  uint32_t page_count{0};
+
+  // Resizing. Frames out of use (parked) are withdrawn from the policy, their
+  // memory is discarded, and their headers are left alone: eviction and the
+  // cleaner check parked again after pinning a frame, since the CLOCK hand may
+  // still offer it. A parked frame is made a clean free frame again when the
+  // pool grows.
+  bool resizable{false};
+  std::atomic<uint32_t> capacity{0};
+  std::unique_ptr<std::atomic<bool>[]> parked;
+  std::unique_ptr<uint64_t[]> parked_latches;  // Latch words of parked frames, see OptLatch::Save
+  std::vector<std::vector<uint32_t>> parked_frames;  // Of each NUMA partition
+  std::mutex resize_latch;  // Protects parked_frames and resizing
+  GhostCache ghosts;
+  bool IsParked(uint32_t index) const { return parked[index].load(std::memory_order_acquire); }
 
-  // An array of buffer pages
-  Page *page_frames;
+  // An array of buffer pages, nullptr once the pool is freed
+  Page *page_frames{nullptr};
+  HugePages::Kind frames_backing{HugePages::Kind::kOff};
+  // Frames of each NUMA node, see NumaPartitions
+  NumaPartitions partitions;
 
-  // Current page frame position
-  uint32_t page_cur;
+  // Picks the frames to evict, by frame index.
+  std::unique_ptr<EvictionPolicy> policy;
 
   // Prevent unintentional copies
   BufferManager(const BufferManager&) = delete;
@@ -7,6 +7,12 @@
 #include <glog/logging.h>
 #include <unistd.h>
 #include <iostream>
+#include <utility>
+#include <vector>
+
+#if defined(IO_URING)
+#include "../include/uring_engine.hpp"
+#endif
 
 extern uint64_t readcount;
 extern uint64_t writecount;
@@ -31,7 +37,7 @@ class File {
     } else {
       fd = open(file_name.data(), openFlags, S_IRUSR | S_IWUSR);
       PCHECK(fd > 0);
-  
+
       FILE *fp = fopen(file_name.data(), "r");
       auto start = fgetc(fp);
       PCHECK(!fclose(fp)); // don't forget to close this file
@@ -41,6 +47,7 @@ class File {
         empty = false;
       }
     }
+    register_fd();
   }
   
   File(const std::string &file_name, bool trunc, long offset_start, size_t access_size): access_size{access_size} {
@@ -53,9 +60,14 @@ class File {
     PCHECK(fd > 0);
 
     empty = true;
+    register_fd();
   }
 
   ~File(){
+    PCHECK(fsync(fd) == 0);
+#if defined(IO_URING)
+    if (UringEngine::Enabled()) UringEngine::UnregisterFile(fd);
+#endif
     PCHECK(close(fd) == 0);
   }
 
@@ -68,7 +80,31 @@ class File {
   template <class Register>
   bool load(long n, Register &reg);
 
+  // Durability barrier for all preceding writes.
+  void sync();
+
+  // Write/read a batch of pages (page number - buffer pairs). With io_uring
+  // all requests of a batch are in flight at the same time. flush_batch sorts
+  // the pages, writes contiguous runs with vectored I/O and issues one fsync.
+  // load_batch reads runs of consecutive page numbers with vectored I/O.
+  template <class Register>
+  bool flush_batch(std::vector<std::pair<long, Register *>> &pages);
+
+  template <class Register>
+  bool load_batch(const std::vector<std::pair<long, Register *>> &pages);
+
  private:
+  inline void register_fd() {
+#if defined(IO_URING)
+    if (UringEngine::Enabled()) UringEngine::RegisterFile(fd);
+#endif
+  }
+
+  // Single-page I/O through the selected backend. Returns the number of bytes
+  // transferred, or -1 on error.
+  ssize_t read_page(void *buf, off_t offset);
+  ssize_t write_page(const void *buf, off_t offset);
+
   std::string fileName;
   size_t access_size;
   long offsetStart = 0;
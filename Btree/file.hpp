@@ -1,5 +1,30 @@
+#include <sys/uio.h>
+#include <algorithm>
+#include <climits>
 #include <cstring>
 
+inline ssize_t File::read_page(void *buf, off_t offset) {
+#if defined(IO_URING)
+  if (UringEngine::Enabled()) {
+    auto &ring = UringEngine::Local();
+    ring.PrepRead(fd, buf, access_size, offsetStart + offset);
+    return ring.SubmitAndWait() ? ring.LastResult() : -1;
+  }
+#endif
+  return pread(fd, buf, access_size, offsetStart + offset);
+}
+
+inline ssize_t File::write_page(const void *buf, off_t offset) {
+#if defined(IO_URING)
+  if (UringEngine::Enabled()) {
+    auto &ring = UringEngine::Local();
+    ring.PrepWrite(fd, buf, access_size, offsetStart + offset);
+    return ring.SubmitAndWait() ? access_size : -1;
+  }
+#endif
+  return pwrite(fd, buf, access_size, offsetStart + offset);
+}
+
 template <class Register>
 bool File::flush(long n, Register &reg) {
   void *buf = static_cast<void *>(&reg);
@@ -7,13 +32,12 @@ bool File::flush(long n, Register &reg) {
   off_t offset = n * size;
   ssize_t ret;
 
-  ret = pwrite(fd, buf, size, offsetStart + offset);
+  // No fsync here: durability barriers are issued once per batch (see
+  // flush_batch) or by sync().
+  ret = write_page(buf, offset);
 
   PCHECK(ret >= 0);
 
-  ret = fsync(fd);
-  PCHECK(ret == 0);
-
 #if defined(IOSTAT)
   writecount++;
 #endif
@@ -28,7 +52,7 @@ bool File::load(long n, Register &reg) {
   off_t offset = n * size;
   ssize_t ret;
 
-  ret = pread(fd, buf, size, offsetStart + offset);
+  ret = read_page(buf, offset);
   PCHECK(ret >= 0);
   if(ret == 0){
     std::memset(buf, '\0', PAGE_SIZE); // TODO: maybe we dont need?
@@ -40,3 +64,106 @@ bool File::load(long n, Register &reg) {
 
   return ret >= 0;
 }
+
+inline void File::sync() {
+  PCHECK(fsync(fd) == 0);
+}
+
+template <class Register>
+bool File::flush_batch(std::vector<std::pair<long, Register *>> &pages) {
+  bool success = true;
+  // Write in page number order so that adjacent pages form sequential runs.
+  std::sort(pages.begin(), pages.end(),
+            [](const auto &a, const auto &b) { return a.first < b.first; });
+#if defined(IO_URING)
+  if (UringEngine::Enabled()) {
+    auto &ring = UringEngine::Local();
+    for (auto &p : pages) {
+      ring.PrepWrite(fd, p.second, access_size, offsetStart + p.first * access_size);
+    }
+    success = ring.SubmitAndWait();
+  } else
+#endif
+  {
+    // Write each run of contiguous pages with a single vectored write.
+    std::vector<iovec> iov;
+    iov.reserve(std::min<size_t>(pages.size(), IOV_MAX));
+    size_t run_start = 0;
+    for (size_t i = 0; i < pages.size(); ++i) {
+      iov.push_back(iovec{static_cast<void *>(pages[i].second), access_size});
+      bool run_ends = (i + 1 == pages.size()) ||
+                      (pages[i + 1].first != pages[i].first + 1) ||
+                      (iov.size() == IOV_MAX);
+      if (run_ends) {
+        off_t offset = offsetStart + pages[run_start].first * access_size;
+        ssize_t ret = pwritev(fd, iov.data(), iov.size(), offset);
+        success &= (ret == static_cast<ssize_t>(iov.size() * access_size));
+        iov.clear();
+        run_start = i + 1;
+      }
+    }
+  }
+  LOG_IF(ERROR, !success) << "Can't flush a batch of " << pages.size() << " pages.";
+
+  // One durability barrier for the whole batch.
+  if (!pages.empty()) {
+    sync();
+  }
+
+#if defined(IOSTAT)
+  writecount += pages.size();
+#endif
+
+  return success;
+}
+
+template <class Register>
+bool File::load_batch(const std::vector<std::pair<long, Register *>> &pages) {
+  bool success = true;
+#if defined(IO_URING)
+  if (UringEngine::Enabled()) {
+    // Pages beyond the end of file come back zero-filled, like in load().
+    for (auto &p : pages) {
+      std::memset(static_cast<void *>(p.second), '\0', access_size);
+    }
+    auto &ring = UringEngine::Local();
+    for (auto &p : pages) {
+      ring.PrepRead(fd, p.second, access_size, offsetStart + p.first * access_size);
+    }
+    success = ring.SubmitAndWait();
+  } else
+#endif
+  {
+    // Read each run of consecutive page numbers with a single vectored read.
+    std::vector<iovec> iov;
+    iov.reserve(std::min<size_t>(pages.size(), IOV_MAX));
+    size_t run_start = 0;
+    for (size_t i = 0; i < pages.size(); ++i) {
+      iov.push_back(iovec{static_cast<void *>(pages[i].second), access_size});
+      bool run_ends = (i + 1 == pages.size()) ||
+                      (pages[i + 1].first != pages[i].first + 1) ||
+                      (iov.size() == IOV_MAX);
+      if (run_ends) {
+        off_t offset = offsetStart + pages[run_start].first * access_size;
+        ssize_t ret = preadv(fd, iov.data(), iov.size(), offset);
+        success &= (ret >= 0);
+        // Pages beyond the end of file come back zero-filled, like in load().
+        size_t done = std::max<ssize_t>(ret, 0);
+        for (auto &v : iov) {
+          if (done < v.iov_len) {
+            std::memset(static_cast<char *>(v.iov_base) + done, '\0', v.iov_len - done);
+          }
+          done -= std::min(done, v.iov_len);
+        }
+        iov.clear();
+        run_start = i + 1;
+      }
+    }
+  }
+
+#if defined(IOSTAT)
+  readcount += pages.size();
+#endif
+
+  return success;
+}
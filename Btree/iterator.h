@@ -0,0 +1,121 @@
+#ifndef B_TREE_ITERATOR_H
+#define B_TREE_ITERATOR_H
+
+#include <cstddef>
+#include <iterator>
+#include <vector>
+
+#include "node.h"
+
+template <class T>
+class Btree;
+
+// Forward iterator over the entries of a Btree in key order. Leaves are
+// followed through their right sibling links. The iterator copies one leaf at
+// a time, validated against the leaf's version, and keeps only that leaf
+// pinned, so an open iterator never holds up writers. Before following the
+// copied sibling link, the iterator checks that the pinned leaf did not change
+// meanwhile, since a merge may have freed the sibling. If it did change, the
+// iterator finds its position again from the root. Entries inserted into a
+// leaf after it was copied may be missed.
+//
+// With readahead > 0 the iterator asks the buffer manager to read up to that
+// many upcoming leaves in one batch whenever it runs out of prefetched leaves.
+template <class T>
+class Iterator {
+ public:
+  using iterator_category = std::forward_iterator_tag;
+  using value_type = T;
+  using difference_type = std::ptrdiff_t;
+  using pointer = const T *;
+  using reference = const T &;
+
+  // The end iterator
+  Iterator() = default;
+
+  Iterator(const Iterator &other) { *this = other; }
+  Iterator &operator=(const Iterator &other) {
+    if (this != &other) {
+      release();
+      tree = other.tree;
+      entries = other.entries;
+      index = other.index;
+      page = other.page;
+      right = other.right;
+      frame = other.frame;
+      version = other.version;
+      resume_key = other.resume_key;
+      resume_after = other.resume_after;
+      readahead = other.readahead;
+      prefetched = other.prefetched;
+      if (frame) {
+        tree->buf_mgr->RepinPage(frame);
+      }
+    }
+    return *this;
+  }
+  ~Iterator() { release(); }
+
+  reference operator*() const { return entries[index]; }
+  pointer operator->() const { return &entries[index]; }
+
+  Iterator &operator++() {
+    if (++index == entries.size()) {
+      next_leaf();
+    }
+    return *this;
+  }
+
+  bool operator==(const Iterator &other) const {
+    if (at_end() || other.at_end()) {
+      return at_end() == other.at_end();
+    }
+    return tree == other.tree && page == other.page && index == other.index;
+  }
+  bool operator!=(const Iterator &other) const { return !(*this == other); }
+
+ private:
+  friend class Btree<T>;
+
+  bool at_end() const { return index >= entries.size(); }
+
+  void release() {
+    if (frame) {
+      tree->buf_mgr->UnpinPage(frame);
+      frame = nullptr;
+    }
+  }
+
+  // Move to the first entry of the next non-empty leaf, or to the end.
+  void next_leaf() {
+    while (at_end() && right != 0) {
+      if (!tree->hop_right(*this)) {
+        tree->position(resume_key, resume_after, *this);
+        continue;
+      }
+      if (readahead > 0 && !entries.empty()) {
+        if (prefetched > 0) {
+          prefetched--;
+        } else {
+          prefetched = tree->read_ahead(EntryTraits<T>::key(entries.front()), readahead);
+        }
+      }
+    }
+  }
+
+  Btree<T> *tree{nullptr};
+  std::vector<T> entries;  // Copy of the current leaf
+  size_t index{0};         // Position in entries
+  pagenum_t page{0};       // The current leaf
+  pagenum_t right{0};      // Its right sibling, 0 for the last leaf
+  Page *frame{nullptr};    // The pinned frame of the current leaf
+  uint64_t version{0};     // The version the current leaf was copied at
+  // Where to find the position again: after resume_key, or at it if
+  // !resume_after.
+  typename EntryTraits<T>::key_type resume_key{};
+  bool resume_after{false};
+  size_t readahead{0};     // Leaves to read ahead
+  size_t prefetched{0};    // Leaves left in the current readahead window
+};
+
+#endif  // B_TREE_ITERATOR_H
@@ -1,53 +1,155 @@
 #ifndef B_TREE_NODE_H
 #define B_TREE_NODE_H
 
-#include <cmath>
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
 
 #include "../include/types.hpp"
+#include "node_search.h"
 
+// Splits a tree entry into the key kept in the key column of a node and the
+// payload stored next to it in a leaf.
 template <class T>
-struct Node {
-  alignas(T) T data[MAX_DATA]{};
+struct EntryTraits;
+
+template <>
+struct EntryTraits<ycsbc::Pair> {
+  using key_type = uint64_t;
+  using value_type = record_t;
+
+  static key_type key(const ycsbc::Pair &p) { return p.key; }
+  static value_type value(const ycsbc::Pair &p) { return p.record_number; }
+  static ycsbc::Pair make(key_type key, value_type value) { return ycsbc::Pair{key, value}; }
+};
+
+constexpr size_t NODE_SIZE = sizeof(decltype(std::declval<Page>().page_data));
+
+// Common prefix of inner and leaf pages.
+struct NodeHeader {
+  // Level of a page on the free list, which links to the next free page
+  // through right.
+  static constexpr uint16_t kFreeLevel = 0xffff;
+
+  lsn_t lsn{0};  // LSN of the last log record applied to the page, see Wal
   pagenum_t page_id{0};
-  pagenum_t right{0};
-  pagenum_t children[MAX_CHILDREN]{};
-  uint16_t count{0};
-
-  Node() = default;
-  explicit constexpr Node(pagenum_t page_id) : page_id{page_id} {
-    count = 0;
-    for (int i = 0; i < MAX_CHILDREN; i++) {
-      children[i] = 0;
-    }
-    for (size_t i = 0; i < MAX_DATA; i++) {
-      data[i] = {};
-    }
-  }
+  pagenum_t right{0};  // Right sibling (leaves only)
+  uint16_t count{0};   // Number of keys
+  uint16_t level{0};   // Height above the leaf level, 0 for leaves
+  uint32_t unused{0};  // Pads the header to the alignment of the key column
+
+  NodeHeader() = default;
+  constexpr NodeHeader(pagenum_t page_id, uint16_t level) : page_id{page_id}, level{level} {}
+
+  bool is_leaf() const { return level == 0; }
+  bool is_inner() const { return level != 0 && level != kFreeLevel; }
+};
 
-  void insert_in_node(int pos, const T &value) {
-    int j = count;
-    while (j > pos) {
-      data[j] = data[j - 1];
-      children[j + 1] = children[j];
-      j--;
-    }
-    data[j] = value;
-    children[j + 1] = children[j];
+// The buffer manager finds the LSN in the first bytes of a page.
+static_assert(offsetof(NodeHeader, lsn) == 0);
+static_assert(sizeof(NodeHeader) == 24);
 
+// Child reference of an inner page. While the child is in the buffer pool, the
+// reference may be swizzled: it holds the index of the child's frame instead of
+// its page number (see Btree::read_child). Page numbers take at most 24 bits,
+// so the two never collide. Pages are only written and logged with page
+// numbers.
+struct Swip {
+  static constexpr pagenum_t kSwizzled = pagenum_t{1} << 31;
+
+  static bool is_swizzled(pagenum_t ref) { return ref & kSwizzled; }
+  static uint32_t frame_index(pagenum_t ref) { return ref & ~kSwizzled; }
+  static pagenum_t make(uint32_t frame_index) { return frame_index | kSwizzled; }
+};
+
+// Inner page: a key column followed by the child references (see Swip).
+// children[i] holds the keys in [keys[i-1], keys[i]). Search is the in-node
+// search policy (see node_search.h).
+template <class T, class Search = DefaultNodeSearch>
+struct InnerNode : NodeHeader {
+  using key_type = typename EntryTraits<T>::key_type;
+
+  static constexpr uint16_t kOrder =
+      (NODE_SIZE - sizeof(NodeHeader) - sizeof(pagenum_t)) / (sizeof(key_type) + sizeof(pagenum_t));
+
+  key_type keys[kOrder];
+  pagenum_t children[kOrder + 1];
+
+  InnerNode() = default;
+  constexpr InnerNode(pagenum_t page_id, uint16_t level) : NodeHeader(page_id, level) {}
+
+  // The count is clamped so that optimistic readers never run past the node.
+  uint16_t size() const { return std::min<uint16_t>(count, kOrder); }
+
+  // Index of the child that covers key.
+  uint16_t upper_bound(const key_type &key) const {
+    return Search::upper_bound(keys, size(), key);
+  }
+
+  // Insert key at pos, with right_child as the child to its right.
+  void insert(uint16_t pos, const key_type &key, pagenum_t right_child) {
+    std::memmove(&keys[pos + 1], &keys[pos], (count - pos) * sizeof(key_type));
+    std::memmove(&children[pos + 2], &children[pos + 1], (count - pos) * sizeof(pagenum_t));
+    keys[pos] = key;
+    children[pos + 1] = right_child;
     count++;
   }
 
-  void delete_in_node(int pos) {
-    for (int i = pos; i < count; i++) {
-      data[i] = data[i + 1];
-      children[i + 1] = children[i + 2];
-    }
+  // Remove the key at pos and the child to its right.
+  void remove(uint16_t pos) {
+    std::memmove(&keys[pos], &keys[pos + 1], (count - pos - 1) * sizeof(key_type));
+    std::memmove(&children[pos + 1], &children[pos + 2], (count - pos - 1) * sizeof(pagenum_t));
     count--;
   }
 
-  bool is_overflow() { return count > BTREE_ORDER; }
+  bool is_full() const { return count >= kOrder; }
+};
+
+// Leaf page: a key column followed by the column of payloads.
+template <class T, class Search = DefaultNodeSearch>
+struct LeafNode : NodeHeader {
+  using traits = EntryTraits<T>;
+  using key_type = typename traits::key_type;
+  using value_type = typename traits::value_type;
+
+  static constexpr uint16_t kOrder =
+      (NODE_SIZE - sizeof(NodeHeader)) / (sizeof(key_type) + sizeof(value_type));
+
+  key_type keys[kOrder];
+  value_type values[kOrder];
+
+  LeafNode() = default;
+  explicit constexpr LeafNode(pagenum_t page_id) : NodeHeader(page_id, 0) {}
+
+  uint16_t size() const { return std::min<uint16_t>(count, kOrder); }
+
+  // Position of the first entry that is not less than key.
+  uint16_t lower_bound(const key_type &key) const {
+    return Search::lower_bound(keys, size(), key);
+  }
+
+  // Position of the first entry that is greater than key.
+  uint16_t upper_bound(const key_type &key) const {
+    return Search::upper_bound(keys, size(), key);
+  }
+
+  T get(uint16_t pos) const { return traits::make(keys[pos], values[pos]); }
+
+  void insert(uint16_t pos, const T &entry) {
+    std::memmove(&keys[pos + 1], &keys[pos], (count - pos) * sizeof(key_type));
+    std::memmove(&values[pos + 1], &values[pos], (count - pos) * sizeof(value_type));
+    keys[pos] = traits::key(entry);
+    values[pos] = traits::value(entry);
+    count++;
+  }
+
+  void remove(uint16_t pos) {
+    std::memmove(&keys[pos], &keys[pos + 1], (count - pos - 1) * sizeof(key_type));
+    std::memmove(&values[pos], &values[pos + 1], (count - pos - 1) * sizeof(value_type));
+    count--;
+  }
 
-  bool is_underflow() { return count < floor(BTREE_ORDER / 2.0); }
+  bool is_full() const { return count >= kOrder; }
 };
 
 #endif  // B_TREE_NODE_H
@@ -0,0 +1,178 @@
+#ifndef B_TREE_NODE_SEARCH_H
+#define B_TREE_NODE_SEARCH_H
+
+#include <immintrin.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <type_traits>
+
+// In-node search kernels over the key column of a node. Every kernel is a
+// policy class with
+//
+//   static uint16_t lower_bound(const K *keys, uint16_t n, const K &key);
+//   static uint16_t upper_bound(const K *keys, uint16_t n, const K &key);
+//
+// returning the number of keys in the sorted keys[0, n) that are less than
+// (lower_bound) or not greater than (upper_bound) key. The kernel of the tree
+// is selected at compile time with the CMake option
+// NODE_SEARCH=<linear|binary|simd|interpolation> (default binary).
+//
+// Kernels run under optimistic lock coupling and may see a node that is being
+// modified, so they must stay within [0, n) no matter what they read.
+
+namespace node_search {
+
+template <bool kUpper, class T>
+inline bool before(const T &entry, const T &key) {
+  if constexpr (kUpper) {
+    return entry <= key;
+  } else {
+    return entry < key;
+  }
+}
+
+// One compare per entry.
+struct Linear {
+  template <bool kUpper, class T>
+  static uint16_t search(const T *data, uint16_t n, const T &key) {
+    uint16_t pos = 0;
+    while (pos < n && before<kUpper>(data[pos], key)) {
+      pos++;
+    }
+    return pos;
+  }
+};
+
+// Binary search without data-dependent branches; the halving step compiles to
+// a conditional move.
+struct BranchlessBinary {
+  template <bool kUpper, class T>
+  static uint16_t search(const T *data, uint16_t n, const T &key) {
+    if (n == 0) {
+      return 0;
+    }
+    const T *base = data;
+    uint16_t len = n;
+    while (len > 1) {
+      uint16_t half = len / 2;
+      base = before<kUpper>(base[half], key) ? base + half : base;
+      len -= half;
+    }
+    return (base - data) + before<kUpper>(*base, key);
+  }
+};
+
+// Compares several uint64_t keys at once. The keys are sorted, so the scan
+// stops at the first vector that is not entirely before the key. Other key
+// types fall back to BranchlessBinary.
+struct Simd {
+  template <bool kUpper, class T>
+  static uint16_t search(const T *data, uint16_t n, const T &key) {
+    if constexpr (std::is_same_v<T, uint64_t>) {
+      uint16_t pos = 0;
+#if defined(__AVX512F__)
+      const __m512i k = _mm512_set1_epi64(key);
+      for (; pos + 8 <= n; pos += 8) {
+        __m512i v = _mm512_loadu_si512(reinterpret_cast<const void *>(data + pos));
+        __mmask8 m = kUpper ? _mm512_cmple_epu64_mask(v, k) : _mm512_cmplt_epu64_mask(v, k);
+        int c = __builtin_popcount(m);
+        if (c < 8) {
+          return pos + c;
+        }
+      }
+#elif defined(__AVX2__)
+      // AVX2 only has signed 64-bit compares; flipping the sign bit of both
+      // sides makes them order unsigned keys correctly.
+      const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+      const __m256i k = _mm256_xor_si256(_mm256_set1_epi64x(key), sign);
+      for (; pos + 8 <= n; pos += 8) {
+        auto *p = reinterpret_cast<const __m256i *>(data + pos);
+        __m256i v0 = _mm256_xor_si256(_mm256_loadu_si256(p), sign);
+        __m256i v1 = _mm256_xor_si256(_mm256_loadu_si256(p + 1), sign);
+        // entry < key  <=>  key > entry;  entry <= key  <=>  !(entry > key)
+        __m256i c0 = kUpper ? _mm256_cmpgt_epi64(v0, k) : _mm256_cmpgt_epi64(k, v0);
+        __m256i c1 = kUpper ? _mm256_cmpgt_epi64(v1, k) : _mm256_cmpgt_epi64(k, v1);
+        int m = _mm256_movemask_pd(_mm256_castsi256_pd(c0)) |
+                (_mm256_movemask_pd(_mm256_castsi256_pd(c1)) << 4);
+        int c = __builtin_popcount(m);
+        if (kUpper) {
+          c = 8 - c;
+        }
+        if (c < 8) {
+          return pos + c;
+        }
+      }
+#endif
+      return pos + Linear::search<kUpper>(data + pos, n - pos, key);
+    } else {
+      return BranchlessBinary::search<kUpper>(data, n, key);
+    }
+  }
+};
+
+// Interpolation search for uniformly distributed uint64_t keys (e.g., hashed
+// YCSB keys). A few interpolation rounds narrow the range, then BranchlessBinary
+// finishes it. Other key types fall back to BranchlessBinary.
+struct Interpolation {
+  template <bool kUpper, class T>
+  static uint16_t search(const T *data, uint16_t n, const T &key) {
+    if constexpr (std::is_same_v<T, uint64_t>) {
+      constexpr int kMaxRounds = 3;
+      constexpr uint16_t kMinRange = 8;
+      // The result is always in [lo, hi].
+      uint16_t lo = 0;
+      uint16_t hi = n;
+      for (int round = 0; round < kMaxRounds && hi - lo > kMinRange; ++round) {
+        if (!before<kUpper>(data[lo], key)) {
+          return lo;
+        }
+        if (before<kUpper>(data[hi - 1], key)) {
+          return hi;
+        }
+        uint64_t lo_key = data[lo];
+        uint64_t hi_key = data[hi - 1];
+        if (hi_key <= lo_key || key < lo_key) {
+          break;  // Only possible while the node is being modified
+        }
+        auto offset = static_cast<unsigned __int128>(key - lo_key) * (hi - 1 - lo) / (hi_key - lo_key);
+        uint16_t guess = lo + static_cast<uint16_t>(std::min<unsigned __int128>(offset, hi - 1 - lo));
+        if (before<kUpper>(data[guess], key)) {
+          lo = guess + 1;
+        } else {
+          hi = guess;
+        }
+      }
+      return lo + BranchlessBinary::search<kUpper>(data + lo, hi - lo, key);
+    } else {
+      return BranchlessBinary::search<kUpper>(data, n, key);
+    }
+  }
+};
+
+// Adapts a kernel to the lower_bound/upper_bound interface used by Node.
+template <class Kernel>
+struct Policy {
+  template <class T>
+  static uint16_t lower_bound(const T *data, uint16_t n, const T &key) {
+    return Kernel::template search<false>(data, n, key);
+  }
+  template <class T>
+  static uint16_t upper_bound(const T *data, uint16_t n, const T &key) {
+    return Kernel::template search<true>(data, n, key);
+  }
+};
+
+}  // namespace node_search
+
+#if defined(NODE_SEARCH_LINEAR)
+using DefaultNodeSearch = node_search::Policy<node_search::Linear>;
+#elif defined(NODE_SEARCH_SIMD)
+using DefaultNodeSearch = node_search::Policy<node_search::Simd>;
+#elif defined(NODE_SEARCH_INTERPOLATION)
+using DefaultNodeSearch = node_search::Policy<node_search::Interpolation>;
+#else
+using DefaultNodeSearch = node_search::Policy<node_search::BranchlessBinary>;
+#endif
+
+#endif  // B_TREE_NODE_SEARCH_H
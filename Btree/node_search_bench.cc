@@ -0,0 +1,153 @@
+// Microbenchmark of the in-node search kernels (see node_search.h) on full
+// inner and leaf key columns, as they are searched on buffer pool hits.
+//
+//   node_search_bench [lookups per kernel]
+//
+// Every kernel is first checked against std::lower_bound/std::upper_bound.
+
+#include <assert.h>
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "node.h"
+
+namespace {
+
+using Key = uint64_t;
+
+enum class Distribution { kUniform, kSkewed };
+
+const char *Name(Distribution d) { return d == Distribution::kUniform ? "uniform" : "skewed"; }
+
+// n sorted distinct keys. Uniform keys are spread over the whole key space,
+// like hashed YCSB keys; skewed keys are dense at the start and increasingly
+// sparse, which is the worst case of interpolation search.
+std::vector<Key> MakeKeys(Distribution d, uint16_t n, std::mt19937_64 &rng) {
+  std::vector<Key> keys;
+  if (d == Distribution::kUniform) {
+    while (keys.size() < n) {
+      keys.push_back(rng() >> 1);
+      std::sort(keys.begin(), keys.end());
+      keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    }
+  } else {
+    Key key = 1;
+    for (uint16_t i = 0; i < n; ++i) {
+      keys.push_back(key);
+      key += 1 + (uint64_t{1} << (i * 48 / n)) + rng() % 4;
+    }
+  }
+  return keys;
+}
+
+// Keys to look up: the keys of the column and their neighbours, and keys
+// around and outside the column's range.
+std::vector<Key> MakeProbes(const std::vector<Key> &keys, size_t n_probes, std::mt19937_64 &rng) {
+  std::vector<Key> probes{0, keys.front() - 1, keys.back() + 1, ~Key{0}};
+  for (Key key : keys) {
+    probes.push_back(key);
+    probes.push_back(key - 1);
+    probes.push_back(key + 1);
+  }
+  while (probes.size() < n_probes) {
+    switch (rng() % 3) {
+      case 0:
+        probes.push_back(keys[rng() % keys.size()]);
+        break;
+      case 1:
+        probes.push_back(keys[rng() % keys.size()] + 1);
+        break;
+      default:
+        probes.push_back(keys.front() + rng() % (keys.back() - keys.front() + 1));
+        break;
+    }
+  }
+  std::shuffle(probes.begin(), probes.end(), rng);
+  return probes;
+}
+
+template <class Search>
+bool Check(const char *kernel, const char *node, const Key *keys, uint16_t n,
+           const std::vector<Key> &probes) {
+  for (Key probe : probes) {
+    uint16_t lower = std::lower_bound(keys, keys + n, probe) - keys;
+    uint16_t upper = std::upper_bound(keys, keys + n, probe) - keys;
+    if (Search::lower_bound(keys, n, probe) != lower || Search::upper_bound(keys, n, probe) != upper) {
+      std::fprintf(stderr, "%s on %s node: wrong position for key %lu\n", kernel, node, probe);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Average nanoseconds per search. The positions are summed so that the
+// searches are not optimized away.
+template <class Search, bool kUpper>
+double Time(const Key *keys, uint16_t n, const std::vector<Key> &probes, size_t lookups, uint64_t &sink) {
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < lookups; ++i) {
+    Key probe = probes[i % probes.size()];
+    sink += kUpper ? Search::upper_bound(keys, n, probe) : Search::lower_bound(keys, n, probe);
+  }
+  std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count() / lookups;
+}
+
+template <class Kernel>
+bool Run(const char *kernel, Distribution d, size_t lookups, uint64_t &sink) {
+  using Search = node_search::Policy<Kernel>;
+  using Inner = InnerNode<ycsbc::Pair, Search>;
+  using Leaf = LeafNode<ycsbc::Pair, Search>;
+
+  // Nodes are page-sized, so keep them off the stack.
+  auto inner = std::make_unique<Inner>(1, 1);
+  auto leaf = std::make_unique<Leaf>(2);
+  std::mt19937_64 rng(42);
+  std::vector<Key> inner_keys = MakeKeys(d, Inner::kOrder, rng);
+  std::vector<Key> leaf_keys = MakeKeys(d, Leaf::kOrder, rng);
+  std::copy(inner_keys.begin(), inner_keys.end(), inner->keys);
+  std::copy(leaf_keys.begin(), leaf_keys.end(), leaf->keys);
+  inner->count = Inner::kOrder;
+  leaf->count = Leaf::kOrder;
+  std::vector<Key> inner_probes = MakeProbes(inner_keys, 1 << 16, rng);
+  std::vector<Key> leaf_probes = MakeProbes(leaf_keys, 1 << 16, rng);
+
+  if (!Check<Search>(kernel, "inner", inner->keys, inner->size(), inner_probes) ||
+      !Check<Search>(kernel, "leaf", leaf->keys, leaf->size(), leaf_probes)) {
+    return false;
+  }
+  std::printf("%-13s %-8s %9.1f %9.1f %9.1f %9.1f\n", kernel, Name(d),
+              Time<Search, false>(inner->keys, inner->size(), inner_probes, lookups, sink),
+              Time<Search, true>(inner->keys, inner->size(), inner_probes, lookups, sink),
+              Time<Search, false>(leaf->keys, leaf->size(), leaf_probes, lookups, sink),
+              Time<Search, true>(leaf->keys, leaf->size(), leaf_probes, lookups, sink));
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  size_t lookups = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 10000000;
+  uint64_t sink = 0;
+  bool ok = true;
+
+  std::printf("Keys per node: inner %u, leaf %u. Nanoseconds per search:\n",
+              InnerNode<ycsbc::Pair>::kOrder, LeafNode<ycsbc::Pair>::kOrder);
+  std::printf("%-13s %-8s %9s %9s %9s %9s\n", "kernel", "keys", "inner lb", "inner ub", "leaf lb", "leaf ub");
+  for (Distribution d : {Distribution::kUniform, Distribution::kSkewed}) {
+    ok &= Run<node_search::Linear>("linear", d, lookups, sink);
+    ok &= Run<node_search::BranchlessBinary>("binary", d, lookups, sink);
+    ok &= Run<node_search::Simd>("simd", d, lookups, sink);
+    ok &= Run<node_search::Interpolation>("interpolation", d, lookups, sink);
+  }
+  std::printf("(checksum %lu)\n", sink);
+  return ok ? 0 : 1;
+}
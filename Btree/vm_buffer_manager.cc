@@ -0,0 +1,377 @@
+#include "vm_buffer_manager.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <thread>
+
+VmBufferManager::VmBufferManager(pagenum_t page_count, pagenum_t virtual_pages) {
+  CHECK(page_count > 0 && page_count <= virtual_pages)
+      << "The buffer pool must hold between 1 and " << virtual_pages << " pages, requested " << page_count;
+  // Eviction gives back the memory of whole frames only.
+  CHECK(sizeof(Page) % sysconf(_SC_PAGESIZE) == 0) << "PAGE_SIZE must be a multiple of the OS page size.";
+  this->page_count = page_count;
+  this->virtual_pages = virtual_pages;
+  this->clean_target = std::max<uint32_t>(page_count / 8, 1);
+  this->max_prefetch = std::min<uint32_t>(page_count / 16, kMaxPrefetch);
+  this->checkpoint_batch = std::clamp<uint32_t>(page_count / 16, 1, kMaxCheckpointBatch);
+
+  // Both regions are only backed by memory where they are touched. Zeroed
+  // state words are kEvicted. The region is not registered with io_uring,
+  // since registered buffers are pinned in memory.
+  void *frames = mmap(nullptr, sizeof(Page) * size_t{virtual_pages}, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  PCHECK(frames != MAP_FAILED) << "Can't reserve the buffer pool region";
+  page_frames = static_cast<Page *>(frames);
+  void *states = mmap(nullptr, sizeof(std::atomic<uint64_t>) * size_t{virtual_pages}, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  PCHECK(states != MAP_FAILED) << "Can't reserve the page states";
+  page_states = static_cast<std::atomic<uint64_t> *>(states);
+
+  slots.reset(new std::atomic<pagenum_t>[page_count]);
+  for (uint32_t i = 0; i < page_count; ++i) {
+    slots[i].store(kFreeSlot, std::memory_order_relaxed);
+  }
+}
+
+void VmBufferManager::Finalize() {
+  if (!page_frames) {
+    return;
+  }
+  if (file) {
+    UnregisterFile(file);
+  }
+  munmap(page_frames, sizeof(Page) * size_t{virtual_pages});
+  munmap(page_states, sizeof(std::atomic<uint64_t>) * size_t{virtual_pages});
+  page_frames = nullptr;
+}
+
+Page *VmBufferManager::PinPage(PageId page_id, uint16_t page_mode) {
+  if (!page_id.IsValid()) {
+    LOG(ERROR) << "Invalid PageId";
+    return nullptr;
+  }
+  if (page_id.GetFileID() != fid) {
+    LOG(ERROR) << "The file is not registered.";
+    return nullptr;
+  }
+  pagenum_t page_num = page_id.GetPageID();
+  CHECK(page_num < virtual_pages) << "Page " << page_num << " is beyond the buffer pool region.";
+
+  std::atomic<uint64_t> &state = page_states[page_num];
+  while (true) {
+    uint64_t s = state.load(std::memory_order_acquire);
+    switch (s & kStateMask) {
+      case kResident: {
+        uint64_t pinned = kResident | (uint64_t{page_mode} << kUsedShift) | ((s & kPinMask) + 1);
+        if (state.compare_exchange_weak(s, pinned, std::memory_order_acquire)) {
+          return &page_frames[page_num];
+        }
+        break;
+      }
+      case kEvicted:
+        // Claiming the page first means concurrent misses on it wait for this
+        // load instead of reading their own copy.
+        if (state.compare_exchange_weak(s, kLoading, std::memory_order_acquire)) {
+          uint32_t slot = EvictSlot();
+          CHECK(file->load(page_num, page_frames[page_num])) << "Can't load the page into the page frame.";
+          FinishLoad(page_num, slot, page_mode, 1);
+          return &page_frames[page_num];
+        }
+        break;
+      default:
+        // Wait for the thread that is loading or evicting the page.
+        std::this_thread::yield();
+    }
+  }
+}
+
+void VmBufferManager::FinishLoad(pagenum_t page_num, uint32_t slot, uint16_t page_mode, uint32_t pins) {
+  // The header was read from storage along with the page.
+  Page *page_frame = &page_frames[page_num];
+  page_frame->page_id = PageId(fid, page_num);
+  page_frame->latch.Reset();
+  page_frame->pin_count.store(0, std::memory_order_relaxed);
+  page_frame->last_used.store(0, std::memory_order_relaxed);
+  page_frame->SetDirty(false);
+  page_frame->SetLoading(false);
+  page_frame->SetWriting(false);
+  slots[slot].store(page_num, std::memory_order_release);
+  page_states[page_num].store(kResident | (uint64_t{page_mode} << kUsedShift) | pins, std::memory_order_release);
+}
+
+Page *VmBufferManager::PinResident(pagenum_t page_num) {
+  std::atomic<uint64_t> &state = page_states[page_num];
+  while (true) {
+    uint64_t s = state.load(std::memory_order_acquire);
+    switch (s & kStateMask) {
+      case kResident:
+        if (state.compare_exchange_weak(s, s + 1, std::memory_order_acquire)) {
+          return &page_frames[page_num];
+        }
+        break;
+      case kEvicted:
+        return nullptr;
+      default:
+        std::this_thread::yield();
+    }
+  }
+}
+
+uint32_t VmBufferManager::EvictSlot() {
+  // Same bound as BufferManager::EvictFrame.
+  const uint64_t max_visits = uint64_t{page_count} * (PAGE_READ + 1) * 1024;
+  for (uint64_t visited = 1;; ++visited) {
+    LOG_IF(FATAL, visited > max_visits)
+        << "All " << page_count << " buffer pages are pinned.";
+    if (visited % page_count == 0) {
+      std::this_thread::yield();
+    }
+
+    uint32_t slot = slot_cur.fetch_add(1, std::memory_order_relaxed) % page_count;
+    pagenum_t page_num = slots[slot].load(std::memory_order_acquire);
+    if (page_num == kFreeSlot) {
+      if (slots[slot].compare_exchange_strong(page_num, kBusySlot, std::memory_order_acquire)) {
+        return slot;
+      }
+      continue;
+    }
+    if (page_num == kBusySlot) {
+      continue;
+    }
+
+    // If the page is in use or recently used, give it another chance. Only
+    // the state word is looked at: the frame may be evicted under our feet.
+    std::atomic<uint64_t> &state = page_states[page_num];
+    uint64_t s = state.load(std::memory_order_acquire);
+    if ((s & kStateMask) != kResident || (s & kPinMask) > 0) {
+      continue;
+    }
+    if (s & kUsedMask) {
+      state.compare_exchange_weak(s, s - (uint64_t{1} << kUsedShift), std::memory_order_relaxed);
+      continue;
+    }
+    if (!state.compare_exchange_strong(s, kEvicting, std::memory_order_acquire)) {
+      continue;
+    }
+    // The page may have moved to another slot since the slot was read.
+    pagenum_t expected = page_num;
+    if (!slots[slot].compare_exchange_strong(expected, kBusySlot, std::memory_order_acquire)) {
+      state.store(kResident, std::memory_order_release);
+      continue;
+    }
+
+    // Nobody else can reach the page now, so it is written from its frame.
+    Page *page_frame = &page_frames[page_num];
+    if (page_frame->IsDirty()) {
+      FlushLogFor(std::initializer_list<std::pair<long, Page *>>{{page_num, page_frame}});
+      bool success = file->flush(page_num, *page_frame);
+      LOG_IF(ERROR, !success) << "Can't flush the dirty page evicted by CLOCK.";
+    }
+    PCHECK(madvise(page_frame, sizeof(Page), MADV_DONTNEED) == 0);
+    state.store(kEvicted, std::memory_order_release);
+    return slot;
+  }
+}
+
+void VmBufferManager::Prefetch(const std::vector<PageId> &page_ids) {
+  thread_local std::vector<std::pair<long, Page *>> batch;
+  thread_local std::vector<uint32_t> batch_slots;
+  batch.clear();
+  batch_slots.clear();
+
+  for (PageId page_id : page_ids) {
+    if (batch.size() == max_prefetch) {
+      break;
+    }
+    if (!page_id.IsValid() || page_id.GetFileID() != fid || page_id.GetPageID() >= virtual_pages) {
+      continue;
+    }
+    // Claim the page as PinPage does, so that threads asking for it wait for
+    // the batch. Pages in any other state are skipped.
+    pagenum_t page_num = page_id.GetPageID();
+    uint64_t s = kEvicted;
+    if (!page_states[page_num].compare_exchange_strong(s, kLoading, std::memory_order_acquire)) {
+      continue;
+    }
+    batch_slots.push_back(EvictSlot());
+    batch.emplace_back(page_num, &page_frames[page_num]);
+  }
+  if (batch.empty()) {
+    return;
+  }
+
+  CHECK(file->load_batch(batch)) << "Can't prefetch pages into the buffer pool.";
+  for (size_t i = 0; i < batch.size(); ++i) {
+    FinishLoad(batch[i].first, batch_slots[i], PAGE_READ, 0);
+  }
+}
+
+void VmBufferManager::RegisterFile(File *file, Wal *wal, Swizzler *) {
+  assert(file);
+  CHECK(!this->file) << "A virtual-memory-assisted buffer pool caches the pages of one file.";
+  this->file = file;
+  this->fid = file->GetId();
+  this->wal = wal;
+  if (!cleaner.joinable()) {
+    cleaner_stop = false;
+    cleaner = std::thread(&VmBufferManager::CleanerLoop, this);
+  }
+}
+
+void VmBufferManager::UnregisterFile(File *file) {
+  CHECK(file == this->file) << "The file is not registered.";
+  if (cleaner.joinable()) {
+    cleaner_stop = true;
+    cleaner.join();
+  }
+
+  std::vector<std::pair<long, Page *>> dirty_pages;
+  for (uint32_t i = 0; i < page_count; ++i) {
+    pagenum_t page_num = slots[i].load(std::memory_order_relaxed);
+    if (page_num < kBusySlot && page_frames[page_num].IsDirty()) {
+      dirty_pages.emplace_back(page_num, &page_frames[page_num]);
+    }
+  }
+  FlushLogFor(dirty_pages);
+  bool success = file->flush_batch(dirty_pages);
+  LOG_IF(ERROR, !success) << "Can't flush the pages of a file leaving the buffer pool.";
+  this->file = nullptr;
+  this->wal = nullptr;
+}
+
+void VmBufferManager::CleanerLoop() {
+  while (!cleaner_stop.load(std::memory_order_relaxed)) {
+    if (CleanBatch() == 0) {
+      std::this_thread::sleep_for(std::chrono::microseconds(500));
+    }
+  }
+}
+
+size_t VmBufferManager::CleanBatch() {
+  thread_local std::vector<std::pair<long, Page *>> batch;
+  thread_local std::vector<Page *> frames;
+  thread_local std::unique_ptr<Page[]> copies;
+  if (!copies) {
+    copies.reset(new Page[kMaxCleanBatch]);
+  }
+  batch.clear();
+  frames.clear();
+
+  uint64_t hand = slot_cur.load(std::memory_order_relaxed);
+  for (uint32_t i = 0; i < clean_target && batch.size() < kMaxCleanBatch; ++i) {
+    pagenum_t page_num = slots[(hand + i) % page_count].load(std::memory_order_acquire);
+    if (page_num >= kBusySlot) {
+      continue;
+    }
+    // Pin unused pages only, without counting it as a use, before looking at
+    // the frame.
+    std::atomic<uint64_t> &state = page_states[page_num];
+    uint64_t s = state.load(std::memory_order_acquire);
+    if ((s & kStateMask) != kResident || (s & kPinMask) > 0 ||
+        !state.compare_exchange_strong(s, s + 1, std::memory_order_acquire)) {
+      continue;
+    }
+    Page *page_frame = &page_frames[page_num];
+    page_frame->SetWriting(true);
+    if (!CopyForWrite(page_frame, copies[batch.size()], false)) {
+      page_frame->SetWriting(false);
+      UnpinPage(page_frame);
+      continue;
+    }
+    batch.emplace_back(page_num, &copies[batch.size()]);
+    frames.push_back(page_frame);
+  }
+
+  if (!batch.empty()) {
+    FlushLogFor(batch);
+    bool success = file->flush_batch(batch);
+    LOG_IF(ERROR, !success) << "Background write-back failed.";
+    for (Page *page_frame : frames) {
+      if (!success) page_frame->SetDirty(true);
+      page_frame->SetWriting(false);
+      UnpinPage(page_frame);
+    }
+  }
+  return batch.size();
+}
+
+bool VmBufferManager::CopyForWrite(Page *frame, Page &copy, bool wait) {
+  bool need_restart;
+  do {
+    need_restart = false;
+    uint64_t version = frame->latch.ReadLockOrRestart(need_restart);
+    if (need_restart) {
+      if (!wait) {
+        return false;
+      }
+      std::this_thread::yield();
+      continue;
+    }
+    if (!frame->IsDirty()) {
+      return false;
+    }
+    frame->SetDirty(false);
+    std::memcpy(copy.GetRealPage(), frame->GetRealPage(), sizeof(Page::page_data));
+    frame->latch.ReadUnlockOrRestart(version, need_restart);
+    if (need_restart) {
+      frame->SetDirty(true);
+    }
+  } while (need_restart);
+  return true;
+}
+
+lsn_t VmBufferManager::Checkpoint(File *) {
+  // See BufferManager::Checkpoint.
+  lsn_t checkpoint_lsn = wal ? wal->CurrentLsn() : 0;
+
+  std::vector<std::pair<long, Page *>> batch;
+  std::vector<Page *> frames;
+  std::unique_ptr<Page[]> copies(new Page[checkpoint_batch]);
+  auto write_batch = [&] {
+    if (batch.empty()) {
+      return;
+    }
+    FlushLogFor(batch);
+    bool success = file->flush_batch(batch);
+    LOG_IF(ERROR, !success) << "Checkpoint write-back failed.";
+    for (Page *page_frame : frames) {
+      if (!success) page_frame->SetDirty(true);
+      UnpinPage(page_frame);
+    }
+    batch.clear();
+    frames.clear();
+  };
+
+  for (uint32_t i = 0; i < page_count; ++i) {
+    pagenum_t page_num = slots[i].load(std::memory_order_acquire);
+    if (page_num >= kBusySlot) {
+      continue;
+    }
+    // The frame is only looked at once pinned. Pinning waits for an eviction
+    // under way, which writes the page back.
+    Page *page_frame = PinResident(page_num);
+    if (!page_frame) {
+      continue;
+    }
+
+    // Wait for a write-back by the cleaner, as in BufferManager::Checkpoint.
+    while (page_frame->IsWriting()) {
+      std::this_thread::yield();
+    }
+    if (!CopyForWrite(page_frame, copies[batch.size()], true)) {
+      UnpinPage(page_frame);
+      continue;
+    }
+
+    batch.emplace_back(page_num, &copies[batch.size()]);
+    frames.push_back(page_frame);
+    if (batch.size() == checkpoint_batch) {
+      write_batch();
+    }
+  }
+  write_batch();
+  // Pages evicted during the checkpoint were written without a sync.
+  file->sync();
+  return checkpoint_lsn;
+}
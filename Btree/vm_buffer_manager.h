@@ -0,0 +1,162 @@
+#pragma once
+#ifndef B_TREE_VM_BUFFER_H
+#define B_TREE_VM_BUFFER_H
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "buffer_manager.h"
+
+// Virtual-memory-assisted buffer pool (vmcache), an alternative to
+// BufferManager selected with the CMake option VMCACHE.
+//
+// One anonymous virtual region is reserved with a frame for every page number
+// of the file, so the frame of a page is found by address arithmetic instead
+// of a page table lookup. Only frames of resident pages are backed by memory:
+// a miss reads the page straight into its frame, and eviction gives the
+// frame's memory back with madvise(MADV_DONTNEED).
+//
+// Every page has a state word outside the region (see kEvicted), which holds
+// its residency state, its CLOCK reference count and its pin count. A frame,
+// header included, is only touched while its page is pinned or held
+// exclusively for loading or eviction, since an evicted frame reads as zeros.
+// Pages must be pinned to be read; swizzled references are not supported
+// (see Btree::read_child).
+//
+// At most page_count pages are resident. CLOCK runs over page_count slots,
+// each holding the page number of a resident page. Since frames are found by
+// page number, the pool caches the pages of one file only.
+class VmBufferManager {
+ public:
+  // @page_count: number of pages that may be resident at the same time
+  // @virtual_pages: number of frames reserved, i.e., page numbers the file
+  // may use
+  explicit VmBufferManager(pagenum_t page_count, pagenum_t virtual_pages = kMaxVirtualPages);
+  ~VmBufferManager() { Finalize(); }
+
+  void Finalize();
+
+  // Same as in BufferManager.
+  [[nodiscard]] Page *PinPage(PageId page_id, uint16_t page_mode);
+  void UnpinPage(Page *page) {
+    [[maybe_unused]] uint64_t old = GetState(page).fetch_sub(1, std::memory_order_release);
+    assert(old & kPinMask);
+  }
+  void RepinPage(Page *page) { GetState(page).fetch_add(1, std::memory_order_acquire); }
+  void Prefetch(const std::vector<PageId> &page_ids);
+  // References are never swizzled with this pool, so there are no swips to
+  // track and no swizzler to call.
+  void RegisterFile(File *file, Wal *wal = nullptr, Swizzler *swizzler = nullptr);
+  void UnregisterFile(File *file);
+  lsn_t Checkpoint(File *file);
+
+  // The frame index of a page is its page number.
+  uint32_t GetFrameIndex(const Page *frame) const { return frame - page_frames; }
+  Page *GetFrame(uint32_t index) const { return &page_frames[index]; }
+  uint32_t GetFrameCount() const { return virtual_pages; }
+  Page *FrameOf(const void *page_data) const {
+    return &page_frames[(static_cast<const char *>(page_data) - reinterpret_cast<const char *>(page_frames)) / sizeof(Page)];
+  }
+
+  Page *GetSwipOwner(const Page *) const { return nullptr; }
+  void SetSwipOwner(const Page *, const Page *) {}
+
+ private:
+  // Page numbers take 24 bits (see PageId).
+  static constexpr pagenum_t kMaxVirtualPages = pagenum_t{1} << 24;
+
+  // Structure of a state word:
+  // ---16 bits---|---16 bits---|---32 bits---|
+  //     State    |  Reference  |  Pin count  |
+  // Pins are only taken on resident pages. Loading and Evicting pages are held
+  // exclusively by the thread that moves them; other threads wait.
+  static constexpr uint64_t kEvicted = 0;
+  static constexpr uint64_t kLoading = uint64_t{1} << 48;
+  static constexpr uint64_t kResident = uint64_t{2} << 48;
+  static constexpr uint64_t kEvicting = uint64_t{3} << 48;
+  static constexpr uint64_t kStateMask = uint64_t{0xffff} << 48;
+  static constexpr int kUsedShift = 32;
+  static constexpr uint64_t kUsedMask = uint64_t{0xffff} << kUsedShift;
+  static constexpr uint64_t kPinMask = 0xffffffff;
+
+  // Slot values other than page numbers.
+  static constexpr pagenum_t kFreeSlot = ~pagenum_t{0};
+  static constexpr pagenum_t kBusySlot = kFreeSlot - 1;  // Being evicted or loaded
+
+  std::atomic<uint64_t> &GetState(const Page *frame) const { return page_states[GetFrameIndex(frame)]; }
+
+  // Pin a page that is resident, waiting for it if it is being loaded or
+  // evicted. Returns nullptr if it is not resident. Does not count as a use.
+  Page *PinResident(pagenum_t page_num);
+
+  // Evict the page in a slot using CLOCK, write it back if dirty and give its
+  // frame's memory back. Returns the slot, which the caller owns (kBusySlot)
+  // until it stores the page number of the page it loads.
+  uint32_t EvictSlot();
+
+  // Publish a page the caller loaded into its frame: reset the frame header,
+  // record the page in slot and make it resident with pins pins.
+  void FinishLoad(pagenum_t page_num, uint32_t slot, uint16_t page_mode, uint32_t pins);
+
+  // Background write-back ahead of the CLOCK hand, see BufferManager.
+  void CleanerLoop();
+  size_t CleanBatch();
+  static constexpr uint32_t kMaxCleanBatch = 64;
+
+  // Copy the page in frame for writing it back and clear its dirty flag, see
+  // BufferManager::CopyForWrite.
+  bool CopyForWrite(Page *frame, Page &copy, bool wait);
+
+  static constexpr uint32_t kMaxPrefetch = 64;
+  uint32_t max_prefetch;
+  static constexpr uint32_t kMaxCheckpointBatch = 64;
+  uint32_t checkpoint_batch;
+
+  uint32_t clean_target;
+  std::thread cleaner;
+  std::atomic<bool> cleaner_stop{false};
+
+  File *file{nullptr};
+  fileid_t fid;
+  Wal *wal{nullptr};
+
+  // Flush the log up to the highest LSN of the pages about to be written.
+  template <class Pages>
+  void FlushLogFor(const Pages &pages) {
+    if (!wal) {
+      return;
+    }
+    lsn_t lsn = 0;
+    for (auto &p : pages) {
+      lsn_t page_lsn;
+      std::memcpy(&page_lsn, p.second->GetRealPage(), sizeof(page_lsn));
+      lsn = std::max(lsn, page_lsn);
+    }
+    wal->Flush(lsn);
+  }
+
+  // Number of slots, i.e., of resident pages
+  uint32_t page_count;
+  // Number of frames in the region
+  uint32_t virtual_pages;
+
+  // The region: one frame per page number
+  Page *page_frames;
+  // One state word per page number, in a region of its own
+  std::atomic<uint64_t> *page_states;
+  // Page number held in each slot
+  std::unique_ptr<std::atomic<pagenum_t>[]> slots;
+
+  // CLOCK hand over the slots
+  std::atomic<uint64_t> slot_cur{0};
+
+  // Prevent unintentional copies
+  VmBufferManager(const VmBufferManager&) = delete;
+  VmBufferManager(VmBufferManager&&) = delete;
+  VmBufferManager &operator=(const VmBufferManager&) = delete;
+  VmBufferManager &operator=(VmBufferManager&&) = delete;
+};
+
+#endif  // B_TREE_VM_BUFFER_H
@@ -0,0 +1,232 @@
+#include "wal.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+Wal::Wal(const std::string &file_name, bool trunc, size_t buffer_size) : capacity{buffer_size} {
+  int flags = O_CREAT | O_RDWR | (trunc ? O_TRUNC : 0);
+  fd = open(file_name.data(), flags, S_IRUSR | S_IWUSR);
+  PCHECK(fd > 0) << "Can't open the log " << file_name;
+
+  FileHeader header{};
+  if (pread(fd, &header, sizeof(header), 0) == sizeof(header) && header.magic == kMagic) {
+    base = header.base;
+    checkpoint = std::max(header.checkpoint, base);
+  } else {
+    PCHECK(ftruncate(fd, 0) == 0);
+    WriteHeader();
+  }
+  next_lsn = durable_lsn = Scan(nullptr);
+  // Drop a torn tail, so that it is not mistaken for records later.
+  PCHECK(ftruncate(fd, kHeaderSize + (next_lsn - base)) == 0);
+
+  active.reserve(capacity);
+  flushing.reserve(capacity);
+  flusher = std::thread(&Wal::FlusherLoop, this);
+}
+
+Wal::~Wal() {
+  {
+    std::lock_guard<std::mutex> guard(latch);
+    stop = true;
+  }
+  work.notify_one();
+  flusher.join();
+  PCHECK(close(fd) == 0);
+}
+
+uint64_t Wal::Seed(const RecordHeader &header) {
+  return 0xcbf29ce484222325ull ^ (uint64_t{header.size} << 16 | static_cast<uint16_t>(header.type));
+}
+
+uint64_t Wal::Checksum(uint64_t seed, const char *data, size_t len) {
+  constexpr uint64_t kPrime = 0x100000001b3ull;
+  uint64_t h = seed;
+  size_t i = 0;
+  for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+    uint64_t word;
+    std::memcpy(&word, data + i, sizeof(word));
+    h = (h ^ word) * kPrime;
+    h ^= h >> 29;
+  }
+  for (; i < len; ++i) {
+    h = (h ^ static_cast<uint8_t>(data[i])) * kPrime;
+  }
+  return h;
+}
+
+lsn_t Wal::Append(LogType type, const void *head, uint32_t head_size, const void *body,
+                  uint32_t body_size) {
+  DCHECK(head_size % sizeof(uint64_t) == 0 || body_size == 0);
+  RecordHeader header{head_size + body_size, type, 0, 0};
+  header.checksum = Checksum(Checksum(Seed(header), static_cast<const char *>(head), head_size),
+                             static_cast<const char *>(body), body_size);
+  size_t len = sizeof(header) + header.size;
+  CHECK(len <= capacity) << "Log record of " << len << " bytes does not fit in the log buffer.";
+
+  std::unique_lock<std::mutex> guard(latch);
+  while (active.size() + len > capacity) {
+    // The buffer is full; wait for the flusher to take it.
+    requested_lsn = std::max(requested_lsn, next_lsn);
+    work.notify_one();
+    flushed.wait(guard);
+  }
+  auto *h = reinterpret_cast<const char *>(&header);
+  active.insert(active.end(), h, h + sizeof(header));
+  active.insert(active.end(), static_cast<const char *>(head), static_cast<const char *>(head) + head_size);
+  if (body_size > 0) {
+    active.insert(active.end(), static_cast<const char *>(body), static_cast<const char *>(body) + body_size);
+  }
+  next_lsn += len;
+  lsn_t lsn = next_lsn;
+  if (active.size() >= capacity / 2) {
+    work.notify_one();
+  }
+  return lsn;
+}
+
+void Wal::Flush(lsn_t lsn) {
+  std::unique_lock<std::mutex> guard(latch);
+  if (durable_lsn >= lsn) {
+    return;
+  }
+  requested_lsn = std::max(requested_lsn, lsn);
+  work.notify_one();
+  flushed.wait(guard, [&] { return durable_lsn >= lsn; });
+}
+
+lsn_t Wal::CurrentLsn() {
+  std::lock_guard<std::mutex> guard(latch);
+  return next_lsn;
+}
+
+lsn_t Wal::DurableLsn() {
+  std::lock_guard<std::mutex> guard(latch);
+  return durable_lsn;
+}
+
+void Wal::FlusherLoop() {
+  std::unique_lock<std::mutex> guard(latch);
+  while (true) {
+    work.wait_for(guard, kFlushInterval, [&] {
+      return stop || requested_lsn > durable_lsn || active.size() >= capacity / 2;
+    });
+    if (active.empty()) {
+      if (stop) break;
+      continue;
+    }
+    // Appends go on into the other buffer while this one is written.
+    active.swap(flushing);
+    lsn_t end = next_lsn;
+    off_t offset = kHeaderSize + (durable_lsn - base);
+    guard.unlock();
+
+    size_t done = 0;
+    while (done < flushing.size()) {
+      ssize_t ret = pwrite(fd, flushing.data() + done, flushing.size() - done, offset + done);
+      PCHECK(ret > 0) << "Can't write the log.";
+      done += ret;
+    }
+    PCHECK(fdatasync(fd) == 0) << "Can't sync the log.";
+
+    guard.lock();
+    flushing.clear();
+    durable_lsn = end;
+    flushed.notify_all();
+  }
+}
+
+void Wal::WriteHeader() {
+  FileHeader header{kMagic, base, checkpoint};
+  PCHECK(pwrite(fd, &header, sizeof(header), 0) == sizeof(header));
+  PCHECK(fdatasync(fd) == 0);
+}
+
+lsn_t Wal::Scan(const std::function<void(LogType, const char *, uint32_t, lsn_t)> *apply) {
+  struct stat st;
+  PCHECK(fstat(fd, &st) == 0);
+  const off_t file_end = st.st_size;
+
+  // Records are read through a window of the file.
+  constexpr size_t kWindow = 8 << 20;
+  std::vector<char> window(kWindow);
+  off_t window_start = 0;
+  size_t window_len = 0;
+  auto fetch = [&](off_t off, size_t len) -> const char * {
+    if (off + static_cast<off_t>(len) > file_end) {
+      return nullptr;
+    }
+    if (off < window_start || off + len > window_start + window_len) {
+      window.resize(std::max(window.size(), len));
+      window_len = std::min<off_t>(window.size(), file_end - off);
+      PCHECK(pread(fd, window.data(), window_len, off) == static_cast<ssize_t>(window_len));
+      window_start = off;
+    }
+    return window.data() + (off - window_start);
+  };
+
+  off_t off = kHeaderSize + (checkpoint - base);
+  while (const char *h = fetch(off, sizeof(RecordHeader))) {
+    RecordHeader header;
+    std::memcpy(&header, h, sizeof(header));
+    if (header.type == LogType::kInvalid || sizeof(header) + header.size > capacity) {
+      break;
+    }
+    const char *payload = fetch(off + sizeof(header), header.size);
+    if (!payload || Checksum(Seed(header), payload, header.size) != header.checksum) {
+      break;
+    }
+    off += sizeof(header) + header.size;
+    if (apply) {
+      (*apply)(header.type, payload, header.size, base + (off - kHeaderSize));
+    }
+  }
+  return base + (off - kHeaderSize);
+}
+
+void Wal::Replay(const std::function<void(LogType type, const char *payload, uint32_t size, lsn_t lsn)> &apply) {
+  Scan(&apply);
+}
+
+void Wal::Truncate() {
+  Flush(CurrentLsn());
+  std::lock_guard<std::mutex> guard(latch);
+  DCHECK(active.empty() && flushing.empty()) << "The log is truncated while records are appended.";
+  // Checkpoint at the end of the log before dropping its records, so that a
+  // crash at any step reopens the log at next_lsn: with the old base, replay
+  // starts past the end of the truncated file, and later records keep their
+  // offsets from it. Only then is the base moved.
+  checkpoint = next_lsn;
+  WriteHeader();
+  PCHECK(ftruncate(fd, kHeaderSize) == 0);
+  PCHECK(fdatasync(fd) == 0);
+  base = next_lsn;
+  WriteHeader();
+}
+
+void Wal::Checkpoint(lsn_t lsn) {
+  // Replay must find the log intact from the checkpoint on.
+  Flush(lsn);
+  {
+    std::lock_guard<std::mutex> guard(latch);
+    if (lsn <= checkpoint) {
+      return;
+    }
+    checkpoint = lsn;
+  }
+  // Appends go on while the header is written.
+  WriteHeader();
+  // Punch out the records before the checkpoint in whole blocks. The file
+  // keeps its size, so the offsets of later records do not change.
+  constexpr off_t kBlock = 4096;
+  off_t end = (kHeaderSize + static_cast<off_t>(checkpoint - base)) / kBlock * kBlock;
+  if (end > kHeaderSize) {
+    int ret = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, kHeaderSize, end - kHeaderSize);
+    PLOG_IF(WARNING, ret != 0 && errno != EOPNOTSUPP) << "Can't free the log before the checkpoint.";
+  }
+}
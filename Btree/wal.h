@@ -0,0 +1,132 @@
+#pragma once
+#ifndef B_TREE_WAL_H
+#define B_TREE_WAL_H
+
+#include <glog/logging.h>
+
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../include/types.hpp"
+
+// Types of the records in the write-ahead log.
+enum class LogType : uint16_t {
+  kInvalid = 0,
+  kBtreeLeafInsert = 1,  // Btree: entry inserted into a leaf
+  kBtreeLeafRemove = 2,  // Btree: entry removed from a leaf
+  kBtreePageImage = 3,   // Btree: full after-image of a page (splits, merges)
+  kRecordWrite = 4,      // DbBtree: record written to the data file
+};
+
+// Write-ahead log with group commit.
+//
+// Records are appended to an in-memory log buffer. A background thread writes
+// the buffer to the log file with sequential writes and one fdatasync per
+// batch, so the records of all threads that committed meanwhile become durable
+// together. The LSN of a record is the log offset of its end: the log is
+// durable up to an LSN once all records ending at or before it are.
+//
+// Pages of a logged file keep the LSN of the last record applied to them in
+// their first bytes (see BufferManager::RegisterFile). A page is only written back
+// once the log is durable up to that LSN, and on redo a record is only applied
+// to a page whose LSN is lower, so replaying the log is idempotent.
+//
+// The log is replayed on open by its users and truncated once everything it
+// describes is on disk (e.g., at a clean shutdown). In between, a checkpoint
+// moves the start of the replay forward (see Checkpoint).
+class Wal {
+ public:
+  // @file_name: log file, created if it does not exist
+  // @trunc: start with an empty log
+  explicit Wal(const std::string &file_name, bool trunc, size_t buffer_size = kDefaultBufferSize);
+  ~Wal();
+
+  // Append a record whose payload is head followed by body. head_size must be
+  // a multiple of 8. Returns the LSN of the record. The record is durable once
+  // Flush() or Commit() returns.
+  lsn_t Append(LogType type, const void *head, uint32_t head_size,
+               const void *body = nullptr, uint32_t body_size = 0);
+
+  // Wait until the log is durable up to lsn.
+  void Flush(lsn_t lsn);
+
+  // Wait until all records appended so far, including the caller's, are
+  // durable. Concurrent commits share one log write.
+  void Commit() { Flush(CurrentLsn()); }
+
+  lsn_t CurrentLsn();
+  lsn_t DurableLsn();
+
+  // Call apply for every valid record in the log, in log order. The log ends at
+  // the first torn or corrupted record. Must not run concurrently with Append.
+  void Replay(const std::function<void(LogType type, const char *payload, uint32_t size, lsn_t lsn)> &apply);
+
+  // Drop all records. The caller guarantees that everything they describe is
+  // on disk. LSNs keep increasing across truncations.
+  void Truncate();
+
+  // Record a checkpoint at lsn: replay starts there from now on. The caller
+  // guarantees that everything the records up to lsn describe is on disk. The
+  // space of those records is given back to the file system. Must not run
+  // concurrently with another Checkpoint or with Truncate.
+  void Checkpoint(lsn_t lsn);
+
+ private:
+  static constexpr size_t kDefaultBufferSize = 4 << 20;
+  static constexpr uint64_t kMagic = 0x4c41572d45455254;  // "TREE-WAL"
+  // Longest time a record waits in the buffer if nobody commits.
+  static constexpr auto kFlushInterval = std::chrono::milliseconds(1);
+
+  struct FileHeader {
+    uint64_t magic;
+    lsn_t base;        // LSN of the first byte after the header
+    lsn_t checkpoint;  // LSN where replay starts, 0 if base
+  };
+  static constexpr off_t kHeaderSize = 512;
+
+  struct RecordHeader {
+    uint32_t size;  // Payload bytes
+    LogType type;
+    uint16_t unused;
+    uint64_t checksum;  // Of the payload, the size and the type
+  };
+  static_assert(sizeof(RecordHeader) == 16);
+
+  // Checksum of the payload, continued from seed. Consumes 8 bytes at a time,
+  // so a payload checksummed in parts gives the same result as long as all but
+  // the last part are multiples of 8 bytes long.
+  static uint64_t Checksum(uint64_t seed, const char *data, size_t len);
+  static uint64_t Seed(const RecordHeader &header);
+  void WriteHeader();
+  // Scan the log for its end and return it. Calls apply, if given, for every
+  // record up to the end.
+  lsn_t Scan(const std::function<void(LogType, const char *, uint32_t, lsn_t)> *apply);
+  void FlusherLoop();
+
+  int fd;
+  lsn_t base{0};
+  lsn_t checkpoint{0};
+  size_t capacity;
+
+  std::mutex latch;  // Protects everything below
+  std::condition_variable work;      // The flusher has work to do
+  std::condition_variable flushed;   // durable_lsn advanced
+  std::vector<char> active;          // Records being appended
+  std::vector<char> flushing;        // Records being written by the flusher
+  lsn_t next_lsn{0};                 // LSN at the end of active
+  lsn_t durable_lsn{0};
+  lsn_t requested_lsn{0};            // Highest LSN a thread waits for
+  bool stop{false};
+  std::thread flusher;
+
+  Wal(const Wal &) = delete;
+  Wal &operator=(const Wal &) = delete;
+};
+
+#endif  // B_TREE_WAL_H
@@ -206,6 +206,17 @@ class TlsAllocator : public IAllocator {
       numa_memory_[i] = (char *)mmap(
           nullptr, kNumaMemorySize, PROT_READ | PROT_WRITE,
           MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+      if (numa_memory_[i] == MAP_FAILED) {
+        // Not enough huge pages reserved: fall back to transparent huge pages,
+        // backed on first touch.
+        LOG(WARNING) << "Can't map the slabs of NUMA node " << i
+                     << " with huge pages, using transparent huge pages instead.";
+        numa_memory_[i] = (char *)mmap(
+            nullptr, kNumaMemorySize, PROT_READ | PROT_WRITE,
+            MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+        PCHECK(numa_memory_[i] != MAP_FAILED) << "Can't map the slabs of NUMA node " << i;
+        madvise(numa_memory_[i], kNumaMemorySize, MADV_HUGEPAGE);
+      }
 
       numa_allocated_[i] = 0;
     }
@@ -1,121 +1,435 @@
 #pragma once
 
 #include "File.h"
+#include <atomic>
+#include <chrono>
 #include <cstdio>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
 #include <memory>
+#include <mutex>
+#include <thread>
+#include <sys/mman.h>
 #include <absl/container/flat_hash_map.h>
-
-#define CACHELINE_SIZE 64
+#include "../include/eviction_policy.hpp"
+#include "../include/huge_pages.hpp"
+#include "../include/memory_broker.hpp"
+#include "../include/numa_partitions.hpp"
 
 //Make sure alignment as 16
+// A frame with the exclusive bit set in pin_count is taken by one thread,
+// e.g., for eviction, and cannot be pinned until it is released.
 struct BufferMeta {
-    size_t page_id;
-    uint32_t pin_count;
-    uint16_t clock_count;
-    uint16_t dirty;
+    size_t page_id = 0;  // 0 if the frame holds no page
+    std::atomic<uint32_t> pin_count{0};
+    std::atomic<uint8_t> dirty{0};
+    std::atomic<uint8_t> loading{0};  // The page is being read in
 };
 
-class HtBufferManager {
+// Frames are replaced by the policy selected with EvictionPolicy::SetDefault.
+//
+// The pool is thread-safe, so that threads can share a table. Like the btree
+// pool, the page table is split into shards with a latch each. A miss claims
+// a frame exclusively, evicts its page, publishes the new mapping and then
+// reads the page in; concurrent pins of the same page wait for the read.
+//
+// The pool is resizable (see ResizablePool): it starts out with all
+// buffer_size frames in use, and the frames it parks give their memory back
+// to the OS, unless they are hugetlbfs pages. A new capacity is only applied
+// by ResizeStep, between the writes of the threads that use the pool.
+//
+// A pool that threads on several nodes share can be numa_partitioned like the
+// btree pool (see NumaPartitions): a miss takes a frame of the thread's own
+// node if it can, and hits on frames of another node count as remote hits. The
+// pool of a single thread is not partitioned; its frames are allocated on the
+// thread's node when it first touches them.
+class HtBufferManager : public ResizablePool {
 public:
-    HtBufferManager(HtFile* hpf, size_t buffer_size): file(hpf), n(buffer_size) {
+    HtBufferManager(HtFile* hpf, size_t buffer_size, bool numa_partitioned = false)
+        : file(hpf), n(buffer_size), metas(new BufferMeta[buffer_size]),
+          capacity(buffer_size), target_capacity(buffer_size) {
         assert(buffer_size % 4 == 0);
-        metas = static_cast<BufferMeta*>(std::aligned_alloc(CACHELINE_SIZE, sizeof(BufferMeta) * n));
-        memset(metas, 0, sizeof(BufferMeta) * n);
-        buffer_frames = static_cast<char*>(std::aligned_alloc(PAGE_SIZE, n * PAGE_SIZE));
-        memset(buffer_frames, 0, PAGE_SIZE * n);
-        lookup_table.clear();
-        clock_hand = 0;
+        // Anonymous memory is zeroed, and only backed once touched unless it
+        // is made of hugetlbfs pages (see HugePages).
+        buffer_frames = static_cast<char*>(HugePages::Map(n * PAGE_SIZE, frames_backing));
+        partitions = NumaPartitions(buffer_size, PAGE_SIZE, frames_backing, numa_partitioned);
+        partitions.Bind(buffer_frames, PAGE_SIZE);
+        if (partitions.GetCount() > 1) {
+            policy = std::make_unique<PartitionedPolicy>(partitions);
+        } else {
+            policy = EvictionPolicy::Make(buffer_size);
+        }
+        parked_frames.resize(partitions.GetCount());
+#if defined(IO_URING)
+        if (UringEngine::Enabled()) {
+            UringEngine::RegisterBuffers(buffer_frames, n * PAGE_SIZE);
+            buffers_registered = true;
+        }
+#endif
     }
 
     ~HtBufferManager() {
         Flush();
-        std::free(metas);
-        std::free(buffer_frames);
+#if defined(IO_URING)
+        if (buffers_registered) UringEngine::UnregisterBuffers(buffer_frames, n * PAGE_SIZE);
+#endif
+        HugePages::Unmap(buffer_frames, n * PAGE_SIZE, frames_backing);
     }
 
     HtFile* GetFile() const {
         return file;
     }
 
-    // These two are for memory safety. Lock manager handles concurrency.
+    BufferStats GetStats() const override {
+        BufferStats stats;
+        for (auto& shard : shards) {
+            stats.hits += shard.hits.load(std::memory_order_relaxed);
+            stats.misses += shard.misses.load(std::memory_order_relaxed);
+            stats.evictions += shard.evictions.load(std::memory_order_relaxed);
+            stats.remote_hits += shard.remote_hits.load(std::memory_order_relaxed);
+        }
+        return stats;
+    }
+
+    // NUMA partitions of the frames, 1 if the pool is not partitioned
+    uint32_t GetPartitionCount() const {
+        return partitions.GetCount();
+    }
+
+    // ResizablePool. GetCapacity returns the capacity the pool was last set
+    // to, which ResizeStep applies.
+    uint32_t GetMaxCapacity() const override {
+        return n;
+    }
+
+    uint32_t GetCapacity() const override {
+        return target_capacity.load(std::memory_order_relaxed);
+    }
+
+    void SetCapacity(uint32_t capacity) override {
+        target_capacity.store(std::clamp<uint32_t>(capacity, 1, n), std::memory_order_relaxed);
+    }
+
+    GhostCache& GetGhostCache() override {
+        return ghosts;
+    }
+
+    // Called by the table after every write. Parks or unparks frames until
+    // the pool has the capacity it was set to; shrinking goes on in the next
+    // steps if the frames left are pinned. One thread resizes at a time, the
+    // others go on. Parked frames stay taken exclusively. Like in the btree
+    // pool, the NUMA partitions keep frames in use in proportion to their
+    // sizes.
+    void ResizeStep() {
+        size_t target = target_capacity.load(std::memory_order_relaxed);
+        if (target == capacity.load(std::memory_order_relaxed)) return;
+        std::unique_lock<std::mutex> guard(resize_latch, std::try_to_lock);
+        if (!guard.owns_lock()) return;
+        size_t capacity = this->capacity.load(std::memory_order_relaxed);
+#if defined(IO_URING)
+        // Registering pinned the frames' memory.
+        if (buffers_registered) {
+            UringEngine::UnregisterBuffers(buffer_frames, n * PAGE_SIZE);
+            buffers_registered = false;
+        }
+#endif
+        auto in_use = [this](uint32_t p) {
+            return uint64_t{partitions.Size(p) - static_cast<uint32_t>(parked_frames[p].size())} * n /
+                   partitions.Size(p);
+        };
+        for (; capacity > target; --capacity) {
+            uint32_t fullest = 0;
+            for (uint32_t p = 1; p < partitions.GetCount(); ++p) {
+                if (in_use(p) > in_use(fullest)) fullest = p;
+            }
+            uint32_t frame_id;
+            {
+                NumaPartitions::LocalScope scope(fullest);
+                frame_id = policy->Victim(claim_unused);
+            }
+            if (frame_id == EvictionPolicy::kNoFrame) break;
+            Evict(frame_id);
+            policy->Withdraw(frame_id);
+            if (HugePages::CanDiscard(frames_backing)) {
+                madvise(buffer_frames + (PAGE_SIZE * frame_id), PAGE_SIZE, MADV_DONTNEED);
+            }
+            parked_frames[partitions.Of(frame_id)].push_back(frame_id);
+        }
+        for (; capacity < target; ++capacity) {
+            uint32_t emptiest = partitions.GetCount();
+            for (uint32_t p = 0; p < partitions.GetCount(); ++p) {
+                if (!parked_frames[p].empty() && (emptiest == partitions.GetCount() || in_use(p) < in_use(emptiest))) {
+                    emptiest = p;
+                }
+            }
+            uint32_t frame_id = parked_frames[emptiest].back();
+            parked_frames[emptiest].pop_back();
+            policy->Free(frame_id);
+            Release(frame_id);
+        }
+        this->capacity.store(capacity, std::memory_order_relaxed);
+        policy->SetCapacity(capacity);
+    }
+
+    const char* GetPolicyName() const {
+        return policy->Name();
+    }
+
+    // These two are for memory safety. The table latches its buckets.
     // Brought in the page.
     size_t PinPage(size_t page_id, char** frame) {
-        auto res = lookup_table.find(page_id);
-        size_t frame_id;
-        if (res == lookup_table.end()) {
-            frame_id = GetFreeFrame();
-            *frame = buffer_frames + (frame_id * PAGE_SIZE);
-            file->ReadPage(page_id, *frame);
-            lookup_table.emplace(page_id, frame_id);
-            metas[frame_id].dirty = 0;
-            metas[frame_id].page_id = page_id;
-            metas[frame_id].pin_count = 1;
-        } else {
-            frame_id = res->second;
-            *frame = buffer_frames + (frame_id * PAGE_SIZE);
-            metas[frame_id].pin_count++;
+        Shard& shard = GetShard(page_id);
+        size_t frame_id = Lookup(shard, page_id);
+        if (frame_id == kNoFrame) {
+            // Evict outside the shard latch, then check that no other thread
+            // brought the page in meanwhile.
+            size_t victim = GetFreeFrame();
+            std::unique_lock<std::mutex> guard(shard.latch);
+            auto [it, inserted] = shard.lookup_table.try_emplace(page_id, victim);
+            if (inserted) {
+                metas[victim].page_id = page_id;
+                metas[victim].loading.store(1, std::memory_order_relaxed);
+                shard.misses.fetch_add(1, std::memory_order_relaxed);
+                guard.unlock();
+                *frame = buffer_frames + (victim * PAGE_SIZE);
+                policy->Admit(victim, page_id, 1);
+                ghosts.Missed(page_id);
+                file->ReadPage(page_id, *frame);
+                metas[victim].loading.store(0, std::memory_order_release);
+                return victim;
+            }
+            guard.unlock();
+            policy->Free(victim);
+            metas[victim].pin_count.fetch_sub(1, std::memory_order_release);
+            frame_id = Lookup(shard, page_id);
+            if (frame_id == kNoFrame) return PinPage(page_id, frame);
+        }
+        *frame = buffer_frames + (frame_id * PAGE_SIZE);
+        policy->Access(frame_id, 1);
+        while (metas[frame_id].loading.load(std::memory_order_acquire)) {
+            std::this_thread::yield();
         }
-        metas[frame_id].clock_count = 1;
         return frame_id;
     }
 
     // Release the page.
     inline void UnpinPage(size_t frame_id) {
-        --metas[frame_id].pin_count;
+        metas[frame_id].pin_count.fetch_sub(1, std::memory_order_release);
     }
 
     inline void MarkDirty(size_t frame_id) {
-        metas[frame_id].dirty = 1;
+        metas[frame_id].dirty.store(1, std::memory_order_relaxed);
     }
 
+    // Free the page pinned in frame_id, and release the pin. Other threads
+    // may still have the page pinned, e.g., to read it optimistically; the
+    // frame is reused once they unpin it.
     void FreePage(size_t frame_id) {
-        assert(metas[frame_id].pin_count == 1);
-        lookup_table.erase(metas[frame_id].page_id);
+        BufferMeta& meta = metas[frame_id];
+        size_t page_id = meta.page_id;
+        {
+            Shard& shard = GetShard(page_id);
+            std::lock_guard<std::mutex> guard(shard.latch);
+            shard.lookup_table.erase(page_id);
+            meta.page_id = 0;
+        }
         //if (metas[frame_id].dirty) {
         //    file->WritePage(metas[frame_id].page_id, buffer_frames + (PAGE_SIZE * frame_id));
         //}
 
-        file->FreePage(metas[frame_id].page_id);
+        file->FreePage(page_id);
 
-        metas[frame_id].pin_count = 0;
-        metas[frame_id].page_id = 0;
-        metas[frame_id].dirty = 0;
-        metas[frame_id].clock_count = 0;
+        meta.dirty.store(0, std::memory_order_relaxed);
+        policy->Free(frame_id);
+        UnpinPage(frame_id);
     }
 
+    // Write back all dirty pages, once no other thread uses the pool.
     void Flush() {
+        std::vector<std::pair<size_t, const char*>> dirty_pages;
         for (size_t i = 0; i < n; ++i) {
-            if (metas[i].dirty) {
-                file->WritePage(metas[i].page_id, buffer_frames + (PAGE_SIZE * i));
-                metas[i].dirty = 0;
+            if (metas[i].dirty.exchange(0, std::memory_order_relaxed)) {
+                dirty_pages.emplace_back(metas[i].page_id, buffer_frames + (PAGE_SIZE * i));
             }
         }
+        file->WritePages(dirty_pages);
         file->Flush();
     }
 
+    // Fuzzy checkpoint. Instead of a background thread, the checkpoint runs in
+    // small steps between writes and never holds the table up for long.
+    // Every interval a checkpoint sweeps the frames, writing up to
+    // kCheckpointBatch dirty pages per step. Its last step writes the pages
+    // dirtied behind the sweep and then the first page, with an fsync: at that
+    // point the file matches the table, except for pages other threads that
+    // share the table had pinned, which are left to the next checkpoint. An
+    // interval of 0 turns checkpoints off.
+    void SetCheckpointInterval(std::chrono::milliseconds interval) {
+        checkpoint_interval = interval;
+        next_checkpoint = std::chrono::steady_clock::now() + interval;
+        checkpointing = false;
+    }
+
+    // Called by the table after every write. One thread takes a step at a
+    // time, the others go on.
+    void CheckpointStep() {
+        if (checkpoint_interval.count() == 0) return;
+        std::unique_lock<std::mutex> guard(checkpoint_latch, std::try_to_lock);
+        if (!guard.owns_lock()) return;
+        if (!checkpointing) {
+            auto now = std::chrono::steady_clock::now();
+            if (now < next_checkpoint) return;
+            next_checkpoint = now + checkpoint_interval;
+            checkpoint_pos = 0;
+            checkpointing = true;
+        }
+
+        // Pages are taken exclusively while they are written, so that no
+        // thread changes them meanwhile.
+        checkpoint_batch.clear();
+        checkpoint_frames.clear();
+        auto collect = [&](size_t i) {
+            if (metas[i].dirty.load(std::memory_order_relaxed) && TryTake(i)) {
+                metas[i].dirty.store(0, std::memory_order_relaxed);
+                checkpoint_batch.emplace_back(metas[i].page_id, buffer_frames + (PAGE_SIZE * i));
+                checkpoint_frames.push_back(i);
+            }
+        };
+        for (; checkpoint_pos < n && checkpoint_batch.size() < kCheckpointBatch; ++checkpoint_pos) {
+            collect(checkpoint_pos);
+        }
+        if (checkpoint_pos == n) {
+            for (size_t i = 0; i < n; ++i) {
+                collect(i);
+            }
+            checkpointing = false;
+        }
+        file->WritePages(checkpoint_batch);
+        for (size_t i : checkpoint_frames) {
+            metas[i].pin_count.fetch_sub(kExclusive, std::memory_order_release);
+        }
+        if (!checkpointing) {
+            file->Flush();
+        }
+    }
+
 private:
+    static constexpr size_t kNoFrame = ~size_t{0};
+    static constexpr uint32_t kExclusive = 1u << 31;
+
+    // Number of page table partitions, must be a power of two
+    static constexpr size_t kNumShards = 64;
+
+    // A partition of the page number - frame mapping, see the btree's
+    // BufferManager. Frames are pinned under the latch of their page's shard.
+    struct alignas(64) Shard {
+        std::mutex latch;
+        absl::flat_hash_map<size_t, size_t> lookup_table;
+        std::atomic<uint64_t> hits{0};
+        std::atomic<uint64_t> misses{0};
+        std::atomic<uint64_t> evictions{0};
+        std::atomic<uint64_t> remote_hits{0};  // See NumaPartitions
+    };
+
+    Shard& GetShard(size_t page_id) {
+        return shards[(page_id ^ (page_id >> 16)) & (kNumShards - 1)];
+    }
+
+    // Pin the frame of page_id, waiting while it is taken exclusively.
+    // Returns kNoFrame if the page is not in the pool.
+    size_t Lookup(Shard& shard, size_t page_id) {
+        while (true) {
+            {
+                std::lock_guard<std::mutex> guard(shard.latch);
+                auto res = shard.lookup_table.find(page_id);
+                if (res == shard.lookup_table.end()) return kNoFrame;
+                size_t frame_id = res->second;
+                if (!(metas[frame_id].pin_count.fetch_add(1, std::memory_order_acquire) & kExclusive)) {
+                    shard.hits.fetch_add(1, std::memory_order_relaxed);
+                    if (partitions.GetCount() > 1 && partitions.Of(frame_id) != partitions.Local()) {
+                        shard.remote_hits.fetch_add(1, std::memory_order_relaxed);
+                    }
+                    return frame_id;
+                }
+                metas[frame_id].pin_count.fetch_sub(1, std::memory_order_relaxed);
+            }
+            std::this_thread::yield();
+        }
+    }
+
+    // Take frame_id exclusively if nobody has it pinned.
+    bool TryTake(size_t frame_id) {
+        uint32_t unpinned = 0;
+        return metas[frame_id].pin_count.compare_exchange_strong(unpinned, kExclusive, std::memory_order_acquire);
+    }
+
+    // Turn a frame taken exclusively into a free one. The exclusive bit is
+    // subtracted rather than cleared, as Lookup may briefly count a pin on
+    // the frame meanwhile.
+    void Release(size_t frame_id) {
+        metas[frame_id].pin_count.fetch_sub(kExclusive, std::memory_order_release);
+    }
+
+    // Returns a frame that holds no page, pinned once.
     size_t GetFreeFrame() {
-        while (metas[clock_hand].pin_count > 0 || metas[clock_hand].clock_count > 0) {
-            if (metas[clock_hand].pin_count == 0) --metas[clock_hand].clock_count;
-            clock_hand = (++clock_hand >= n) ? 0 : clock_hand;
+        uint32_t frame_id = EvictionPolicy::kNoFrame;
+        while (frame_id == EvictionPolicy::kNoFrame) {
+            frame_id = policy->Victim(claim_unused);
+        }
+        Evict(frame_id);
+        metas[frame_id].pin_count.fetch_sub(kExclusive - 1, std::memory_order_relaxed);
+        return frame_id;
+    }
+
+    // Evict the page in frame_id, if any, taken with Victim. The page is
+    // written back before it leaves the page table, so that a miss on it
+    // does not read an old version.
+    void Evict(size_t frame_id) {
+        BufferMeta& meta = metas[frame_id];
+        if (meta.page_id == 0) return;
+        if (meta.dirty.exchange(0, std::memory_order_relaxed)) {
+            file->WritePage(meta.page_id, buffer_frames + (PAGE_SIZE * frame_id));
         }
-        //Evict
-        lookup_table.erase(metas[clock_hand].page_id);
-        if (metas[clock_hand].dirty) {
-            file->WritePage(metas[clock_hand].page_id, buffer_frames + (PAGE_SIZE * clock_hand));
+        Shard& shard = GetShard(meta.page_id);
+        {
+            std::lock_guard<std::mutex> guard(shard.latch);
+            shard.lookup_table.erase(meta.page_id);
+            shard.evictions.fetch_add(1, std::memory_order_relaxed);
         }
-        return clock_hand;
+        policy->Evicted(frame_id);
+        ghosts.Evicted(meta.page_id);
+        meta.page_id = 0;
     }
 
-    absl::flat_hash_map<size_t, size_t> lookup_table;
+    static constexpr size_t kCheckpointBatch = 8;
+    std::chrono::milliseconds checkpoint_interval{0};
+    std::chrono::steady_clock::time_point next_checkpoint;
+    bool checkpointing = false;
+    size_t checkpoint_pos = 0;  // Next frame the sweep visits
+    std::vector<std::pair<size_t, const char*>> checkpoint_batch;
+    std::vector<size_t> checkpoint_frames;  // Taken while the batch is written
+    std::mutex checkpoint_latch;  // Protects the checkpoint state
+
+    Shard shards[kNumShards];
     HtFile* file;
     size_t n;
-    size_t clock_hand;
-    BufferMeta* metas;
+    std::unique_ptr<BufferMeta[]> metas;
     char* buffer_frames;
-};
+    HugePages::Kind frames_backing;
+    NumaPartitions partitions;  // Of the frames
+    std::unique_ptr<EvictionPolicy> policy;
 
-#undef CACHELINE_SIZE
\ No newline at end of file
+    // Resizing. Parked frames are out of use, withdrawn from the policy and
+    // taken exclusively, so that the CLOCK hand, which may still offer them,
+    // cannot claim them.
+    std::vector<std::vector<uint32_t>> parked_frames;  // Of each NUMA partition
+    std::atomic<size_t> capacity;
+    std::atomic<uint32_t> target_capacity;
+    std::mutex resize_latch;  // Protects parked_frames and resizing
+    GhostCache ghosts;
+    std::function<bool(uint32_t)> claim_unused = [this](uint32_t i) { return TryTake(i); };
+#if defined(IO_URING)
+    bool buffers_registered = false;
+#endif
+};
@@ -4,20 +4,35 @@
 #define EXPAND_SIZE 1024 * PAGE_SIZE
 #define _FILE_OFFSET_BITS 64
 
+#include <cerrno>
 #include <cstdio>
 #include <cassert>
 #include <fcntl.h>
+#include <linux/falloc.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <string>
 #include <cstring>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#if defined(IO_URING)
+#include "../include/uring_engine.hpp"
+#endif
 
 alignas(512) const char dummy_page[PAGE_SIZE] = {0};
 
 // Meta Level Page Structure
-// First Page: first 8 bytes, first free page no, second 8 bytes, effect file size.
-// Every Page if empty page first 8 bytes -> next free page.
+// First Page: first 8 bytes, first page of the free map, second 8 bytes, effect file size,
+// third 8 bytes and the rest, fields of the table.
+// The free map is a bitmap of the free pages, kept in memory and written by
+// Flush to a chain of map pages: first 8 bytes next map page, then the bits of
+// the next kMapBits pages. Freed pages are punched out of the file, and
+// TruncPage zeroes a page with fallocate instead of writing it.
+// Page I/O is thread-safe; the first page and the free map are changed under
+// alloc_latch.
 
 class HtFile {
 public:
@@ -30,11 +45,14 @@ public:
 
         fd = open(path.c_str(), flags, S_IRUSR | S_IWUSR);
         assert(fd > 0);
+#if defined(IO_URING)
+        if (UringEngine::Enabled()) UringEngine::RegisterFile(fd);
+#endif
 
         struct stat buf;
         fstat(fd, &buf);
 
-        first_free_page = reinterpret_cast<size_t*>(first_page);
+        free_map_head = reinterpret_cast<size_t*>(first_page);
         fsize = reinterpret_cast<size_t*>(first_page + sizeof(size_t));
         if (buf.st_size < PAGE_SIZE) {
             posix_fallocate(fd, 0, PAGE_SIZE);
@@ -53,7 +71,7 @@ public:
         }
         fstat(fd, &buf);
         flen = std::max((size_t)buf.st_size, init_size);
-
+        ReadFreeMap();
     }
 
     size_t GetThirdField() {
@@ -67,85 +85,215 @@ public:
         fsync(fd);
     }
 
+    // The rest of the first page holds fields of the table. Unlike the third
+    // field, they are only written to the file by Flush.
+    static constexpr size_t kTableFields = PAGE_SIZE / sizeof(size_t) - 3;
+
+    size_t GetTableField(size_t i) {
+        std::lock_guard<std::mutex> guard(alloc_latch);
+        return *reinterpret_cast<size_t*>(first_page + sizeof(size_t) * (3 + i));
+    }
+
+    void SetTableField(size_t i, size_t x) {
+        std::lock_guard<std::mutex> guard(alloc_latch);
+        *reinterpret_cast<size_t*>(first_page + sizeof(size_t) * (3 + i)) = x;
+    }
+
     inline void ReadPage(size_t page_id, char* buf) {
+#if defined(IO_URING)
+        if (UringEngine::Enabled()) {
+            auto &ring = UringEngine::Local();
+            ring.PrepRead(fd, buf, PAGE_SIZE, PAGE_SIZE * page_id);
+            bool ok = ring.SubmitAndWait();
+            assert(ok && ring.LastResult() == PAGE_SIZE);
+            return;
+        }
+#endif
         int res = pread(fd, buf, PAGE_SIZE, PAGE_SIZE * page_id);
         assert(res == PAGE_SIZE);
     }
 
     inline void WritePage(size_t page_id, const char* buf) {
         // XX: Force fsync here??
-        int res = pwrite(fd, buf, PAGE_SIZE, PAGE_SIZE * page_id);
-        assert(res == PAGE_SIZE);
+#if defined(IO_URING)
+        if (UringEngine::Enabled()) {
+            auto &ring = UringEngine::Local();
+            ring.PrepWrite(fd, buf, PAGE_SIZE, PAGE_SIZE * page_id);
+            bool ok = ring.SubmitAndWait();
+            assert(ok);
+        } else
+#endif
+        {
+            int res = pwrite(fd, buf, PAGE_SIZE, PAGE_SIZE * page_id);
+            assert(res == PAGE_SIZE);
+        }
 #ifdef FORCE_FSYNC
         fsync(fd);
 #endif
     }
 
-    // Make sure the page number returned is available to write, doesn't need to guarantee
-    // it is zeroed.
-    size_t AllocatePage() {
-        if (*first_free_page != 0) {
-            char buf[PAGE_SIZE];
-            int res = pread(fd, buf, PAGE_SIZE, PAGE_SIZE * (*first_free_page));
-            assert(res == PAGE_SIZE);
-            size_t next_free_page = *reinterpret_cast<size_t*>(buf);
-            size_t ans = *first_free_page;
-            *first_free_page = next_free_page;
-#ifdef FORCE_FSYNC
-            Flush();
+    // Read/write a batch of (page no, buffer) pairs. With io_uring all pages of
+    // a batch are in flight at the same time.
+    void ReadPages(const std::vector<std::pair<size_t, char*>>& pages) {
+#if defined(IO_URING)
+        if (UringEngine::Enabled()) {
+            auto &ring = UringEngine::Local();
+            for (auto &p : pages) {
+                ring.PrepRead(fd, p.second, PAGE_SIZE, PAGE_SIZE * p.first);
+            }
+            bool ok = ring.SubmitAndWait();
+            assert(ok);
+            return;
+        }
 #endif
-            return ans;
-        } else {
-            if ((*fsize) + 1 >= flen / PAGE_SIZE) {
-                int ret = posix_fallocate(fd, flen, EXPAND_SIZE);
-                if (ret != 0) return 0;
-                flen += EXPAND_SIZE;
+        for (auto &p : pages) {
+            ReadPage(p.first, p.second);
+        }
+    }
+
+    void WritePages(const std::vector<std::pair<size_t, const char*>>& pages) {
+#if defined(IO_URING)
+        if (UringEngine::Enabled()) {
+            auto &ring = UringEngine::Local();
+            for (auto &p : pages) {
+                ring.PrepWrite(fd, p.second, PAGE_SIZE, PAGE_SIZE * p.first);
             }
-            ++(*fsize);
+            bool ok = ring.SubmitAndWait();
+            assert(ok);
 #ifdef FORCE_FSYNC
-            Flush();
+            fsync(fd);
+#endif
+            return;
+        }
 #endif
-            return *fsize;
+        for (auto &p : pages) {
+            WritePage(p.first, p.second);
         }
     }
 
+    // Make sure the page number returned is available to write, doesn't need to guarantee
+    // it is zeroed.
+    size_t AllocatePage() {
+        std::lock_guard<std::mutex> guard(alloc_latch);
+        size_t page_id = AllocatePageLocked();
+#ifdef FORCE_FSYNC
+        WriteFreeMap();
+        fsync(fd);
+#endif
+        return page_id;
+    }
+
     void FreePage(size_t page_id) {
-        char buf[PAGE_SIZE] = {0};
-        *reinterpret_cast<size_t*>(buf) = *first_free_page;
-        int res = pwrite(fd, buf, PAGE_SIZE, page_id * PAGE_SIZE);
-        assert(res == PAGE_SIZE);
-        *first_free_page = page_id;
+        // Punch the page out before it can be allocated again.
+        fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, page_id * PAGE_SIZE, PAGE_SIZE);
+        std::lock_guard<std::mutex> guard(alloc_latch);
+        if (free_map.size() <= page_id / 64) free_map.resize(page_id / 64 + 1, 0);
+        assert(!(free_map[page_id / 64] & (uint64_t{1} << (page_id % 64))));
+        free_map[page_id / 64] |= uint64_t{1} << (page_id % 64);
+        free_hint = std::min(free_hint, page_id / 64);
+        ++n_free;
 #ifdef FORCE_FSYNC
-        Flush();
+        WriteFreeMap();
+        fsync(fd);
 #endif
     }
 
     void TruncPage(size_t page_id) {
-        int res = pwrite(fd, dummy_page, PAGE_SIZE, page_id * PAGE_SIZE);
-        assert(res == PAGE_SIZE);
+        if (fallocate(fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, page_id * PAGE_SIZE, PAGE_SIZE) != 0) {
+            // The file system cannot zero ranges.
+            assert(errno == EOPNOTSUPP);
+            int res = pwrite(fd, dummy_page, PAGE_SIZE, page_id * PAGE_SIZE);
+            assert(res == PAGE_SIZE);
+        }
 #ifdef FORCE_FSYNC
         fsync(fd);
 #endif
     }
 
+    // Pages in the free map
+    size_t GetFreePages() {
+        std::lock_guard<std::mutex> guard(alloc_latch);
+        return n_free;
+    }
+
     void Flush() {
-#ifndef FORCE_FSYNC
-        int res = pwrite(fd, first_page, PAGE_SIZE, 0);
-        assert(res == PAGE_SIZE);
-#endif
+        std::unique_lock<std::mutex> guard(alloc_latch);
+        WriteFreeMap();
+        guard.unlock();
         fsync(fd);
     }
 
     ~HtFile() {
         Flush();
         fsync(fd);
+#if defined(IO_URING)
+        if (UringEngine::Enabled()) UringEngine::UnregisterFile(fd);
+#endif
         close(fd);
     }
 private:
+    static constexpr size_t kMapWords = PAGE_SIZE / sizeof(uint64_t) - 1;
+    static constexpr size_t kMapBits = kMapWords * 64;  // Pages per map page
+
+    size_t AllocatePageLocked() {
+        if (n_free > 0) {
+            while (free_map[free_hint] == 0) ++free_hint;
+            size_t page_id = free_hint * 64 + __builtin_ctzll(free_map[free_hint]);
+            free_map[free_hint] &= free_map[free_hint] - 1;
+            --n_free;
+            return page_id;
+        }
+        if ((*fsize) + 1 >= flen / PAGE_SIZE) {
+            int ret = posix_fallocate(fd, flen, EXPAND_SIZE);
+            if (ret != 0) return 0;
+            flen += EXPAND_SIZE;
+        }
+        return ++(*fsize);
+    }
+
+    void ReadFreeMap() {
+        alignas(512) char buf[PAGE_SIZE];
+        for (size_t page_id = *free_map_head; page_id != 0; page_id = *reinterpret_cast<size_t*>(buf)) {
+            map_pages.push_back(page_id);
+            ReadPage(page_id, buf);
+            const uint64_t* words = reinterpret_cast<uint64_t*>(buf + sizeof(size_t));
+            free_map.insert(free_map.end(), words, words + kMapWords);
+        }
+        for (uint64_t word : free_map) {
+            n_free += __builtin_popcountll(word);
+        }
+    }
+
+    // Write the free map and the first page. Map pages are allocated from the
+    // file until they cover all of its pages.
+    void WriteFreeMap() {
+        while (map_pages.size() * kMapBits <= *fsize) {
+            size_t page_id = AllocatePageLocked();
+            assert(page_id != 0);
+            map_pages.push_back(page_id);
+        }
+        free_map.resize(map_pages.size() * kMapWords, 0);
+        alignas(512) char buf[PAGE_SIZE];
+        for (size_t i = 0; i < map_pages.size(); ++i) {
+            *reinterpret_cast<size_t*>(buf) = i + 1 < map_pages.size() ? map_pages[i + 1] : 0;
+            memcpy(buf + sizeof(size_t), free_map.data() + i * kMapWords, kMapWords * sizeof(uint64_t));
+            int res = pwrite(fd, buf, PAGE_SIZE, map_pages[i] * PAGE_SIZE);
+            assert(res == PAGE_SIZE);
+        }
+        *free_map_head = map_pages.empty() ? 0 : map_pages[0];
+        int res = pwrite(fd, first_page, PAGE_SIZE, 0);
+        assert(res == PAGE_SIZE);
+    }
+
     //FILE* fp;
     int fd;
     alignas(512) char first_page[PAGE_SIZE];
     size_t flen;
     size_t* fsize;
-    size_t* first_free_page;
+    size_t* free_map_head;
+    std::mutex alloc_latch;
+    std::vector<uint64_t> free_map;  // Bit per page, set if it is free
+    size_t free_hint = 0;  // No free pages below word free_hint
+    size_t n_free = 0;
+    std::vector<size_t> map_pages;  // The chain of the free map
 };
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <immintrin.h>
+
+#include <cstddef>
+#include <cstdint>
+
+// Every slot of a bucket page has a 1-byte fingerprint of its key, 0 if the
+// slot is empty. A probe compares the fingerprint block as a whole and only
+// reads the keys of the slots that match, so most pages are ruled out without
+// reading a key.
+
+#define FINGERPRINT_BLOCK 256
+#define FINGERPRINT_WORDS (FINGERPRINT_BLOCK / 64)
+
+inline uint8_t Fingerprint(uint64_t key) {
+    // The bucket is taken from the low bits of the hash, so the fingerprint
+    // comes from the high bits of a multiplicative hash.
+    uint8_t fingerprint = (key * 0x9E3779B97F4A7C15ull) >> 56;
+    return fingerprint != 0 ? fingerprint : 1;
+}
+
+// Mark in mask the slots, 64 per word, among the first n_slots of the block
+// whose fingerprint is fingerprint. Pass 0 to find the empty slots. Reads
+// the whole block, which may be changing under an optimistic reader.
+inline void MatchFingerprints(const uint8_t* block, uint8_t fingerprint, size_t n_slots,
+                              uint64_t (&mask)[FINGERPRINT_WORDS]) {
+#if defined(__AVX2__)
+    const __m256i needle = _mm256_set1_epi8(static_cast<char>(fingerprint));
+    for (size_t w = 0; w < FINGERPRINT_WORDS; ++w) {
+        auto* p = reinterpret_cast<const __m256i*>(block + w * 64);
+        uint32_t lo = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256(p), needle));
+        uint32_t hi = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256(p + 1), needle));
+        mask[w] = (uint64_t{hi} << 32) | lo;
+    }
+#else
+    const __m128i needle = _mm_set1_epi8(static_cast<char>(fingerprint));
+    for (size_t w = 0; w < FINGERPRINT_WORDS; ++w) {
+        uint64_t word = 0;
+        for (size_t q = 0; q < 4; ++q) {
+            auto* p = reinterpret_cast<const __m128i*>(block + w * 64 + q * 16);
+            uint64_t bits = static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(p), needle)));
+            word |= bits << (q * 16);
+        }
+        mask[w] = word;
+    }
+#endif
+    // The block is padded past the slots.
+    for (size_t w = 0; w < FINGERPRINT_WORDS; ++w) {
+        if (n_slots <= w * 64) {
+            mask[w] = 0;
+        } else if (n_slots < (w + 1) * 64) {
+            mask[w] &= (uint64_t{1} << (n_slots - w * 64)) - 1;
+        }
+    }
+}
+
+// Take the first slot out of mask and return it, or FINGERPRINT_BLOCK if
+// there is none.
+inline size_t PopSlot(uint64_t (&mask)[FINGERPRINT_WORDS]) {
+    for (size_t w = 0; w < FINGERPRINT_WORDS; ++w) {
+        if (mask[w] != 0) {
+            size_t slot = w * 64 + __builtin_ctzll(mask[w]);
+            mask[w] &= mask[w] - 1;
+            return slot;
+        }
+    }
+    return FINGERPRINT_BLOCK;
+}
@@ -1,31 +1,81 @@
+#include <absl/container/flat_hash_set.h>
+#include <atomic>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
 #include "BufferManager.h"
 #include "File.h"
+#include "Fingerprint.h"
+#include "../include/latch.hpp"
+#if defined(VMCACHE)
+#include "VmBufferManager.h"
+using HtBufferPool = HtVmBufferManager;
+#else
+using HtBufferPool = HtBufferManager;
+#endif
 
 // Directory Layout: first 8 byte next, second 8 byte n_entries, then every 8 byte a pointer to bucket.
-// Bucket Layout: first 8 byte next, 4096-8 byte left. 16 byte per entry. 
-// 32 byte bitmap -> 8*32 = 256 entries -> actual 253 entries.
+// Bucket Layout: first 8 byte next, second 8 byte n_entries, then a 256 byte
+// block of 1 byte fingerprints (see Fingerprint.h), the keys and the values.
+// 16 + 256 bytes, 4096 - 272 left -> 16 byte per entry -> 239 entries.
 
-// | -- Next -- | -- N_ENTRY -- | -- 32 byte bitmap -- | -------- 253 * 16 byte entries ---------- |
+// | -- Next -- | -- N_ENTRY -- | -- 256 byte fingerprints -- | -- 239 * 8 byte keys -- | -- 239 * 8 byte values -- |
 // Exactly 4096 bytes.
 
 // 4096 / 8 bytes = 512 buckets per DIRECTORY
 
+// Linear hashing: the table starts out with n_buckets buckets, and splits the
+// next bucket in line whenever an insert appends a page to a full chain, so
+// chains stay about one page long however many records there are. With
+// bucket_count buckets, 2^L * n_buckets <= bucket_count < 2^(L+1) * n_buckets,
+// a key goes to bucket hash % (2^(L+1) * n_buckets), or to
+// hash % (2^L * n_buckets) if the former is not there yet.
+//
+// The directory pages of the first buckets are pages 1 to
+// n_buckets / 512 + 1. Those of the buckets added by splits are listed in
+// index pages, 512 per index page. The table fields of the first page hold
+// the bucket count, then the index page numbers.
+
 // Key uint64_t Value uint64_t
 
 #define N_BUCKETS_PER_DIR (PAGE_SIZE / 8)
-#define ENTRY_OFFSET 48
-#define ENTRIES_PER_BUCKET 253
+#define FINGERPRINT_OFFSET 16
+#define KEY_OFFSET (FINGERPRINT_OFFSET + FINGERPRINT_BLOCK)
+#define ENTRIES_PER_BUCKET 239
+#define VALUE_OFFSET (KEY_OFFSET + ENTRIES_PER_BUCKET * 8)
+static_assert(VALUE_OFFSET + ENTRIES_PER_BUCKET * 8 <= PAGE_SIZE, "bucket entries do not fit a page");
 
+// Concurrency: every bucket chain has a latch (OptLatch), shared with the
+// chains of other buckets once the table has grown. Insert and Erase, and the
+// compaction of empty pages, hold it exclusively. Search reads the chain
+// optimistically and restarts if a writer changed it meanwhile. A split holds
+// the latches of both of its buckets, and one thread splits at a time. Threads
+// can share a table with HtBufferManager only, HtVmBufferManager is not
+// thread-safe.
+//
+// Compaction: Search never writes. It skips the empty pages that Erase leaves
+// behind and queues their chain, and the next Insert or Erase unlinks and
+// frees the empty pages of one queued chain after its own work, the way
+// checkpoints run in steps. Insert and Erase also free the empty pages they
+// come across in their own chain. The checkpoint and resize steps of the
+// buffer pool also run after Insert and Erase only, as only writes dirty
+// pages; a table that is only searched keeps its pool's capacity until the
+// next write.
 
 class HashTable {
 public:
     HashTable(std::string path, size_t buffer_cap): hpf(path, 0, false) {
-        bmgr = new HtBufferManager(&hpf, buffer_cap);
+        bmgr = new HtBufferPool(&hpf, buffer_cap);
         n_buckets = hpf.GetThirdField();
+        OpenDirectory();
     }
 
     HashTable(std::string path, size_t n_buckets, size_t buffer_cap): hpf(path, EXPAND_SIZE, true), n_buckets(n_buckets) {
-        bmgr = new HtBufferManager(&hpf, buffer_cap);
+        bmgr = new HtBufferPool(&hpf, buffer_cap);
         hpf.SetThirdField(n_buckets);
         size_t res;
         for (size_t i = 0; i < n_buckets / N_BUCKETS_PER_DIR + 1; ++i) {
@@ -33,10 +83,18 @@ public:
             hpf.TruncPage(res);
         }
         assert(res == n_buckets / N_BUCKETS_PER_DIR + 1);
+        OpenDirectory();
     }
 
-    HashTable(std::string path, size_t n_buckets, size_t buffer_cap, bool trunc): hpf(path, EXPAND_SIZE, trunc), n_buckets(n_buckets) {
-        bmgr = new HtBufferManager(&hpf, buffer_cap);
+    // With numa_partitioned, the buffer pool is split by NUMA node for threads
+    // on several nodes that share the table (see HtBufferManager).
+    HashTable(std::string path, size_t n_buckets, size_t buffer_cap, bool trunc, bool numa_partitioned = false)
+        : hpf(path, EXPAND_SIZE, trunc), n_buckets(n_buckets) {
+#if defined(VMCACHE)
+        bmgr = new HtBufferPool(&hpf, buffer_cap);
+#else
+        bmgr = new HtBufferPool(&hpf, buffer_cap, numa_partitioned);
+#endif
     if (trunc) {
         hpf.SetThirdField(n_buckets);
         size_t res;
@@ -47,64 +105,422 @@ public:
     } else {
         assert(hpf.GetThirdField() == n_buckets);
     }
+        OpenDirectory();
     }
 
     bool Insert(uint64_t key, uint64_t value) {
         EntrySlot slot;
-        auto success = GetFreeSlotWithProbe(key, slot);
+        size_t bucket;
+        OptLatch& latch = LockChain(key, bucket);
+        auto success = GetFreeSlotWithProbe(key, bucket, slot);
         if (success) {
-            *reinterpret_cast<uint64_t*>(slot.entry) = key;
-            *reinterpret_cast<uint64_t*>(slot.entry + 8) = value;
+            *slot.key = key;
+            *slot.value = value;
             (*slot.n_entry)++;
-            *slot.bitmap |= slot.bitmask;
+            *slot.fingerprint = Fingerprint(key);
             bmgr->MarkDirty(slot.frame_id);
             bmgr->UnpinPage(slot.frame_id);
-            return true;
         }
-        return false;
+        latch.WriteUnlock();
+        if (slot.appended) Grow();
+        CompactStep();
+        bmgr->CheckpointStep();
+        bmgr->ResizeStep();
+        return success;
     }
 
     bool Search(const uint64_t key, uint64_t& value) {
-        EntrySlot slot;
-        auto success = ProbeAndCompress(key, slot);
-        if (success) {
-            value = *reinterpret_cast<uint64_t*>(slot.entry + 8);
-            bmgr->UnpinPage(slot.frame_id);
-            return true;
-        } else return false;
+        Probe result;
+        do {
+            result = OptimisticProbe(key, value);
+        } while (result == Probe::kRestart);
+        return result == Probe::kFound;
     }
 
     bool Erase(uint64_t key) {
         EntrySlot slot;
-        auto success = ProbeAndCompress(key, slot);
+        size_t bucket;
+        OptLatch& latch = LockChain(key, bucket);
+        auto success = ProbeAndCompress(key, bucket, slot);
         if (success) {
-            memset(reinterpret_cast<char*>(slot.entry), 0, 16);
+            *slot.key = 0;
+            *slot.value = 0;
             (*slot.n_entry)--;
-            *slot.bitmap &= ~slot.bitmask;
+            *slot.fingerprint = 0;
             bmgr->MarkDirty(slot.frame_id);
             bmgr->UnpinPage(slot.frame_id);
-            return true;
-        } else return false;
+        }
+        latch.WriteUnlock();
+        CompactStep();
+        bmgr->CheckpointStep();
+        bmgr->ResizeStep();
+        return success;
+    }
+
+    // Take a fuzzy checkpoint every interval, see
+    // HtBufferManager::SetCheckpointInterval.
+    void SetCheckpointInterval(std::chrono::milliseconds interval) {
+        bmgr->SetCheckpointInterval(interval);
     }
 
+    BufferStats GetBufferStats() const {
+        return bmgr->GetStats();
+    }
+
+    const char* GetBufferPolicyName() const {
+        return bmgr->GetPolicyName();
+    }
+
+    HtBufferPool* GetBufferPool() const {
+        return bmgr;
+    }
+
+    // Buckets the table has grown to
+    size_t GetBucketCount() const {
+        return bucket_count.load(std::memory_order_relaxed);
+    }
+
+    struct CompactionStats {
+        uint64_t deferred = 0;  // Chains queued by Search
+        uint64_t dropped = 0;  // Not queued because the queue was full or busy
+        uint64_t pending = 0;  // Still queued
+        uint64_t reclaimed = 0;  // Empty pages freed by Insert and Erase
+    };
+
+    CompactionStats GetCompactionStats() const {
+        CompactionStats stats;
+        stats.deferred = compactions_deferred.load(std::memory_order_relaxed);
+        stats.dropped = compactions_dropped.load(std::memory_order_relaxed);
+        stats.pending = compactions_pending.load(std::memory_order_relaxed);
+        stats.reclaimed = pages_reclaimed.load(std::memory_order_relaxed);
+        return stats;
+    }
 
     ~HashTable() {
         delete bmgr;
+        for (size_t* index : dir_index) {
+            std::free(index);
+        }
     }
 
 private:
     struct EntrySlot {
-        char* entry;
-        uint8_t* bitmap;
-        uint8_t bitmask;
+        uint8_t* fingerprint;
+        uint64_t* key;
+        uint64_t* value;
         size_t* n_entry;
         size_t frame_id;
+        bool appended = false;  // To a chain without free slots
     };
 
-    bool GetFreeSlotWithProbe(const uint64_t& key, EntrySlot& slot) {
+    static constexpr size_t kMaxIndexPages = HtFile::kTableFields - 1;
+    static constexpr size_t kMaxPendingCompactions = 4096;
+
+    enum class Probe { kFound, kNotFound, kRestart };
+
+    // Set up the latches and read the index pages in.
+    void OpenDirectory() {
+        n_dir_pages = n_buckets / N_BUCKETS_PER_DIR + 1;
+        size_t n_latches = 1;
+        while (n_latches < n_buckets) n_latches <<= 1;
+        chain_latches.reset(new OptLatch[n_latches]);
+        latch_mask = n_latches - 1;
+
+        size_t count = hpf.GetTableField(0);
+        if (count == 0) {
+            // Not split yet.
+            count = n_buckets;
+            hpf.SetTableField(0, count);
+        }
+        bucket_count.store(count, std::memory_order_relaxed);
+        for (size_t i = 0; i < kMaxIndexPages && hpf.GetTableField(i + 1) != 0; ++i) {
+            dir_index[i] = static_cast<size_t*>(std::aligned_alloc(512, PAGE_SIZE));
+            hpf.ReadPage(hpf.GetTableField(i + 1), reinterpret_cast<char*>(dir_index[i]));
+        }
+    }
+
+    // Bucket of hash with count buckets, see Linear hashing above.
+    size_t Bucket(size_t hash, size_t count) const {
+        size_t low = n_buckets << (63 - __builtin_clzl(count / n_buckets));
+        size_t bucket = hash % (low * 2);
+        return bucket < count ? bucket : bucket - low;
+    }
+
+    // Directory page with the pointer to the chain of bucket.
+    size_t DirPage(size_t bucket) const {
+        size_t dir = bucket / N_BUCKETS_PER_DIR;
+        if (dir < n_dir_pages) return dir + 1;
+        dir -= n_dir_pages;
+        return dir_index[dir / N_BUCKETS_PER_DIR][dir % N_BUCKETS_PER_DIR];
+    }
+
+    OptLatch& LockBucket(size_t bucket) {
+        OptLatch& latch = chain_latches[bucket & latch_mask];
+        while (true) {
+            bool need_restart = false;
+            latch.WriteLockOrRestart(need_restart);
+            if (!need_restart) return latch;
+            std::this_thread::yield();
+        }
+    }
+
+    // Latch the chain of key's bucket exclusively, and set bucket to it.
+    OptLatch& LockChain(const uint64_t& key, size_t& bucket) {
+        size_t hash = std::hash<uint64_t>()(key);
+        while (true) {
+            bucket = Bucket(hash, bucket_count.load(std::memory_order_acquire));
+            OptLatch& latch = LockBucket(bucket);
+            // A split may have moved the key before the latch was taken.
+            if (Bucket(hash, bucket_count.load(std::memory_order_acquire)) == bucket) return latch;
+            latch.WriteUnlock();
+        }
+    }
+
+    // Split buckets for the pages appended to full chains. If another thread
+    // is splitting, it takes over this split as well.
+    void Grow() {
+        pending_splits.fetch_add(1, std::memory_order_relaxed);
+        std::unique_lock<std::mutex> guard(split_latch, std::try_to_lock);
+        if (!guard.owns_lock()) return;
+        while (pending_splits.load(std::memory_order_relaxed) > 0) {
+            pending_splits.fetch_sub(1, std::memory_order_relaxed);
+            if (!SplitBucket()) break;
+        }
+    }
+
+    // Split the next bucket in line: its records that hash to the new bucket
+    // move there, and the rest are packed into as few pages as they fill.
+    // Returns false once the directory is full.
+    bool SplitBucket() {
+        size_t count = bucket_count.load(std::memory_order_relaxed);
+        size_t low = n_buckets << (63 - __builtin_clzl(count / n_buckets));
+        size_t from = count - low, to = count;
+        if (!AddDirEntry(to)) return false;
+        OptLatch& from_latch = LockBucket(from);
+        OptLatch& to_latch = chain_latches[to & latch_mask];
+        if (&to_latch != &from_latch) LockBucket(to);
+
+        std::vector<std::pair<uint64_t, uint64_t>> stay, move;
+        std::vector<size_t> pages;
+        char *dir_frame, *frame;
+        size_t dir_frame_id = bmgr->PinPage(DirPage(from), &dir_frame);
+        size_t* dir_ptr = reinterpret_cast<size_t*>(dir_frame + (from % N_BUCKETS_PER_DIR) * sizeof(size_t));
+        for (size_t page_no = *dir_ptr; page_no != 0;) {
+            size_t frame_id = bmgr->PinPage(page_no, &frame);
+            const uint8_t* fingerprints = reinterpret_cast<uint8_t*>(frame + FINGERPRINT_OFFSET);
+            for (size_t i = 0; i < ENTRIES_PER_BUCKET; ++i) {
+                if (fingerprints[i] != 0) {
+                    uint64_t key = reinterpret_cast<uint64_t*>(frame + KEY_OFFSET)[i];
+                    auto& records = std::hash<uint64_t>()(key) % (low * 2) == to ? move : stay;
+                    records.emplace_back(key, reinterpret_cast<uint64_t*>(frame + VALUE_OFFSET)[i]);
+                }
+            }
+            pages.push_back(page_no);
+            page_no = *reinterpret_cast<size_t*>(frame);
+            bmgr->UnpinPage(frame_id);
+        }
+        *dir_ptr = WriteChain(stay, pages);
+        bmgr->MarkDirty(dir_frame_id);
+        bmgr->UnpinPage(dir_frame_id);
+
+        dir_frame_id = bmgr->PinPage(DirPage(to), &dir_frame);
+        dir_ptr = reinterpret_cast<size_t*>(dir_frame + (to % N_BUCKETS_PER_DIR) * sizeof(size_t));
+        *dir_ptr = WriteChain(move, {});
+        bmgr->MarkDirty(dir_frame_id);
+        bmgr->UnpinPage(dir_frame_id);
+
+        bucket_count.store(count + 1, std::memory_order_release);
+        hpf.SetTableField(0, count + 1);
+        if (&to_latch != &from_latch) to_latch.WriteUnlock();
+        from_latch.WriteUnlock();
+        return true;
+    }
+
+    // Make sure that bucket has a directory entry: the first bucket of a
+    // directory page adds the page, and the first of an index page adds that
+    // too. Returns false if the index pages are used up.
+    bool AddDirEntry(size_t bucket) {
+        size_t dir = bucket / N_BUCKETS_PER_DIR;
+        if (dir < n_dir_pages || bucket % N_BUCKETS_PER_DIR != 0) return true;
+        dir -= n_dir_pages;
+        size_t index = dir / N_BUCKETS_PER_DIR;
+        if (index >= kMaxIndexPages) return false;
+        if (dir % N_BUCKETS_PER_DIR == 0) {
+            hpf.SetTableField(index + 1, hpf.AllocatePage());
+            dir_index[index] = static_cast<size_t*>(std::aligned_alloc(512, PAGE_SIZE));
+            memset(dir_index[index], 0, PAGE_SIZE);
+        }
+        auto page_no = hpf.AllocatePage();
+        hpf.TruncPage(page_no);
+        char* frame;
+        bmgr->UnpinPage(PinNewPage(page_no, &frame));
+        dir_index[index][dir % N_BUCKETS_PER_DIR] = page_no;
+        hpf.WritePage(hpf.GetTableField(index + 1), reinterpret_cast<char*>(dir_index[index]));
+        return true;
+    }
+
+    // Write records into a chain of full pages, reusing the given pages and
+    // freeing those left over. Returns the first page, 0 if there are no
+    // records.
+    size_t WriteChain(const std::vector<std::pair<uint64_t, uint64_t>>& records, const std::vector<size_t>& pages) {
+        size_t n_pages = (records.size() + ENTRIES_PER_BUCKET - 1) / ENTRIES_PER_BUCKET;
+        std::vector<size_t> chain(pages.begin(), pages.begin() + std::min(n_pages, pages.size()));
+        while (chain.size() < n_pages) {
+            auto page_no = hpf.AllocatePage();
+            hpf.TruncPage(page_no);
+            chain.push_back(page_no);
+        }
+        char* frame;
+        for (size_t i = n_pages; i < pages.size(); ++i) {
+            bmgr->FreePage(bmgr->PinPage(pages[i], &frame));
+        }
+        for (size_t i = 0; i < n_pages; ++i) {
+            size_t frame_id = PinNewPage(chain[i], &frame);
+            size_t first = i * ENTRIES_PER_BUCKET;
+            size_t n_entry = std::min(records.size() - first, size_t{ENTRIES_PER_BUCKET});
+            *reinterpret_cast<size_t*>(frame) = i + 1 < n_pages ? chain[i + 1] : 0;
+            *reinterpret_cast<size_t*>(frame + 8) = n_entry;
+            for (size_t j = 0; j < n_entry; ++j) {
+                reinterpret_cast<uint8_t*>(frame + FINGERPRINT_OFFSET)[j] = Fingerprint(records[first + j].first);
+                reinterpret_cast<uint64_t*>(frame + KEY_OFFSET)[j] = records[first + j].first;
+                reinterpret_cast<uint64_t*>(frame + VALUE_OFFSET)[j] = records[first + j].second;
+            }
+            bmgr->MarkDirty(frame_id);
+            bmgr->UnpinPage(frame_id);
+        }
+        return n_pages > 0 ? chain[0] : 0;
+    }
+
+    // Point slot to entry i of the bucket page in frame frame_id.
+    static void SetSlot(EntrySlot& slot, char* frame, size_t i, size_t frame_id) {
+        slot.fingerprint = reinterpret_cast<uint8_t*>(frame + FINGERPRINT_OFFSET) + i;
+        slot.key = reinterpret_cast<uint64_t*>(frame + KEY_OFFSET) + i;
+        slot.value = reinterpret_cast<uint64_t*>(frame + VALUE_OFFSET) + i;
+        slot.n_entry = reinterpret_cast<size_t*>(frame + 8);
+        slot.frame_id = frame_id;
+    }
+
+    // Pin the bucket page page_no and clear it, e.g., when it was just
+    // allocated: an optimistic Search may have read the page into the pool
+    // while it was free.
+    size_t PinNewPage(size_t page_no, char** frame) {
+        size_t frame_id = bmgr->PinPage(page_no, frame);
+        memset(*frame, 0, PAGE_SIZE);
+        return frame_id;
+    }
+
+    // Search without latching the chain. Page numbers read from the chain are
+    // only followed once the latch version shows that they were current, and
+    // the result only counts if the version did not change until the end.
+    // Empty pages are passed over, and their chain queued for compaction.
+    Probe OptimisticProbe(const uint64_t& key, uint64_t& value) {
+        size_t count = bucket_count.load(std::memory_order_acquire);
+        size_t bucket = Bucket(std::hash<uint64_t>()(key), count);
+        OptLatch& latch = chain_latches[bucket & latch_mask];
+        bool need_restart = false;
+        uint64_t version = latch.ReadLockOrRestart(need_restart);
+        if (need_restart) {
+            std::this_thread::yield();
+            return Probe::kRestart;
+        }
+        // A split publishes the bucket count before it releases the latch.
+        if (bucket_count.load(std::memory_order_acquire) != count) return Probe::kRestart;
+        bool has_empty = false;
+        uint8_t fingerprint = Fingerprint(key);
+        uint64_t mask[FINGERPRINT_WORDS];
+        char* frame;
+        size_t frame_id = bmgr->PinPage(DirPage(bucket), &frame);
+        size_t page_no = *reinterpret_cast<volatile size_t*>(frame + (bucket % N_BUCKETS_PER_DIR) * sizeof(size_t));
+        bmgr->UnpinPage(frame_id);
+
+        while (true) {
+            latch.CheckOrRestart(version, need_restart);
+            if (need_restart) return Probe::kRestart;
+            if (page_no == 0) {
+                if (has_empty) DeferCompaction(bucket);
+                return Probe::kNotFound;
+            }
+
+            frame_id = bmgr->PinPage(page_no, &frame);
+            size_t n_entry = *reinterpret_cast<volatile size_t*>(frame + 8);
+            bool found = false;
+            MatchFingerprints(reinterpret_cast<uint8_t*>(frame + FINGERPRINT_OFFSET), fingerprint, ENTRIES_PER_BUCKET, mask);
+            for (size_t i = PopSlot(mask); i < ENTRIES_PER_BUCKET; i = PopSlot(mask)) {
+                if (reinterpret_cast<volatile uint64_t*>(frame + KEY_OFFSET)[i] == key) {
+                    value = reinterpret_cast<volatile uint64_t*>(frame + VALUE_OFFSET)[i];
+                    found = true;
+                    break;
+                }
+            }
+            page_no = *reinterpret_cast<volatile size_t*>(frame);
+            bmgr->UnpinPage(frame_id);
+            latch.CheckOrRestart(version, need_restart);
+            if (need_restart) return Probe::kRestart;
+            if (found) return Probe::kFound;
+            if (n_entry == 0) has_empty = true;
+        }
+    }
+
+    // Queue the chain of bucket for compaction. Search does not wait for the
+    // queue: if another thread holds it, or it is full, the chain is queued
+    // by a later Search.
+    void DeferCompaction(size_t bucket) {
+        std::unique_lock<std::mutex> guard(compact_latch, std::try_to_lock);
+        if (!guard.owns_lock() || compact_queue.size() >= kMaxPendingCompactions) {
+            compactions_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        if (compact_queue.insert(bucket).second) {
+            compactions_deferred.fetch_add(1, std::memory_order_relaxed);
+            compactions_pending.store(compact_queue.size(), std::memory_order_relaxed);
+        }
+    }
+
+    // Compact one queued chain, if any. Called by Insert and Erase once they
+    // released their own latch.
+    void CompactStep() {
+        if (compactions_pending.load(std::memory_order_relaxed) == 0) return;
+        size_t bucket;
+        {
+            std::unique_lock<std::mutex> guard(compact_latch, std::try_to_lock);
+            if (!guard.owns_lock() || compact_queue.empty()) return;
+            auto it = compact_queue.begin();
+            bucket = *it;
+            compact_queue.erase(it);
+            compactions_pending.store(compact_queue.size(), std::memory_order_relaxed);
+        }
+        // Buckets are never removed, so a queued bucket is still there; a
+        // split since may have compacted it already.
+        OptLatch& latch = LockBucket(bucket);
+        CompactChain(bucket);
+        latch.WriteUnlock();
+    }
+
+    // Unlink and free the empty pages of the chain of bucket. The chain must
+    // be latched exclusively.
+    void CompactChain(size_t bucket) {
+        char *frame, *next_frame;
+        size_t frame_id = bmgr->PinPage(DirPage(bucket), &frame);
+        size_t* next_ptr = reinterpret_cast<size_t*>(frame + (bucket % N_BUCKETS_PER_DIR) * sizeof(size_t));
+        while (*next_ptr != 0) {
+            size_t next_frame_id = bmgr->PinPage(*next_ptr, &next_frame);
+            if (*reinterpret_cast<size_t*>(next_frame + 8) == 0) {
+                *next_ptr = *reinterpret_cast<size_t*>(next_frame);
+                bmgr->MarkDirty(frame_id);
+                bmgr->FreePage(next_frame_id);
+                pages_reclaimed.fetch_add(1, std::memory_order_relaxed);
+            } else {
+                bmgr->UnpinPage(frame_id);
+                frame_id = next_frame_id;
+                next_ptr = reinterpret_cast<size_t*>(next_frame);
+            }
+        }
+        bmgr->UnpinPage(frame_id);
+    }
+
+    bool GetFreeSlotWithProbe(const uint64_t& key, size_t bucket, EntrySlot& slot) {
         bool free_slot = false;
-        size_t bucket = std::hash<uint64_t>()(key) % n_buckets;
-        size_t dir_page_no = bucket / N_BUCKETS_PER_DIR + 1;
+        size_t dir_page_no = DirPage(bucket);
         char *dir_frame, *bucket_frame;
         size_t dir_frame_id = bmgr->PinPage(dir_page_no, &dir_frame);
         size_t* dir_ptr = reinterpret_cast<size_t*>(dir_frame + (bucket % N_BUCKETS_PER_DIR) * sizeof(size_t));
@@ -116,11 +532,8 @@ private:
             *dir_ptr = page_no;
             bmgr->MarkDirty(dir_frame_id);
             bmgr->UnpinPage(dir_frame_id);
-            slot.frame_id = bmgr->PinPage(page_no, &bucket_frame);
-            slot.entry = reinterpret_cast<char*>(bucket_frame + ENTRY_OFFSET);
-            slot.bitmap = reinterpret_cast<uint8_t*>(bucket_frame + 16);
-            slot.bitmask = 1;
-            slot.n_entry = reinterpret_cast<size_t*>(bucket_frame + 8);
+            size_t frame_id = PinNewPage(page_no, &bucket_frame);
+            SetSlot(slot, bucket_frame, 0, frame_id);
             return true;
         } else {
             size_t cur_frame_id = bmgr->PinPage(*dir_ptr, &bucket_frame);
@@ -133,6 +546,7 @@ private:
                 *dir_ptr = next;
                 bmgr->MarkDirty(dir_frame_id);
                 bmgr->FreePage(cur_frame_id);
+                pages_reclaimed.fetch_add(1, std::memory_order_relaxed);
 
                 if (next == 0) { // not found, hit the end.
                     auto page_no = hpf.AllocatePage();
@@ -142,11 +556,8 @@ private:
                     bmgr->UnpinPage(dir_frame_id);
 
                     // Starting from here bucket_frame is the new frame.
-                    slot.frame_id = bmgr->PinPage(page_no, &bucket_frame);
-                    slot.entry = reinterpret_cast<char*>(bucket_frame + ENTRY_OFFSET);
-                    slot.bitmap = reinterpret_cast<uint8_t*>(bucket_frame + 16);
-                    slot.bitmask = 1;
-                    slot.n_entry = reinterpret_cast<size_t*>(bucket_frame + 8);
+                    size_t frame_id = PinNewPage(page_no, &bucket_frame);
+                    SetSlot(slot, bucket_frame, 0, frame_id);
                     return true; 
                 }
                 
@@ -159,38 +570,26 @@ private:
             bmgr->UnpinPage(dir_frame_id);
 
             size_t* next_ptr = NULL;
+            uint8_t fingerprint = Fingerprint(key);
+            uint64_t mask[FINGERPRINT_WORDS];
             do {
-                size_t scanned = 0;
-                size_t offset = ENTRY_OFFSET;
-                size_t bitmap_offset = 16;
-                uint8_t* bitmap = reinterpret_cast<uint8_t*>(bucket_frame + bitmap_offset);
-                uint8_t bitmask = 1;
-                for (size_t i = 0; i < ENTRIES_PER_BUCKET; ++i) {
-                    auto occupy = bitmask & *bitmap;
-
-                    if (occupy) {
-                        if (*reinterpret_cast<uint64_t*>(bucket_frame + offset) == key) {
-                            // Already there. Unpin the page, return false.
-                            bmgr->UnpinPage(cur_frame_id);
-                            return false;
-                        }
-                        ++scanned;
-                    } else if (!free_slot) {
+                uint8_t* fingerprints = reinterpret_cast<uint8_t*>(bucket_frame + FINGERPRINT_OFFSET);
+                MatchFingerprints(fingerprints, fingerprint, ENTRIES_PER_BUCKET, mask);
+                for (size_t i = PopSlot(mask); i < ENTRIES_PER_BUCKET; i = PopSlot(mask)) {
+                    if (reinterpret_cast<uint64_t*>(bucket_frame + KEY_OFFSET)[i] == key) {
+                        // Already there. Unpin the page (and the one holding the free slot), return false.
+                        bmgr->UnpinPage(cur_frame_id);
+                        if (free_slot && slot.frame_id != cur_frame_id) bmgr->UnpinPage(slot.frame_id);
+                        return false;
+                    }
+                }
+                if (!free_slot) {
+                    MatchFingerprints(fingerprints, 0, ENTRIES_PER_BUCKET, mask);
+                    size_t i = PopSlot(mask);
+                    if (i < ENTRIES_PER_BUCKET) {
                         free_slot = true;
-                        slot.entry = reinterpret_cast<char*>(bucket_frame + offset);
-                        slot.bitmap = bitmap;
-                        slot.bitmask = bitmask;
-                        slot.n_entry = n_entry;
-                        slot.frame_id = cur_frame_id;
+                        SetSlot(slot, bucket_frame, i, cur_frame_id);
                     }
-
-                    if (free_slot && scanned == *n_entry) break;
-                    offset += 16;
-                    if (bitmask == (1 << 7)) {
-                        bitmask = 1;
-                        bitmap_offset += 1;
-                        bitmap = reinterpret_cast<uint8_t*>(bucket_frame + bitmap_offset);
-                    } else bitmask <<= 1;
                 }
                 next_ptr = reinterpret_cast<size_t*>(bucket_frame);
                 char *next_frame;
@@ -203,6 +602,7 @@ private:
                         *next_ptr = tmp_next;
                         bmgr->MarkDirty(cur_frame_id);
                         bmgr->FreePage(next_frame_id);
+                        pages_reclaimed.fetch_add(1, std::memory_order_relaxed);
                         
                         if (tmp_next == 0 && !free_slot) { // not found, hit the end.
                             auto page_no = hpf.AllocatePage();
@@ -212,13 +612,12 @@ private:
                             bmgr->UnpinPage(cur_frame_id);
 
                             // Starting from here next_frame is the new frame.
-                            slot.frame_id = bmgr->PinPage(page_no, &next_frame);
-                            slot.entry = reinterpret_cast<char*>(next_frame + ENTRY_OFFSET);
-                            slot.bitmap = reinterpret_cast<uint8_t*>(next_frame + 16);
-                            slot.bitmask = 1;
-                            slot.n_entry = reinterpret_cast<size_t*>(next_frame + 8);
+                            size_t frame_id = PinNewPage(page_no, &next_frame);
+                            SetSlot(slot, next_frame, 0, frame_id);
+                            slot.appended = true;
                             return true; 
                         } else if (free_slot) {
+                            if (cur_frame_id != slot.frame_id) bmgr->UnpinPage(cur_frame_id);
                             return true;
                         }
                         
@@ -229,7 +628,10 @@ private:
             if (!free_slot || (free_slot && cur_frame_id != slot.frame_id)) bmgr->UnpinPage(cur_frame_id);
                     bucket_frame = next_frame;
                     cur_frame_id = next_frame_id;
-                } else break; // Hit the end....
+                } else { // Hit the end....
+                    if (free_slot && cur_frame_id != slot.frame_id) bmgr->UnpinPage(cur_frame_id);
+                    break;
+                }
             } while (true);
 
             if (!free_slot) { // If there was no found free slots, then allocate new page.
@@ -240,20 +642,17 @@ private:
                 bmgr->UnpinPage(cur_frame_id);
                 char* frame;
                 // Starting from here next_frame is the new frame.
-                slot.frame_id = bmgr->PinPage(page_no, &frame);
-                slot.entry = reinterpret_cast<char*>(frame + ENTRY_OFFSET);
-                slot.bitmap = reinterpret_cast<uint8_t*>(frame + 16);
-                slot.bitmask = 1;
-                slot.n_entry = reinterpret_cast<size_t*>(frame + 8);
+                size_t frame_id = PinNewPage(page_no, &frame);
+                SetSlot(slot, frame, 0, frame_id);
+                slot.appended = true;
             }
             return true;
         }
     }
 
 
-    inline bool ProbeAndCompress(const uint64_t& key, EntrySlot& slot) {
-        size_t bucket = std::hash<uint64_t>()(key) % n_buckets;
-        size_t dir_page_no = bucket / N_BUCKETS_PER_DIR + 1;
+    inline bool ProbeAndCompress(const uint64_t& key, size_t bucket, EntrySlot& slot) {
+        size_t dir_page_no = DirPage(bucket);
         char *dir_frame, *bucket_frame;
         size_t dir_frame_id = bmgr->PinPage(dir_page_no, &dir_frame);
         size_t* dir_ptr = reinterpret_cast<size_t*>(dir_frame + (bucket % N_BUCKETS_PER_DIR * sizeof(size_t)));
@@ -269,6 +668,7 @@ private:
                 *dir_ptr = next;
                 bmgr->MarkDirty(dir_frame_id);
                 bmgr->FreePage(cur_frame_id);
+                pages_reclaimed.fetch_add(1, std::memory_order_relaxed);
                 if (next == 0) {
                     bmgr->UnpinPage(dir_frame_id);
                     return false; 
@@ -279,32 +679,16 @@ private:
             }
             bmgr->UnpinPage(dir_frame_id);
 
+            uint8_t fingerprint = Fingerprint(key);
+            uint64_t mask[FINGERPRINT_WORDS];
             do {
-                size_t scanned = 0;
-                size_t offset = ENTRY_OFFSET;
-                size_t bitmap_offset = 16;
-                uint8_t* bitmap = reinterpret_cast<uint8_t*>(bucket_frame + bitmap_offset);
-                uint8_t bitmask = 1;
-                for (size_t i = 0; i < ENTRIES_PER_BUCKET; ++i) {
-                    auto occupy = bitmask & *bitmap;
-                    if (occupy) {
-                        if (*reinterpret_cast<uint64_t*>(bucket_frame + offset) == key) {
-                            slot.frame_id = cur_frame_id;
-                            slot.entry = reinterpret_cast<char*>(bucket_frame + offset);
-                            slot.bitmap = bitmap;
-                            slot.bitmask = bitmask;
-                            slot.n_entry = n_entry;
-                            return true;
-                        }
-                        ++scanned;
-                        if (scanned == *n_entry) break;
+                MatchFingerprints(reinterpret_cast<uint8_t*>(bucket_frame + FINGERPRINT_OFFSET), fingerprint,
+                                  ENTRIES_PER_BUCKET, mask);
+                for (size_t i = PopSlot(mask); i < ENTRIES_PER_BUCKET; i = PopSlot(mask)) {
+                    if (reinterpret_cast<uint64_t*>(bucket_frame + KEY_OFFSET)[i] == key) {
+                        SetSlot(slot, bucket_frame, i, cur_frame_id);
+                        return true;
                     }
-                    offset += 16;
-                    if (bitmask == (1 << 7)) {
-                        bitmask = 1;
-                        bitmap_offset += 1;
-                        bitmap = reinterpret_cast<uint8_t*>(bucket_frame + bitmap_offset);
-                    } else bitmask <<= 1;
                 }
                 size_t* next_ptr = reinterpret_cast<size_t*>(bucket_frame);
                 char *next_frame;
@@ -316,6 +700,7 @@ private:
                         *next_ptr = tmp_next;
                         bmgr->MarkDirty(cur_frame_id);
                         bmgr->FreePage(next_frame_id);
+                        pages_reclaimed.fetch_add(1, std::memory_order_relaxed);
                         if (tmp_next == 0) {
                             bmgr->UnpinPage(cur_frame_id);
                             return false;
@@ -337,6 +722,19 @@ private:
     }
 
     HtFile hpf;
-    HtBufferManager* bmgr;
-    size_t n_buckets;
+    HtBufferPool* bmgr;
+    size_t n_buckets;  // To start out with
+    size_t n_dir_pages;  // Of the first buckets
+    std::atomic<size_t> bucket_count;
+    size_t* dir_index[kMaxIndexPages] = {};  // Index pages read in
+    std::unique_ptr<OptLatch[]> chain_latches;  // Of bucket & latch_mask
+    size_t latch_mask;
+    std::mutex split_latch;
+    std::atomic<size_t> pending_splits{0};
+    std::mutex compact_latch;
+    absl::flat_hash_set<size_t> compact_queue;  // Buckets with empty pages, see Compaction above
+    std::atomic<uint64_t> compactions_pending{0};
+    std::atomic<uint64_t> compactions_deferred{0};
+    std::atomic<uint64_t> compactions_dropped{0};
+    std::atomic<uint64_t> pages_reclaimed{0};
 };
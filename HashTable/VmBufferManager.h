@@ -0,0 +1,209 @@
+#pragma once
+
+#include "File.h"
+#include "../include/eviction_policy.hpp"
+#include <sys/mman.h>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Per-page metadata of HtVmBufferManager. Zeroed metadata is a page that is
+// not resident.
+struct VmPageMeta {
+    uint32_t slot;  // Slot of the page while it is resident
+    uint16_t pin_count;
+    uint8_t clock_count;
+    uint8_t dirty;
+    uint8_t resident;
+};
+
+// Virtual-memory-assisted buffer pool (vmcache), an alternative to
+// HtBufferManager selected with the CMake option VMCACHE. One anonymous
+// virtual region has a frame for every page number, so the frame of a page is
+// found by address arithmetic and the frame id of a page is its page number.
+// Only frames of resident pages are backed by memory: a miss reads the page
+// straight into its frame, and eviction gives the frame's memory back with
+// madvise(MADV_DONTNEED). At most buffer_size pages are resident; CLOCK runs
+// over buffer_size slots, each holding the page number of a resident page.
+// Unlike HtBufferManager, it is not thread-safe. It always uses CLOCK.
+class HtVmBufferManager {
+public:
+    HtVmBufferManager(HtFile* hpf, size_t buffer_size, size_t virtual_pages = kDefaultVirtualPages)
+        : file(hpf), n(buffer_size), virtual_pages(virtual_pages) {
+        assert(buffer_size > 0 && buffer_size <= virtual_pages);
+        // Only backed by memory where touched; the region is not registered
+        // with io_uring, since registered buffers are pinned in memory.
+        buffer_frames = static_cast<char*>(mmap(nullptr, virtual_pages * PAGE_SIZE, PROT_READ | PROT_WRITE,
+                                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0));
+        assert(buffer_frames != MAP_FAILED);
+        metas = static_cast<VmPageMeta*>(mmap(nullptr, virtual_pages * sizeof(VmPageMeta), PROT_READ | PROT_WRITE,
+                                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0));
+        assert(metas != MAP_FAILED);
+        slots.assign(n, kFreeSlot);
+        clock_hand = 0;
+    }
+
+    ~HtVmBufferManager() {
+        Flush();
+        munmap(buffer_frames, virtual_pages * PAGE_SIZE);
+        munmap(metas, virtual_pages * sizeof(VmPageMeta));
+    }
+
+    HtFile* GetFile() const {
+        return file;
+    }
+
+    BufferStats GetStats() const {
+        return stats;
+    }
+
+    const char* GetPolicyName() const {
+        return "clock";
+    }
+
+    // Same as in HtBufferManager; the frame id is the page number.
+    size_t PinPage(size_t page_id, char** frame) {
+        assert(page_id < virtual_pages);
+        *frame = buffer_frames + (page_id * PAGE_SIZE);
+        VmPageMeta& meta = metas[page_id];
+        if (!meta.resident) {
+            size_t slot = GetFreeSlot();
+            file->ReadPage(page_id, *frame);
+            slots[slot] = page_id;
+            meta.slot = slot;
+            meta.resident = 1;
+            meta.dirty = 0;
+            meta.pin_count = 0;
+            stats.misses++;
+        } else {
+            stats.hits++;
+        }
+        meta.pin_count++;
+        meta.clock_count = 1;
+        return page_id;
+    }
+
+    inline void UnpinPage(size_t frame_id) {
+        --metas[frame_id].pin_count;
+    }
+
+    inline void MarkDirty(size_t frame_id) {
+        metas[frame_id].dirty = 1;
+    }
+
+    void FreePage(size_t frame_id) {
+        VmPageMeta& meta = metas[frame_id];
+        assert(meta.pin_count == 1);
+        file->FreePage(frame_id);
+        slots[meta.slot] = kFreeSlot;
+        Drop(frame_id);
+    }
+
+    void Flush() {
+        std::vector<std::pair<size_t, const char*>> dirty_pages;
+        for (size_t page_id : slots) {
+            if (page_id != kFreeSlot && metas[page_id].dirty) {
+                dirty_pages.emplace_back(page_id, buffer_frames + (PAGE_SIZE * page_id));
+                metas[page_id].dirty = 0;
+            }
+        }
+        file->WritePages(dirty_pages);
+        file->Flush();
+    }
+
+    // The pool is not resizable, see HtBufferManager::ResizeStep.
+    void ResizeStep() {}
+
+    // Fuzzy checkpoint, see HtBufferManager::SetCheckpointInterval. The sweep
+    // runs over the slots.
+    void SetCheckpointInterval(std::chrono::milliseconds interval) {
+        checkpoint_interval = interval;
+        next_checkpoint = std::chrono::steady_clock::now() + interval;
+        checkpointing = false;
+    }
+
+    void CheckpointStep() {
+        if (checkpoint_interval.count() == 0) return;
+        if (!checkpointing) {
+            auto now = std::chrono::steady_clock::now();
+            if (now < next_checkpoint) return;
+            next_checkpoint = now + checkpoint_interval;
+            checkpoint_pos = 0;
+            checkpointing = true;
+        }
+
+        checkpoint_batch.clear();
+        auto collect = [&](size_t i) {
+            size_t page_id = slots[i];
+            if (page_id != kFreeSlot && metas[page_id].dirty) {
+                checkpoint_batch.emplace_back(page_id, buffer_frames + (PAGE_SIZE * page_id));
+                metas[page_id].dirty = 0;
+            }
+        };
+        for (; checkpoint_pos < n && checkpoint_batch.size() < kCheckpointBatch; ++checkpoint_pos) {
+            collect(checkpoint_pos);
+        }
+        if (checkpoint_pos == n) {
+            for (size_t i = 0; i < n; ++i) {
+                collect(i);
+            }
+            checkpointing = false;
+        }
+        file->WritePages(checkpoint_batch);
+        if (!checkpointing) {
+            file->Flush();
+        }
+    }
+
+private:
+    // 64 GB of page numbers
+    static constexpr size_t kDefaultVirtualPages = size_t{1} << 24;
+    static constexpr size_t kFreeSlot = ~size_t{0};
+
+    size_t GetFreeSlot() {
+        while (slots[clock_hand] != kFreeSlot) {
+            VmPageMeta& meta = metas[slots[clock_hand]];
+            if (meta.pin_count == 0 && meta.clock_count == 0) {
+                break;
+            }
+            if (meta.pin_count == 0) --meta.clock_count;
+            clock_hand = (++clock_hand >= n) ? 0 : clock_hand;
+        }
+        //Evict
+        size_t page_id = slots[clock_hand];
+        if (page_id != kFreeSlot) {
+            if (metas[page_id].dirty) {
+                file->WritePage(page_id, buffer_frames + (PAGE_SIZE * page_id));
+            }
+            slots[clock_hand] = kFreeSlot;
+            Drop(page_id);
+            stats.evictions++;
+        }
+        return clock_hand;
+    }
+
+    // Forget a page and give the memory of its frame back.
+    void Drop(size_t page_id) {
+        memset(&metas[page_id], 0, sizeof(VmPageMeta));
+        int res = madvise(buffer_frames + (PAGE_SIZE * page_id), PAGE_SIZE, MADV_DONTNEED);
+        assert(res == 0);
+        (void)res;
+    }
+
+    static constexpr size_t kCheckpointBatch = 8;
+    std::chrono::milliseconds checkpoint_interval{0};
+    std::chrono::steady_clock::time_point next_checkpoint;
+    bool checkpointing = false;
+    size_t checkpoint_pos = 0;  // Next slot the sweep visits
+    std::vector<std::pair<size_t, const char*>> checkpoint_batch;
+
+    HtFile* file;
+    size_t n;
+    size_t virtual_pages;
+    size_t clock_hand;
+    BufferStats stats;
+    std::vector<size_t> slots;  // Page number held in each slot
+    VmPageMeta* metas;          // Indexed by page number
+    char* buffer_frames;        // Indexed by page number
+};
@@ -27,9 +27,10 @@ class Client {
   bool DoRead();
   bool DoTransaction();
 
-  __attribute__((no_sanitize("thread"))) uint64_t GetStats() { return read_cnt + ins_cnt; }
+  __attribute__((no_sanitize("thread"))) uint64_t GetStats() { return read_cnt + ins_cnt + scan_cnt; }
   uint64_t GetRead() { return read_cnt; }
   uint64_t GetInsert() { return ins_cnt; }
+  uint64_t GetScan() { return scan_cnt; }
   auto GetOps() const noexcept { return op_cnt; }
  protected:
   
@@ -47,6 +48,7 @@ class Client {
   // Stats
   uint64_t read_cnt{};
   uint64_t ins_cnt{};
+  uint64_t scan_cnt{};
   uint64_t op_cnt{};
 };
 
@@ -79,9 +81,10 @@ inline bool Client::DoTransaction() {
       status = TransactionInsert();
       ins_cnt += (status == DB::kOK);
       break;
-    // case SCAN:
-    //   status = TransactionScan();
-    //   break;
+    case SCAN:
+      status = TransactionScan();
+      scan_cnt += (status == DB::kOK);
+      break;
     // case READMODIFYWRITE:
     //   status = TransactionReadModifyWrite();
     //   break;
@@ -134,18 +137,11 @@ inline int Client::TransactionReadModifyWrite() {
 }
 
 inline int Client::TransactionScan() {
-  // const std::string &table = workload_.NextTable();
-  // const std::string &key = workload_.NextTransactionKey();
-  // int len = workload_.NextScanLength();
-  // std::vector<std::vector<DB::KVPair>> result;
-  // if (!workload_.read_all_fields()) {
-  //   std::vector<std::string> fields;
-  //   fields.push_back("field" + workload_.NextFieldName());
-  //   return db_.Scan(table, key, len, &fields, result);
-  // } else {
-  //   return db_.Scan(table, key, len, NULL, result);
-  // }
-  return 0;
+  auto key = workload_.NextTransactionKey();
+  int len = workload_.NextScanLength();
+  thread_local std::vector<std::vector<DB::KVPair>> result;
+  result.clear();  // reuse vector
+  return db_.Scan(table, key, len, NULL, result);
 }
 
 inline int Client::TransactionUpdate() {
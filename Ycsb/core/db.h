@@ -9,6 +9,8 @@
 #ifndef YCSB_C_DB_H_
 #define YCSB_C_DB_H_
 
+#include <cstdint>
+#include <functional>
 #include <vector>
 #include <string>
 
@@ -67,6 +69,14 @@ class DB {
   virtual int Scan(const std::string &table, const std::string &key,
                    int record_count, const std::vector<std::string> *fields,
                    std::vector<std::vector<KVPair>> &result) = 0;
+  virtual int Scan(const std::string &table, uint64_t key,
+                   int record_count, const std::vector<std::string> *fields,
+                   std::vector<std::vector<KVPair>> &result) {
+    // Assume 8B keys only
+    thread_local std::string sbuf(4096, '\0');
+    *reinterpret_cast<uint64_t *>(sbuf.data()) = key;
+    return Scan(table, sbuf, record_count, fields, result);
+  }
   ///
   /// Updates a record in the database.
   /// Field/value pairs in the specified vector are written to the record,
@@ -107,6 +117,18 @@ class DB {
   /// @return Zero on success, a non-zero error code on error.
   ///
   virtual int Delete(const std::string &table, const std::string &key) = 0;
+  ///
+  /// Loads a set of records at once instead of inserting them one by one.
+  /// Called once, from a single thread, on an empty database.
+  ///
+  /// @param keys The keys of the records, in any order. May be reordered.
+  /// @param value_of Builds the value of the record with the given key.
+  /// @return True on success, false if the DB does not support bulk loading.
+  ///
+  virtual bool BulkLoad(std::vector<uint64_t> &keys,
+                        const std::function<std::string(uint64_t)> &value_of) {
+    return false;
+  }
   
   virtual ~DB() { }
 
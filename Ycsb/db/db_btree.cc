@@ -1,18 +1,25 @@
 #include "db_btree.h"
+#include <algorithm>
+#include <mutex>
 #include <thread>
 
 static std::once_flag init{};
 namespace ycsbc {
 DbBtree::DbBtree(std::string filename, const off_t index_len,
                  const off_t data_len, const bool load,
-                 uint32_t buffer_page) :
+                 uint32_t buffer_page, double fill_factor, bool use_wal,
+                 long checkpoint_interval, bool pin_inner) :
       file(new File(filename + ".index", index_len, load, PAGE_SIZE)),
-      index(file, (buffer_page <= 0 ? buffer_page = 1000 : buffer_page)),
-      data(filename + ".data", data_len, load, sizeof(Record)) {
+      wal(use_wal ? new Wal(filename + ".wal", load) : nullptr),
+      index(file, MakePool(filename, buffer_page <= 0 ? buffer_page = 1000 : buffer_page), wal.get(), pin_inner),
+      data(filename + ".data", data_len, load, sizeof(Record)),
+      fill_factor(fill_factor) {
   std::call_once(init, [&]() {
-    LOG(INFO) << "BTREE_ORDER=" << BTREE_ORDER << " PAGE_SIZE=" << PAGE_SIZE
+    LOG(INFO) << "INNER_ORDER=" << InnerNode<Pair>::kOrder
+              << " LEAF_ORDER=" << LeafNode<Pair>::kOrder << " PAGE_SIZE=" << PAGE_SIZE
               << " sizeof(Record)=" << sizeof(Record)
-              << " sizeof(Node)=" << sizeof(Node<Pair>)
+              << " sizeof(InnerNode)=" << sizeof(InnerNode<Pair>)
+              << " sizeof(LeafNode)=" << sizeof(LeafNode<Pair>)
               << " sizeof(Page.page_data)=" << sizeof(decltype(std::declval<Page>().page_data))
               << " sizeof(Page)=" << sizeof(Page)
               << " sizeof(Metadata)=" << sizeof(Metadata)
@@ -20,16 +27,91 @@ DbBtree::DbBtree(std::string filename, const off_t index_len,
               << " falloc INDEX_SIZE=" << index_len
               << " falloc DATA_SIZE=" << data_len
               << " #buffer pages=" << buffer_page
-              << " truncate files LOAD=" << load;
+              << " truncate files LOAD=" << load
+              << " WAL=" << use_wal
+              << " CHECKPOINT_INTERVAL=" << checkpoint_interval
+              << " PIN_INNER=" << pin_inner;
   });
-  if(!load){ // todo: recovery
-    num_records = index.get_record_count();
+  if(!load){
+    // Records of deleted entries keep their slots.
+    num_records = index.get_next_record();
+    if (wal) {
+      RedoRecords();
+    }
   }
+  if (checkpoint_interval > 0) {
+    // Record writes are logged too, so the data file must be on disk before
+    // the log is cut at a checkpoint.
+    index.start_checkpointer(std::chrono::milliseconds(checkpoint_interval), [this] { data.sync(); });
+  }
+}
+
+DbBtree::~DbBtree() {
+  index.stop_checkpointer();
+  // The inner levels grow with the inserts of the run.
+  LOG(INFO) << "B-tree pinned pages=" << index.get_pinned_pages()
+            << " (" << index.get_pinned_pages() * sizeof(Page) / 1024 << " KiB of DRAM)";
 }
 
-DbBtree::DbBtree(std::string filename, const bool load, const long index_start, const long data_start)
+// Rewrite the records in the log to the data file. The index redoes its own
+// records when it is opened.
+void DbBtree::RedoRecords() {
+  size_t redone = 0;
+  wal->Replay([&](LogType type, const char *payload, uint32_t size, lsn_t lsn) {
+    if (type != LogType::kRecordWrite) {
+      return;
+    }
+    record_t record_number;
+    Record r;
+    std::memcpy(&record_number, payload, sizeof(record_number));
+    std::memcpy(static_cast<void *>(&r), payload + sizeof(record_number), sizeof(r));
+    data.flush(record_number, r);
+    // Keep later inserts from reusing the slot.
+    if (record_number >= num_records.load(std::memory_order_relaxed)) {
+      num_records = record_number + 1;
+    }
+    redone++;
+  });
+  LOG_IF(INFO, redone > 0) << "Redid " << redone << " record writes.";
+}
+
+DbBtree::DbBtree(std::string filename, const bool load, const long index_start, const long data_start,
+                 uint32_t buffer_page)
   : file(new File(filename, load, index_start, PAGE_SIZE)),
-    index(file, 0), data(filename, load, data_start, sizeof(Record)) {}
+    index(file, SharedPool(filename, buffer_page <= 0 ? 1000 : buffer_page)),
+    data(filename, load, data_start, sizeof(Record)) {}
+
+std::shared_ptr<Btree<Pair>::Pool> DbBtree::MakePool(const std::string &name, uint32_t page_count) {
+#if !defined(VMCACHE)
+  if (MemoryBroker *broker = MemoryBroker::Get()) {
+    uint32_t max_pages = std::max<uint64_t>(broker->GetBudget(), page_count);
+    std::shared_ptr<Btree<Pair>::Pool> pool(new Btree<Pair>::Pool(max_pages, std::min(page_count, max_pages)),
+                                            [broker](Btree<Pair>::Pool *pool) {
+                                              broker->Unregister(pool);
+                                              delete pool;
+                                            });
+    broker->Register(name, pool.get());
+    return pool;
+  }
+#endif
+  return std::make_shared<Btree<Pair>::Pool>(page_count);
+}
+
+std::shared_ptr<Btree<Pair>::Pool> DbBtree::SharedPool(const std::string &name, uint32_t page_count) {
+#if defined(VMCACHE)
+  return MakePool(name, page_count);
+#else
+  static std::mutex latch;
+  static std::weak_ptr<Btree<Pair>::Pool> shared;
+  std::lock_guard<std::mutex> guard(latch);
+  auto pool = shared.lock();
+  if (!pool) {
+    pool = MakePool(name, page_count);
+    shared = pool;
+  }
+  return pool;
+#endif
+}
 
 int DbBtree::Read(const std::string &table, uint64_t key,
                   const std::vector<std::string> *fields,
@@ -59,21 +141,56 @@ int DbBtree::Read(const std::string &table, uint64_t key,
 
 int DbBtree::Insert(const std::string &table, uint64_t key,
                     std::vector<KVPair> &values) {
+  // The tree is shared by all threads; each insert claims its own record slot.
+  record_t record_number = num_records.fetch_add(1, std::memory_order_relaxed);
 #ifndef CLUSTERED
   Record r{key, values.at(0).second};
-  data.flush(num_records, r);
+  // The record is written before it is logged, so that a checkpoint that cuts
+  // the log after the log record also finds the record in the data file.
+  data.flush(record_number, r);
+  if (wal) {
+    wal->Append(LogType::kRecordWrite, &record_number, sizeof(record_number), &r, sizeof(r));
+  }
 #endif
 
-  index.insert(Pair{key, num_records});
+  index.insert(Pair{key, record_number});
+  if (wal) {
+    wal->Commit();
+  }
 
-  num_records++;
   return DB::kOK;
 }
 
+int DbBtree::Scan(const std::string &table, uint64_t key,
+                  int record_count, const std::vector<std::string> *fields,
+                  std::vector<std::vector<KVPair>> &result) {
+  thread_local std::vector<Pair> pairs;
+  pairs.clear();
+  index.scan(Pair{key}, record_count, pairs);
+
+#if defined(CLUSTERED)
+  return pairs.empty() ? DB::kErrorNoData : DB::kOK;
+#else
+  // Fetch the records of the scanned range in one batch.
+  thread_local std::vector<Record> records;
+  thread_local std::vector<std::pair<long, Record *>> batch;
+  records.resize(pairs.size());
+  batch.clear();
+  for (size_t i = 0; i < pairs.size(); ++i) {
+    batch.emplace_back(pairs[i].record_number, &records[i]);
+  }
+  data.load_batch(batch);
+  for (auto &r : records) {
+    result.push_back({KVPair{"", r.getValue()}});
+  }
+  return pairs.empty() ? DB::kErrorNoData : DB::kOK;
+#endif
+}
+
 int DbBtree::Scan(const std::string &table, const std::string &key,
                   int record_count, const std::vector<std::string> *fields,
                   std::vector<std::vector<KVPair>> &result) {
-  return DB::kOK;
+  return Scan(table, strtoull(key.c_str(), NULL, 10), record_count, fields, result);
 }
 
 int DbBtree::Update(const std::string &table, const std::string &key,
@@ -82,7 +199,44 @@ int DbBtree::Update(const std::string &table, const std::string &key,
 }
 
 int DbBtree::Delete(const std::string &table, const std::string &key) {
-  return DB::kOK;
+  // The record slot is not reused; only the index entry goes away.
+  bool removed = index.remove(Pair{strtoull(key.c_str(), NULL, 10)});
+  if (wal && removed) {
+    wal->Commit();
+  }
+  return removed ? DB::kOK : DB::kErrorNoData;
+}
+
+bool DbBtree::BulkLoad(std::vector<uint64_t> &keys,
+                       const std::function<std::string(uint64_t)> &value_of) {
+  std::sort(keys.begin(), keys.end());
+  record_t first = num_records.fetch_add(keys.size(), std::memory_order_relaxed);
+#ifndef CLUSTERED
+  // Records are numbered in key order, so the data file is written sequentially.
+  constexpr size_t kBatchRecords = 4096;
+  std::vector<Record> records(kBatchRecords);
+  std::vector<std::pair<long, Record *>> batch;
+  for (size_t i = 0; i < keys.size(); ++i) {
+    Record *r = &records[batch.size()];
+    *r = Record{keys[i], value_of(keys[i])};
+    batch.emplace_back(first + i, r);
+    if (batch.size() == kBatchRecords || i + 1 == keys.size()) {
+      CHECK(data.flush_batch(batch)) << "Can't write bulk loaded records.";
+      batch.clear();
+    }
+  }
+#endif
+
+  std::vector<Pair> pairs;
+  pairs.reserve(keys.size());
+  for (size_t i = 0; i < keys.size(); ++i) {
+    pairs.push_back(Pair{keys[i], first + i});
+  }
+  index.bulk_load(pairs, fill_factor);
+  if (wal) {
+    wal->Commit();
+  }
+  return true;
 }
 
 int DbBtree::Read(const std::string &table, const std::string &key,
@@ -1,3 +1,6 @@
+#include <atomic>
+#include <memory>
+
 #include "btree.h"
 #include "buffer_manager.h"
 #include "../core/db.h"
@@ -28,8 +31,19 @@ static_assert(sizeof(Record) == ALIGNMENT);
 
 class DbBtree : public DB {
  public:
-  DbBtree(std::string filename, const off_t index_len, const off_t data_len, const bool load, uint32_t buffer_page);
-  DbBtree(std::string filename, const bool load, const long index_start, const long data_start);
+  // With use_wal, changes are logged to filename.wal and every insert and
+  // delete returns once its log records are durable (group commit). With
+  // checkpoint_interval > 0, a fuzzy checkpoint is taken every
+  // checkpoint_interval milliseconds. With pin_inner, the inner nodes stay
+  // pinned in the buffer pool and only leaves are evicted.
+  DbBtree(std::string filename, const off_t index_len, const off_t data_len, const bool load, uint32_t buffer_page,
+          double fill_factor = 1.0, bool use_wal = false, long checkpoint_interval = 0,
+          bool pin_inner = false);
+  // A tree on a raw device, at index_start. The trees of all threads share one
+  // buffer pool (see SharedPool).
+  DbBtree(std::string filename, const bool load, const long index_start, const long data_start,
+          uint32_t buffer_page);
+  ~DbBtree() override;
   int Read(const std::string &table, const std::string &key,
            const std::vector<std::string> *fields,
            std::vector<KVPair> &result) override;
@@ -41,6 +55,8 @@ class DbBtree : public DB {
   int Update(const std::string &table, const std::string &key,
              std::vector<KVPair> &values) override;
   int Delete(const std::string &table, const std::string &key) override;
+  bool BulkLoad(std::vector<uint64_t> &keys,
+                const std::function<std::string(uint64_t)> &value_of) override;
 
 // Optimized Path
   int Read(const std::string &table, uint64_t key,
@@ -48,12 +64,32 @@ class DbBtree : public DB {
            std::vector<KVPair> &result) override;
   int Insert(const std::string &table, uint64_t key,
              std::vector<KVPair> &values) override;
+  int Scan(const std::string &table, uint64_t key, int record_count,
+           const std::vector<std::string> *fields,
+           std::vector<std::vector<KVPair>> &result) override;
 
  private:
   std::shared_ptr<File> file;
+  // Declared before index, which truncates the log when it is destroyed.
+  std::unique_ptr<Wal> wal;
   Btree<Pair> index;
+  // Declared after index, so that it is synced and closed before the log is
+  // truncated. The checkpointer of index syncs it too, so ~DbBtree stops the
+  // checkpointer before any member goes away.
   File data;
-  record_t num_records = 0;
-  inline constexpr bool valid_record_number(record_t n) { return n <= num_records; }
+  std::atomic<record_t> num_records{0};
+  double fill_factor{1.0};  // Node fill factor of bulk loading
+  inline bool valid_record_number(record_t n) { return n <= num_records.load(std::memory_order_relaxed); }
+  // A LogType::kRecordWrite log record holds the record number followed by
+  // the record.
+  void RedoRecords();
+  // A buffer pool of page_count pages. With a MemoryBroker, the pool is
+  // resizable up to the whole budget, and managed by the broker under name
+  // until it is freed.
+  static std::shared_ptr<Btree<Pair>::Pool> MakePool(const std::string &name, uint32_t page_count);
+  // The buffer pool shared by the trees of the process, created with
+  // page_count pages by the first tree and freed with the last one. With
+  // VMCACHE, every tree gets a pool of its own, as those cache one file each.
+  static std::shared_ptr<Btree<Pair>::Pool> SharedPool(const std::string &name, uint32_t page_count);
 };
 }  // namespace ycsbc
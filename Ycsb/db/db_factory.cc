@@ -25,19 +25,28 @@ DB *DBFactory::CreateDB(utils::Properties &props) {
     const off_t index_len = stol(props.GetProperty("falloc_index", "0"));
     const off_t data_len = stol(props.GetProperty("falloc_data", "0"));
     const long buffer_page = stol(props.GetProperty("buffer_page", "0"));
-    return new DbBtree(btree_file, index_len, data_len, load, buffer_page);
+    const double fill_factor = stod(props.GetProperty("fill_factor", "1.0"));
+    const bool wal = utils::StrToBool(props.GetProperty("wal", "false"));
+    const long checkpoint_interval = stol(props.GetProperty("checkpoint_interval", "0"));
+    const bool pin_inner = utils::StrToBool(props.GetProperty("pin_inner", "false"));
+    return new DbBtree(btree_file, index_len, data_len, load, buffer_page, fill_factor, wal,
+                       checkpoint_interval, pin_inner);
   } else if (props["tree"] == "hashtable") {
     std::string hashtable_file = props.GetProperty("hashtable_file", "hashtable");
     const bool load = utils::StrToBool(props.GetProperty("load", "false"));
     const long buffer_page = stol(props.GetProperty("buffer_page", "1000"));
-    return new DbHashTable(hashtable_file, load, buffer_page);
+    const long checkpoint_interval = stol(props.GetProperty("checkpoint_interval", "0"));
+    const long n_buckets = stol(props.GetProperty("hashtable_buckets", "100000"));
+    const bool shared = utils::StrToBool(props.GetProperty("shared_table", "false"));
+    return new DbHashTable(hashtable_file, load, buffer_page, checkpoint_interval, n_buckets, shared);
   } else if (props["tree"] == "btree_rdev") {
     std::string btree_file = props.GetProperty("btree_file", "/dev/nvme0n1");
     const bool load = utils::StrToBool(props.GetProperty("load", "false"));
 
     long index_start = std::stol(props.GetProperty("index_start", "0"));
     long data_start = std::stol(props.GetProperty("data_start", "0"));
-    return new DbBtree(btree_file, load, index_start, data_start);
+    const long buffer_page = stol(props.GetProperty("buffer_page", "0"));
+    return new DbBtree(btree_file, load, index_start, data_start, buffer_page);
   } else if (props["tree"] == "pibench") {
     std::string pool_file = props.GetProperty("path", "");
     auto num_threads = stoi(props.GetProperty("threadcount", "1"));
@@ -1,8 +1,54 @@
 #include "db_hashtable.h"
+#include <glog/logging.h>
 
 namespace ycsbc {
-DbHashTable::DbHashTable(std::string filename, const bool load, uint32_t buffer_page) 
-                        : ht(filename, 100000, buffer_page, load) {}
+namespace {
+// With a MemoryBroker, the pool may grow up to the whole budget. Frames are
+// only backed by memory once used.
+uint32_t MaxBufferPages(uint32_t buffer_page) {
+#if !defined(VMCACHE)
+  if (MemoryBroker *broker = MemoryBroker::Get()) {
+    return std::max<uint64_t>(broker->GetBudget(), buffer_page) / 4 * 4;
+  }
+#endif
+  return buffer_page;
+}
+}  // namespace
+
+DbHashTable::DbHashTable(std::string filename, const bool load, uint32_t buffer_page,
+                         long checkpoint_interval, size_t n_buckets, bool shared)
+                        : ht(filename, n_buckets, MaxBufferPages(buffer_page), load, shared) {
+  if (checkpoint_interval > 0) {
+    ht.SetCheckpointInterval(std::chrono::milliseconds(checkpoint_interval));
+  }
+#if !defined(VMCACHE)
+  if (MemoryBroker *broker = MemoryBroker::Get()) {
+    broker->Register(filename, ht.GetBufferPool());
+  }
+#endif
+}
+
+DbHashTable::~DbHashTable() {
+#if !defined(VMCACHE)
+  if (MemoryBroker *broker = MemoryBroker::Get()) {
+    broker->Unregister(ht.GetBufferPool());
+  }
+#endif
+  BufferStats stats = ht.GetBufferStats();
+  LOG(INFO) << "Hash table buffer pool (" << ht.GetBufferPolicyName() << "): hits=" << stats.hits
+            << " misses=" << stats.misses << " evictions=" << stats.evictions
+            << " hit ratio=" << stats.HitRatio();
+#if !defined(VMCACHE)
+  LOG_IF(INFO, ht.GetBufferPool()->GetPartitionCount() > 1)
+      << "Hash table buffer pool NUMA partitions: " << ht.GetBufferPool()->GetPartitionCount()
+      << ", remote hits=" << stats.remote_hits;
+#endif
+  LOG(INFO) << "Hash table buckets: " << ht.GetBucketCount();
+  HashTable::CompactionStats compaction = ht.GetCompactionStats();
+  LOG(INFO) << "Hash table compaction: deferred=" << compaction.deferred
+            << " dropped=" << compaction.dropped << " pending=" << compaction.pending
+            << " reclaimed=" << compaction.reclaimed;
+}
 
 int DbHashTable::Read(const std::string &table, uint64_t key,
                   const std::vector<std::string> *fields,
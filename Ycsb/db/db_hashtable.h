@@ -4,7 +4,14 @@
 namespace ycsbc {
 class DbHashTable : public DB {
   public:
-    DbHashTable(std::string filename, const bool load, uint32_t buffer_page);
+    // With checkpoint_interval > 0, a fuzzy checkpoint is taken every
+    // checkpoint_interval milliseconds. The table starts out with n_buckets
+    // buckets and splits them as it grows. A shared table is used by all
+    // threads, and its buffer pool is split by NUMA node if partitioning is
+    // enabled.
+    DbHashTable(std::string filename, const bool load, uint32_t buffer_page, long checkpoint_interval = 0,
+                size_t n_buckets = 100000, bool shared = false);
+    ~DbHashTable() override;
     int Read(const std::string &table, const std::string &key,
            const std::vector<std::string> *fields,
            std::vector<KVPair> &result) override;
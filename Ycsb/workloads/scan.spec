@@ -0,0 +1,30 @@
+# Yahoo! Cloud System Benchmark
+# Workload E: Short ranges
+#   Application example: Threaded conversations, where each scan is for the posts in a given thread
+#
+#   Scan/insert ratio: 95/5
+#   Request distribution: uniform
+#   Scan length: uniform in [1, maxscanlength]
+keylength=8
+fieldcount=1
+fieldlength=8
+
+insertstart=0 # Change it accordingly to avoid inserting existing keys.
+
+recordcount=1000
+
+workload=com.yahoo.ycsb.workloads.CoreWorkload
+
+readallfields=true
+
+readproportion=0
+insertproportion=0.05
+updateproportion=0
+scanproportion=0.95
+
+maxscanlength=100
+scanlengthdistribution=uniform
+
+requestdistribution=uniform
+
+benchmarkseconds=60
@@ -25,12 +25,22 @@
 #include "buffer_manager.h"
 #include <buildinfo.h>
 #include "../include/affinity.hpp"
+#include "../include/eviction_policy.hpp"
+#include "../include/huge_pages.hpp"
+#include "../include/memory_broker.hpp"
+#include "../include/numa_partitions.hpp"
+#include "../include/perf_counters.hpp"
+#if defined(IO_URING)
+#include "../include/uring_engine.hpp"
+#endif
 
 using namespace std;
 
 std::atomic<bool> shutdown(false);
 std::atomic<uint64_t> shutdown_barrier(0);
 std::atomic<uint64_t> start_barrier(0);
+// Count the dTLB misses of the run phase, see TlbCounters.
+bool tlb_stats = false;
 
 void UsageMessage(const char *command);
 bool StrStartWith(const char *str, const char *pre);
@@ -41,7 +51,9 @@ struct ClientStats {
   uint64_t oks{};
   uint64_t inserts{};
   uint64_t reads{};
+  uint64_t scans{};
   std::vector<std::chrono::high_resolution_clock::time_point> latencies{};
+  TlbCounters::Counts tlb{};
   // reducing reserve can cause allocations during benchmark
   ClientStats(double latency_sample) {
     if (latency_sample > 0.0)  // 1 Billion samples / sample rate
@@ -74,8 +86,13 @@ ClientStats DelegateClient(int thread_id, ycsbc::Client *client, ycsbc::DB *db,
     }
     --shutdown_barrier;
   } else {
+    std::unique_ptr<TlbCounters> tlb;
+    if (tlb_stats) {
+      tlb.reset(new TlbCounters);
+    }
     --start_barrier;
     while (start_barrier);
+    if (tlb) tlb->Start();
     if(latency_sample <= 0.0)
       while (!shutdown.load(std::memory_order_relaxed))
         stats.oks += client->DoTransaction();
@@ -91,6 +108,7 @@ ClientStats DelegateClient(int thread_id, ycsbc::Client *client, ycsbc::DB *db,
           stats.latencies.emplace_back(end);
         }
       }
+    if (tlb) stats.tlb = tlb->Stop();
     --shutdown_barrier;
     LOG_IF(WARNING, stats.oks != client->GetOps())
         << stats.oks << " Oks != expected: " << client->GetOps()
@@ -100,6 +118,7 @@ ClientStats DelegateClient(int thread_id, ycsbc::Client *client, ycsbc::DB *db,
   db->thread_deinit(thread_id);
   stats.inserts = client->GetInsert();
   stats.reads = client->GetRead();
+  stats.scans = client->GetScan();
   db->Close();
   return stats;
 }
@@ -130,6 +149,61 @@ int main(const int argc, const char *argv[]) {
     latency_sample = 0;
   }
 
+  // Select the page I/O backend before any file is opened.
+  const string io_engine = props.GetProperty("io_engine", "psync");
+  if (io_engine != "psync") {
+#if defined(IO_URING)
+    UringEngine::Options options;
+    options.queue_depth = stoul(props.GetProperty("io_depth", "256"));
+    if (io_engine == "io_uring_sqpoll") {
+      options.sqpoll = true;
+    } else if (io_engine == "io_uring_iopoll") {
+      options.iopoll = true;
+    } else if (io_engine != "io_uring") {
+      cerr << "Invalid option \"-io_engine\", choose from psync, io_uring, "
+              "io_uring_sqpoll and io_uring_iopoll.\n";
+      exit(0);
+    }
+    UringEngine::Enable(options);
+#else
+    cerr << "\"-io_engine " << io_engine << "\" requires building with -DIO_URING=ON.\n";
+    exit(0);
+#endif
+  }
+
+  // Select the replacement policy of the buffer pools before they are created.
+  EvictionPolicy::Kind eviction;
+  if (!EvictionPolicy::Parse(props.GetProperty("eviction", "clock"), eviction)) {
+    cerr << "Invalid option \"-eviction\", choose from clock, lru, 2q, arc and midpoint.\n";
+    exit(0);
+  }
+  EvictionPolicy::SetDefault(eviction);
+
+  // Back the buffer pools with huge pages, also before they are created.
+  HugePages::Kind huge_pages;
+  if (!HugePages::Parse(props.GetProperty("huge_pages", "off"), huge_pages)) {
+    cerr << "Invalid option \"-huge_pages\", choose from off, thp, 2m and 1g.\n";
+    exit(0);
+  }
+  HugePages::SetDefault(huge_pages);
+  tlb_stats = utils::StrToBool(props.GetProperty("tlb_stats", "false"));
+  if (utils::StrToBool(props.GetProperty("numa_partition", "false"))) {
+    NumaPartitions::Enable();
+  }
+
+  // Split a page budget among the buffer pools and move frames between them
+  // as the workload runs. The broker must exist before the pools.
+  const uint64_t memory_budget = stoull(props.GetProperty("memory_budget", "0"));
+  if (memory_budget > 0) {
+#if defined(VMCACHE)
+    cerr << "\"-memory_budget\" is not supported with -DVMCACHE=ON.\n";
+    exit(0);
+#else
+    MemoryBroker::Enable(memory_budget, std::max<uint64_t>(memory_budget / 64, 16),
+                         std::chrono::milliseconds(stol(props.GetProperty("broker_interval", "1000"))));
+#endif
+  }
+
   vector<ycsbc::DB *> connections;
   vector<future<ClientStats>> workers;
   vector<ycsbc::CoreWorkload> workloads;
@@ -147,12 +221,14 @@ int main(const int argc, const char *argv[]) {
       exit(0);
     }
 
+    // All threads share one B-tree (and one buffer pool).
+    props.SetProperty("btree_file", path + "/btree");
+    auto *db = ycsbc::DBFactory::CreateDB(props);
     auto insert_start = props.GetProperty("insertstart");
     for (int i = 0; i < num_threads; ++i) {
-      props.SetProperty("btree_file", path + "/btree_" + std::to_string(i));
       props.SetProperty("thread_id", std::to_string(i));
 
-      connections.emplace_back(ycsbc::DBFactory::CreateDB(props));
+      connections.emplace_back(db);
 
       props.SetProperty("insertstart", insert_start);
       workloads.emplace_back(props);
@@ -167,11 +243,23 @@ int main(const int argc, const char *argv[]) {
       exit(0);
     }
 
+    // Every thread has a table (and a buffer pool) of its own, unless they
+    // share one. Tables grow as records are inserted, so a shared one starts
+    // out with as many buckets as any other.
+    ycsbc::DB *shared = nullptr;
+    if (utils::StrToBool(props.GetProperty("shared_table", "false"))) {
+#if defined(VMCACHE)
+      cerr << "\"-shared_table\" is not supported with -DVMCACHE=ON.\n";
+      exit(0);
+#endif
+      props.SetProperty("hashtable_file", path + "/hashtable");
+      shared = ycsbc::DBFactory::CreateDB(props);
+    }
     for (int i = 0; i < num_threads; ++i) {
       props.SetProperty("hashtable_file", path + "/hashtable_" + std::to_string(i));
       props.SetProperty("thread_id", std::to_string(i));
 
-      connections.emplace_back(ycsbc::DBFactory::CreateDB(props));
+      connections.emplace_back(shared ? shared : ycsbc::DBFactory::CreateDB(props));
 
       workloads.emplace_back(props);
     }
@@ -254,7 +342,38 @@ int main(const int argc, const char *argv[]) {
                           stoi(props.GetProperty("starting_cpu", "0")));
 
   // Loads data
-  if (load) {
+  if (load && utils::StrToBool(props.GetProperty("bulk_load", "false"))) {
+    total_ops = stoi(props[ycsbc::CoreWorkload::RECORD_COUNT_PROPERTY]);
+
+    timer.Start();
+
+    // Draw the same keys the load threads would insert, then build the index
+    // from all of them at once.
+    std::vector<uint64_t> keys;
+    keys.reserve(total_ops);
+    for (int i = 0; i < num_threads; ++i) {
+      for (int j = 0; j < total_ops / num_threads; ++j) {
+        keys.push_back(workloads[i].NextSequenceKey());
+      }
+    }
+    uint64_t sum = keys.size();
+    auto value_of = [&](uint64_t key) {
+      std::vector<ycsbc::DB::KVPair> values;
+      workloads[0].BuildValues(key, values);
+      return values.empty() ? std::string() : values[0].second;
+    };
+    if (!connections[0]->BulkLoad(keys, value_of)) {
+      cerr << "\"-bulk_load\" is not supported by \"-tree " << props.GetProperty("tree") << "\".\n";
+      exit(0);
+    }
+
+    double use_time = timer.End();
+
+    cout << "********** load result **********" << endl;
+    cout << "bulk loading records: " << sum << ", use time: " << use_time
+         << " s, qps: " << sum / use_time << " ops/sec" << endl;
+    cout << "*********************************" << endl;
+  } else if (load) {
     total_ops = stoi(props[ycsbc::CoreWorkload::RECORD_COUNT_PROPERTY]);
 
     timer.Start();
@@ -405,9 +524,11 @@ int main(const int argc, const char *argv[]) {
     std::vector<double> global_latencies{};
     global_latencies.reserve(1024*1024);
     uint64_t total_ops = 0;
+    TlbCounters::Counts tlb;
     for (auto &f : workers) {
       auto stats = f.get();
-      total_ops += stats.inserts + stats.reads;
+      total_ops += stats.inserts + stats.reads + stats.scans;
+      tlb += stats.tlb;
       for (unsigned int i = 0; i < stats.latencies.size(); i = i + 2) {
         auto s = std::chrono::nanoseconds(stats.latencies[i + 1] -
                                           stats.latencies[i]).count();
@@ -425,6 +546,16 @@ int main(const int argc, const char *argv[]) {
     cout << "********** run result **********" << endl;
     cout << "operations: " << total_ops << ", duration: " << duration
          << " s,  qps: " << total_ops / duration << " ops/s" << endl;
+    if (tlb_stats) {
+      if (tlb.available) {
+        // Every dTLB miss is a page walk.
+        cout << "dTLB misses: loads " << tlb.load_misses << ", stores " << tlb.store_misses << ", "
+             << (double)(tlb.load_misses + tlb.store_misses) / std::max<uint64_t>(total_ops, 1) << " per op ("
+             << HugePages::Name(huge_pages) << " huge pages)" << endl;
+      } else {
+        cout << "dTLB misses: not available, see kernel.perf_event_paranoid" << endl;
+      }
+    }
 
     if(latency_sample != 0){
       std::sort(global_latencies.begin(), global_latencies.end());
@@ -445,14 +576,24 @@ int main(const int argc, const char *argv[]) {
                 << std::endl;
     }
   }
+  if (MemoryBroker *broker = MemoryBroker::Get()) {
+    for (auto &share : broker->GetAllocation()) {
+      LOG(INFO) << "Memory broker: pool " << share.name << " has " << share.capacity << " pages, hit ratio="
+                << share.stats.HitRatio();
+    }
+    LOG(INFO) << "Memory broker: " << broker->GetMoves() << " moves within a budget of " << broker->GetBudget()
+              << " pages";
+  }
   if (props.GetProperty("tree") != "pibench" && props.GetProperty("tree") != "dash" &&
-      props.GetProperty("tree") != "bztree") {
+      props.GetProperty("tree") != "bztree" && props.GetProperty("tree") != "btree" &&
+      !(props.GetProperty("tree") == "hashtable" && utils::StrToBool(props.GetProperty("shared_table", "false")))) {
     for (auto &db: connections) {
       delete db;
     }
   } else {
     delete connections.front();
   }
+  MemoryBroker::Disable();
 }
 
 string ParseCommandLine(int argc, const char *argv[],
@@ -628,6 +769,118 @@ string ParseCommandLine(int argc, const char *argv[],
       }
       props.SetProperty("starting_cpu", argv[argindex]);
       argindex++;
+    } else if (strcmp(argv[argindex], "-io_engine") == 0) {
+      argindex++;
+      if (argindex >= argc) {
+        UsageMessage(argv[0]);
+        exit(0);
+      }
+      props.SetProperty("io_engine", argv[argindex]);
+      argindex++;
+    } else if (strcmp(argv[argindex], "-io_depth") == 0) {
+      argindex++;
+      if (argindex >= argc) {
+        UsageMessage(argv[0]);
+        exit(0);
+      }
+      props.SetProperty("io_depth", argv[argindex]);
+      argindex++;
+    } else if (strcmp(argv[argindex], "-bulk_load") == 0) {
+      argindex++;
+      if (argindex >= argc) {
+        UsageMessage(argv[0]);
+        exit(0);
+      }
+      props.SetProperty("bulk_load", argv[argindex]);
+      argindex++;
+    } else if (strcmp(argv[argindex], "-fill_factor") == 0) {
+      argindex++;
+      if (argindex >= argc) {
+        UsageMessage(argv[0]);
+        exit(0);
+      }
+      props.SetProperty("fill_factor", argv[argindex]);
+      argindex++;
+    } else if (strcmp(argv[argindex], "-wal") == 0) {
+      argindex++;
+      if (argindex >= argc) {
+        UsageMessage(argv[0]);
+        exit(0);
+      }
+      props.SetProperty("wal", argv[argindex]);
+      argindex++;
+    } else if (strcmp(argv[argindex], "-pin_inner") == 0) {
+      argindex++;
+      if (argindex >= argc) {
+        UsageMessage(argv[0]);
+        exit(0);
+      }
+      props.SetProperty("pin_inner", argv[argindex]);
+      argindex++;
+    } else if (strcmp(argv[argindex], "-eviction") == 0) {
+      argindex++;
+      if (argindex >= argc) {
+        UsageMessage(argv[0]);
+        exit(0);
+      }
+      props.SetProperty("eviction", argv[argindex]);
+      argindex++;
+    } else if (strcmp(argv[argindex], "-huge_pages") == 0) {
+      argindex++;
+      if (argindex >= argc) {
+        UsageMessage(argv[0]);
+        exit(0);
+      }
+      props.SetProperty("huge_pages", argv[argindex]);
+      argindex++;
+    } else if (strcmp(argv[argindex], "-numa_partition") == 0) {
+      argindex++;
+      if (argindex >= argc) {
+        UsageMessage(argv[0]);
+        exit(0);
+      }
+      props.SetProperty("numa_partition", argv[argindex]);
+      argindex++;
+    } else if (strcmp(argv[argindex], "-shared_table") == 0) {
+      argindex++;
+      if (argindex >= argc) {
+        UsageMessage(argv[0]);
+        exit(0);
+      }
+      props.SetProperty("shared_table", argv[argindex]);
+      argindex++;
+    } else if (strcmp(argv[argindex], "-tlb_stats") == 0) {
+      argindex++;
+      if (argindex >= argc) {
+        UsageMessage(argv[0]);
+        exit(0);
+      }
+      props.SetProperty("tlb_stats", argv[argindex]);
+      argindex++;
+    } else if (strcmp(argv[argindex], "-memory_budget") == 0) {
+      argindex++;
+      if (argindex >= argc) {
+        UsageMessage(argv[0]);
+        exit(0);
+      }
+      props.SetProperty("memory_budget", argv[argindex]);
+      argindex++;
+    } else if (strcmp(argv[argindex], "-broker_interval") == 0) {
+      argindex++;
+      if (argindex >= argc) {
+        UsageMessage(argv[0]);
+        exit(0);
+      }
+      props.SetProperty("broker_interval", argv[argindex]);
+      argindex++;
+    } else if (strcmp(argv[argindex], "-checkpoint_interval") == 0) {
+      argindex++;
+      if (argindex >= argc) {
+        UsageMessage(argv[0]);
+        exit(0);
+      }
+      props.SetProperty("checkpoint_interval", argv[argindex]);
+      argindex++;
     } else if (strcmp(argv[argindex], "-epoch") == 0) {
       argindex++;
       if (argindex >= argc) {
@@ -667,13 +920,52 @@ Optional Flags:
   run <true|false>: if set true, run with the workload defined in the property file. Default is false.
   stride n: The stride for CPU pinning. Must be greater than 0. Default is 2.
   starting_cpu n: The first CPU # to use. Default is 0.
+  io_engine e: Page I/O backend of btree and hashtable, choose from [psync io_uring
+               io_uring_sqpoll io_uring_iopoll]. Default is psync. The io_uring
+               engines require building with -DIO_URING=ON.
+  io_depth n: Queue depth of each thread's io_uring. Default is 256.
+  checkpoint_interval n: Write back the dirty pages of btree and hashtable in
+                         a fuzzy checkpoint every n milliseconds while the
+                         workload runs. Default is 0 (off).
+  eviction p: Replacement policy of the btree and hashtable buffer pools, choose
+              from [clock lru 2q arc midpoint]. midpoint is a scan-resistant
+              LRU. Hits, misses and evictions are logged when the pools are
+              closed. Default is clock.
+  huge_pages h: Back the btree and hashtable buffer pools with huge pages,
+               choose from [off thp 2m 1g]. 2m and 1g need pages reserved in
+               vm.nr_hugepages, and fall back to thp. Default is off.
+  numa_partition <true|false>: Split the frames of the btree buffer pool, and
+                               of the shared hashtable's, into one partition
+                               per NUMA node, and take frames of the local
+                               node on a miss. Default is false.
+  tlb_stats <true|false>: Count the dTLB misses (page walks) of the run phase
+                          with perf counters. Default is false.
+  memory_budget n: Split n pages among the btree and hashtable buffer pools
+                   and move frames to the pools that miss most while the
+                   workload runs. Overrides buffer_page. Default is 0 (off).
+  broker_interval n: Rebalance the memory_budget every n milliseconds.
+                     Default is 1000.
 Tree Dependent Flags:
 btree:
   buffer_page n: the number of pages for the buffer pool.
   falloc_index n: the size of the pre-allocated index files in n bytes.
   falloc_data n: the size of the pre-allocated data files in n bytes.
+  bulk_load <true|false>: with -load true, build the tree bottom-up from all
+                          records instead of inserting them. Default is false.
+  fill_factor f: node fill factor of bulk loading, in (0, 1]. Default is 1.0.
+  wal <true|false>: log changes to a write-ahead log with group commit and
+                    recover from it on open. Default is false.
+  pin_inner <true|false>: keep the inner nodes pinned in the buffer pool, so
+                          that only leaves are evicted. buffer_page must leave
+                          room for them. Default is false.
+hashtable:
+  buffer_page n: the number of pages of each thread's buffer pool.
+  shared_table <true|false>: all threads share one table, and one buffer pool
+                             of buffer_page pages. Default is false.
 btree_rdev:
   device_size n: the size of the raw device in n GB, required.
+  buffer_page n: the number of pages of the buffer pool the trees of all
+                 threads share.
 pibench:
   wrapper wrapperfile.so: Use a PiBench wrapper file, required.
   poolsize n: The size to give the pibench wrapper in bytes, depending on the
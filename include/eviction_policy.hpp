@@ -0,0 +1,552 @@
+#ifndef EVICTION_POLICY_HPP
+#define EVICTION_POLICY_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Hit, miss and eviction counters of a buffer pool. Hits and misses count
+// the pins that found, or had to read, their page.
+struct BufferStats {
+  uint64_t hits{0};
+  uint64_t misses{0};
+  uint64_t evictions{0};
+  uint64_t remote_hits{0};  // Hits on frames of another NUMA node, see NumaPartitions
+
+  double HitRatio() const {
+    return hits + misses > 0 ? static_cast<double>(hits) / (hits + misses) : 0.0;
+  }
+};
+
+// Replacement policy of a buffer pool (see BufferManager and HtBufferManager).
+//
+// The pool tells the policy which page each frame holds and when it is used,
+// and the policy picks the frames to evict. Frames are identified by their
+// index and pages by a 64-bit key. A frame is tracked from Admit until Evicted
+// or Free. Calls for a frame that is not tracked are ignored, so a hit that
+// races with the load of the same frame does no harm.
+//
+// Policies are thread-safe: CLOCK is lock-free, the others keep their lists
+// under a latch. The policy of the pools created next is chosen once per run
+// with SetDefault.
+class EvictionPolicy {
+ public:
+  enum class Kind { kClock, kLru, k2Q, kArc, kMidpoint };
+  static constexpr uint32_t kNoFrame = ~uint32_t{0};
+
+  virtual ~EvictionPolicy() = default;
+  virtual const char *Name() const = 0;
+
+  // The page key was read into frame. weight is the number of CLOCK rounds
+  // the use protects the page for; the other policies ignore it.
+  virtual void Admit(uint32_t frame, uint64_t key, uint16_t weight) = 0;
+  // The page in frame was used again.
+  virtual void Access(uint32_t frame, uint16_t weight) = 0;
+  // Offer frames to claim in eviction order until it takes one, and return
+  // that frame. claim returns false for frames that cannot be evicted now,
+  // e.g., because they are pinned. Returns kNoFrame after one round over the
+  // frames. The page in the returned frame is still tracked: the pool calls
+  // Evicted once it is gone, or leaves it be if it has to stay after all.
+  virtual uint32_t Victim(const std::function<bool(uint32_t)> &claim) = 0;
+  // The page in frame, taken with Victim, was evicted.
+  virtual void Evicted(uint32_t frame) = 0;
+  // frame holds no page any more, e.g., because its page was freed.
+  virtual void Free(uint32_t frame) = 0;
+  // Append up to count frames that Victim would offer next, for writing them
+  // back ahead of eviction.
+  virtual void Upcoming(uint32_t count, std::vector<uint32_t> &frames) = 0;
+  // frame is taken out of use, e.g., because the pool shrinks (see
+  // ResizablePool), until it is given back with Free. Victim may still offer
+  // it to claim.
+  virtual void Withdraw(uint32_t frame) = 0;
+  // Only capacity frames are in use. Policies that split the frames into
+  // parts size the parts by it.
+  virtual void SetCapacity(uint32_t capacity) {}
+
+  // Policy names: clock, lru, 2q, arc and midpoint.
+  static bool Parse(const std::string &name, Kind &kind) {
+    static const std::pair<const char *, Kind> kNames[] = {
+        {"clock", Kind::kClock}, {"lru", Kind::kLru}, {"2q", Kind::k2Q},
+        {"arc", Kind::kArc},     {"midpoint", Kind::kMidpoint}};
+    for (auto &n : kNames) {
+      if (name == n.first) {
+        kind = n.second;
+        return true;
+      }
+    }
+    return false;
+  }
+  // Select the policy of the buffer pools created from now on. CLOCK is the
+  // default.
+  static void SetDefault(Kind kind) { default_kind = kind; }
+  static std::unique_ptr<EvictionPolicy> Make(uint32_t frame_count) {
+    return Make(default_kind, frame_count);
+  }
+  static std::unique_ptr<EvictionPolicy> Make(Kind kind, uint32_t frame_count);
+
+ private:
+  static inline Kind default_kind = Kind::kClock;
+};
+
+// CLOCK with reference counts: the hand passes over a used frame weight times
+// before the frame can be evicted.
+class ClockPolicy : public EvictionPolicy {
+ public:
+  explicit ClockPolicy(uint32_t frame_count)
+      : frame_count(frame_count), refs(new std::atomic<uint16_t>[frame_count]) {
+    for (uint32_t i = 0; i < frame_count; ++i) {
+      refs[i].store(0, std::memory_order_relaxed);
+    }
+  }
+  const char *Name() const override { return "clock"; }
+
+  void Admit(uint32_t frame, uint64_t, uint16_t weight) override {
+    refs[frame].store(weight, std::memory_order_relaxed);
+  }
+  void Access(uint32_t frame, uint16_t weight) override {
+    refs[frame].store(weight, std::memory_order_relaxed);
+  }
+  // The hand is advanced with an atomic increment instead of a latch.
+  uint32_t Victim(const std::function<bool(uint32_t)> &claim) override {
+    for (uint32_t i = 0; i < frame_count; ++i) {
+      uint32_t frame = hand.fetch_add(1, std::memory_order_relaxed) % frame_count;
+      // Decrement the reference count unless it already dropped to zero.
+      uint16_t used = refs[frame].load(std::memory_order_relaxed);
+      while (used > 0 && !refs[frame].compare_exchange_weak(used, used - 1, std::memory_order_relaxed)) {
+      }
+      if (used == 0 && claim(frame)) {
+        return frame;
+      }
+    }
+    return kNoFrame;
+  }
+  void Evicted(uint32_t frame) override { refs[frame].store(0, std::memory_order_relaxed); }
+  void Free(uint32_t frame) override { refs[frame].store(0, std::memory_order_relaxed); }
+  void Withdraw(uint32_t frame) override { refs[frame].store(0, std::memory_order_relaxed); }
+  void Upcoming(uint32_t count, std::vector<uint32_t> &frames) override {
+    uint64_t h = hand.load(std::memory_order_relaxed);
+    for (uint32_t i = 0; i < std::min(count, frame_count); ++i) {
+      frames.push_back((h + i) % frame_count);
+    }
+  }
+
+ private:
+  uint32_t frame_count;
+  std::unique_ptr<std::atomic<uint16_t>[]> refs;
+  std::atomic<uint64_t> hand{0};
+};
+
+// Base of the policies that order the frames in lists. Every frame is in at
+// most one list, threaded through per-frame links; list 0 holds the free
+// frames, which are offered first. Frames are appended at the back (most
+// recently used end) and offered from the front. Derived classes hold latch
+// in all their methods.
+class FrameListPolicy : public EvictionPolicy {
+ protected:
+  static constexpr uint8_t kFreeList = 0;
+  static constexpr uint8_t kNoList = 0xff;
+
+  FrameListPolicy(uint32_t frame_count, uint8_t list_count)
+      : frame_count(frame_count), links(frame_count), keys(frame_count), heads(list_count),
+        tails(list_count), sizes(list_count) {
+    for (uint8_t l = 0; l < list_count; ++l) {
+      heads[l] = tails[l] = kNoFrame;
+    }
+    for (uint32_t f = 0; f < frame_count; ++f) {
+      PushBack(kFreeList, f);
+    }
+  }
+
+  uint8_t ListOf(uint32_t frame) const { return links[frame].list; }
+  uint32_t Size(uint8_t list) const { return sizes[list]; }
+  uint32_t Front(uint8_t list) const { return heads[list]; }
+  uint32_t Next(uint32_t frame) const { return links[frame].next; }
+
+  void PushBack(uint8_t list, uint32_t frame) {
+    Link &link = links[frame];
+    link.list = list;
+    link.prev = tails[list];
+    link.next = kNoFrame;
+    if (tails[list] != kNoFrame) {
+      links[tails[list]].next = frame;
+    } else {
+      heads[list] = frame;
+    }
+    tails[list] = frame;
+    sizes[list]++;
+  }
+
+  void Remove(uint32_t frame) {
+    Link &link = links[frame];
+    if (link.list == kNoList) {
+      return;
+    }
+    (link.prev != kNoFrame ? links[link.prev].next : heads[link.list]) = link.next;
+    (link.next != kNoFrame ? links[link.next].prev : tails[link.list]) = link.prev;
+    sizes[link.list]--;
+    link.list = kNoList;
+  }
+
+  void MoveToBack(uint8_t list, uint32_t frame) {
+    Remove(frame);
+    PushBack(list, frame);
+  }
+
+  // Take a free frame if claim accepts one.
+  uint32_t TakeFree(const std::function<bool(uint32_t)> &claim) {
+    for (uint32_t f = Front(kFreeList); f != kNoFrame; f = Next(f)) {
+      if (claim(f)) {
+        Remove(f);
+        return f;
+      }
+    }
+    return kNoFrame;
+  }
+
+  // Offer the frames of list from the front. A frame claim turns down is in
+  // use, so it moves to the back as if it was just used. Frames reached
+  // through swizzled references are pinned or used without the pool knowing,
+  // and would otherwise be offered first over and over.
+  uint32_t Offer(uint8_t list, const std::function<bool(uint32_t)> &claim) {
+    for (uint32_t n = Size(list); n > 0; --n) {
+      uint32_t f = Front(list);
+      if (claim(f)) {
+        return f;
+      }
+      MoveToBack(list, f);
+    }
+    return kNoFrame;
+  }
+
+  void Collect(uint8_t list, uint32_t count, std::vector<uint32_t> &frames) const {
+    for (uint32_t f = Front(list); f != kNoFrame && frames.size() < count; f = Next(f)) {
+      frames.push_back(f);
+    }
+  }
+
+ public:
+  void Free(uint32_t frame) override {
+    std::lock_guard<std::mutex> guard(latch);
+    if (ListOf(frame) != kFreeList) {
+      Remove(frame);
+      PushBack(kFreeList, frame);
+    }
+  }
+  void Withdraw(uint32_t frame) override {
+    std::lock_guard<std::mutex> guard(latch);
+    Remove(frame);
+  }
+
+ protected:
+  struct Link {
+    uint32_t prev{kNoFrame};
+    uint32_t next{kNoFrame};
+    uint8_t list{kNoList};
+  };
+
+  uint32_t frame_count;
+  std::mutex latch;
+  std::vector<Link> links;
+  std::vector<uint64_t> keys;  // Key of the page in each tracked frame
+  std::vector<uint32_t> heads;
+  std::vector<uint32_t> tails;
+  std::vector<uint32_t> sizes;
+};
+
+// Keys of recently evicted pages in FIFO order (ghost entries of 2Q and ARC).
+class GhostList {
+ public:
+  size_t Size() const { return order.size(); }
+  bool Erase(uint64_t key) {
+    auto it = index.find(key);
+    if (it == index.end()) {
+      return false;
+    }
+    order.erase(it->second);
+    index.erase(it);
+    return true;
+  }
+  void PushBack(uint64_t key) {
+    Erase(key);
+    index.emplace(key, order.insert(order.end(), key));
+  }
+  void PopFront() {
+    index.erase(order.front());
+    order.pop_front();
+  }
+
+ private:
+  std::list<uint64_t> order;
+  std::unordered_map<uint64_t, std::list<uint64_t>::iterator> index;
+};
+
+// Least recently used.
+class LruPolicy : public FrameListPolicy {
+ public:
+  explicit LruPolicy(uint32_t frame_count) : FrameListPolicy(frame_count, 2) {}
+  const char *Name() const override { return "lru"; }
+
+  void Admit(uint32_t frame, uint64_t key, uint16_t) override {
+    std::lock_guard<std::mutex> guard(latch);
+    keys[frame] = key;
+    MoveToBack(kLru, frame);
+  }
+  void Access(uint32_t frame, uint16_t) override {
+    std::lock_guard<std::mutex> guard(latch);
+    if (ListOf(frame) == kLru) {
+      MoveToBack(kLru, frame);
+    }
+  }
+  uint32_t Victim(const std::function<bool(uint32_t)> &claim) override {
+    std::lock_guard<std::mutex> guard(latch);
+    uint32_t frame = TakeFree(claim);
+    return frame != kNoFrame ? frame : Offer(kLru, claim);
+  }
+  void Evicted(uint32_t frame) override {
+    std::lock_guard<std::mutex> guard(latch);
+    if (ListOf(frame) == kLru) {
+      Remove(frame);
+    }
+  }
+  void Upcoming(uint32_t count, std::vector<uint32_t> &frames) override {
+    std::lock_guard<std::mutex> guard(latch);
+    Collect(kLru, count, frames);
+  }
+
+ private:
+  static constexpr uint8_t kLru = 1;
+};
+
+// 2Q (Johnson and Shasha), an approximation of LRU-2. A page read in for the
+// first time enters the A1in FIFO; only a page that is read in again while it
+// is remembered in the A1out ghost list enters the Am LRU list. A1in gets a
+// quarter of the frames, A1out remembers half as many pages as there are
+// frames.
+class TwoQPolicy : public FrameListPolicy {
+ public:
+  explicit TwoQPolicy(uint32_t frame_count) : FrameListPolicy(frame_count, 3) { SetCapacity(frame_count); }
+  const char *Name() const override { return "2q"; }
+  void SetCapacity(uint32_t capacity) override {
+    std::lock_guard<std::mutex> guard(latch);
+    max_in = std::max<uint32_t>(capacity / 4, 1);
+    max_out = std::max<uint32_t>(capacity / 2, 1);
+  }
+
+  void Admit(uint32_t frame, uint64_t key, uint16_t) override {
+    std::lock_guard<std::mutex> guard(latch);
+    keys[frame] = key;
+    MoveToBack(a1out.Erase(key) ? kAm : kA1in, frame);
+  }
+  // Uses of a page in A1in are taken as correlated with its first use.
+  void Access(uint32_t frame, uint16_t) override {
+    std::lock_guard<std::mutex> guard(latch);
+    if (ListOf(frame) == kAm) {
+      MoveToBack(kAm, frame);
+    }
+  }
+  uint32_t Victim(const std::function<bool(uint32_t)> &claim) override {
+    std::lock_guard<std::mutex> guard(latch);
+    uint32_t frame = TakeFree(claim);
+    auto [first, second] = Order();
+    if (frame == kNoFrame) frame = Offer(first, claim);
+    if (frame == kNoFrame) frame = Offer(second, claim);
+    return frame;
+  }
+  void Evicted(uint32_t frame) override {
+    std::lock_guard<std::mutex> guard(latch);
+    if (ListOf(frame) == kA1in) {
+      a1out.PushBack(keys[frame]);
+      while (a1out.Size() > max_out) {
+        a1out.PopFront();
+      }
+    }
+    if (ListOf(frame) != kFreeList) {
+      Remove(frame);
+    }
+  }
+  void Upcoming(uint32_t count, std::vector<uint32_t> &frames) override {
+    std::lock_guard<std::mutex> guard(latch);
+    auto [first, second] = Order();
+    Collect(first, count, frames);
+    Collect(second, count, frames);
+  }
+
+ private:
+  static constexpr uint8_t kA1in = 1;
+  static constexpr uint8_t kAm = 2;
+
+  // A1in gives up frames while it is over its share.
+  std::pair<uint8_t, uint8_t> Order() const {
+    return Size(kA1in) > max_in ? std::make_pair(kA1in, kAm) : std::make_pair(kAm, kA1in);
+  }
+
+  uint32_t max_in;
+  uint32_t max_out;
+  GhostList a1out;
+};
+
+// Adaptive Replacement Cache (Megiddo and Modha). T1 holds pages used once
+// since they were read in, T2 pages used more often; the ghost lists B1 and B2
+// remember pages recently evicted from each. Reading in a page remembered in
+// B1 (B2) grows (shrinks) the target size p of T1, and Victim takes from T1
+// while it is larger than p.
+class ArcPolicy : public FrameListPolicy {
+ public:
+  explicit ArcPolicy(uint32_t frame_count) : FrameListPolicy(frame_count, 3), capacity(frame_count) {}
+  const char *Name() const override { return "arc"; }
+  void SetCapacity(uint32_t capacity) override {
+    std::lock_guard<std::mutex> guard(latch);
+    this->capacity = capacity;
+    p = std::min<size_t>(p, capacity);
+  }
+
+  void Admit(uint32_t frame, uint64_t key, uint16_t) override {
+    std::lock_guard<std::mutex> guard(latch);
+    keys[frame] = key;
+    size_t s1 = b1.Size(), s2 = b2.Size();
+    if (b1.Erase(key)) {
+      p = std::min<size_t>(capacity, p + std::max<size_t>(s2 / s1, 1));
+      MoveToBack(kT2, frame);
+    } else if (b2.Erase(key)) {
+      p -= std::min(p, std::max<size_t>(s1 / s2, 1));
+      MoveToBack(kT2, frame);
+    } else {
+      MoveToBack(kT1, frame);
+    }
+  }
+  void Access(uint32_t frame, uint16_t) override {
+    std::lock_guard<std::mutex> guard(latch);
+    if (ListOf(frame) == kT1 || ListOf(frame) == kT2) {
+      MoveToBack(kT2, frame);
+    }
+  }
+  uint32_t Victim(const std::function<bool(uint32_t)> &claim) override {
+    std::lock_guard<std::mutex> guard(latch);
+    uint32_t frame = TakeFree(claim);
+    auto [first, second] = Order();
+    if (frame == kNoFrame) frame = Offer(first, claim);
+    if (frame == kNoFrame) frame = Offer(second, claim);
+    return frame;
+  }
+  // The ghost lists together remember at most as many pages as there are
+  // frames in use, and T1 and B1 together hold at most that many.
+  void Evicted(uint32_t frame) override {
+    std::lock_guard<std::mutex> guard(latch);
+    uint8_t list = ListOf(frame);
+    if (list != kT1 && list != kT2) {
+      return;
+    }
+    (list == kT1 ? b1 : b2).PushBack(keys[frame]);
+    Remove(frame);
+    while (b1.Size() > 0 && Size(kT1) + b1.Size() > capacity) {
+      b1.PopFront();
+    }
+    while (b1.Size() + b2.Size() > capacity) {
+      (b2.Size() > 0 ? b2 : b1).PopFront();
+    }
+  }
+  void Upcoming(uint32_t count, std::vector<uint32_t> &frames) override {
+    std::lock_guard<std::mutex> guard(latch);
+    auto [first, second] = Order();
+    Collect(first, count, frames);
+    Collect(second, count, frames);
+  }
+
+ private:
+  static constexpr uint8_t kT1 = 1;
+  static constexpr uint8_t kT2 = 2;
+
+  std::pair<uint8_t, uint8_t> Order() const {
+    return Size(kT1) > 0 && Size(kT1) >= std::max<size_t>(p, 1) ? std::make_pair(kT1, kT2)
+                                                                : std::make_pair(kT2, kT1);
+  }
+
+  size_t capacity;
+  size_t p{0};
+  GhostList b1;
+  GhostList b2;
+};
+
+// Scan-resistant LRU with midpoint insertion, as in InnoDB. The list is split
+// into a young part and an old part of 3/8 of the frames. Pages read in enter
+// the old part, and only move to the young part on their second hit, so a
+// scan, which reads (or prefetches) a page and uses it once, only cycles
+// through the old part. Frames are evicted from the old part first.
+class MidpointPolicy : public FrameListPolicy {
+ public:
+  explicit MidpointPolicy(uint32_t frame_count) : FrameListPolicy(frame_count, 3), hits(frame_count) {
+    SetCapacity(frame_count);
+  }
+  const char *Name() const override { return "midpoint"; }
+  void SetCapacity(uint32_t capacity) override {
+    std::lock_guard<std::mutex> guard(latch);
+    max_young = std::max<uint32_t>(capacity - capacity * 3 / 8, 1);
+  }
+
+  void Admit(uint32_t frame, uint64_t key, uint16_t) override {
+    std::lock_guard<std::mutex> guard(latch);
+    keys[frame] = key;
+    hits[frame] = 0;
+    MoveToBack(kOld, frame);
+  }
+  void Access(uint32_t frame, uint16_t) override {
+    std::lock_guard<std::mutex> guard(latch);
+    if (ListOf(frame) == kYoung || (ListOf(frame) == kOld && ++hits[frame] >= kHitsToPromote)) {
+      MoveToBack(kYoung, frame);
+      while (Size(kYoung) > max_young) {
+        MoveToBack(kOld, Front(kYoung));
+      }
+    }
+  }
+  uint32_t Victim(const std::function<bool(uint32_t)> &claim) override {
+    std::lock_guard<std::mutex> guard(latch);
+    uint32_t frame = TakeFree(claim);
+    if (frame == kNoFrame) frame = Offer(kOld, claim);
+    if (frame == kNoFrame) frame = Offer(kYoung, claim);
+    return frame;
+  }
+  void Evicted(uint32_t frame) override {
+    std::lock_guard<std::mutex> guard(latch);
+    if (ListOf(frame) == kOld || ListOf(frame) == kYoung) {
+      Remove(frame);
+    }
+  }
+  void Upcoming(uint32_t count, std::vector<uint32_t> &frames) override {
+    std::lock_guard<std::mutex> guard(latch);
+    Collect(kOld, count, frames);
+    Collect(kYoung, count, frames);
+  }
+
+ private:
+  static constexpr uint8_t kOld = 1;
+  static constexpr uint8_t kYoung = 2;
+  static constexpr uint8_t kHitsToPromote = 2;
+
+  std::vector<uint8_t> hits;  // Hits of each page in the old part
+  uint32_t max_young;
+};
+
+inline std::unique_ptr<EvictionPolicy> EvictionPolicy::Make(Kind kind, uint32_t frame_count) {
+  switch (kind) {
+    case Kind::kLru:
+      return std::make_unique<LruPolicy>(frame_count);
+    case Kind::k2Q:
+      return std::make_unique<TwoQPolicy>(frame_count);
+    case Kind::kArc:
+      return std::make_unique<ArcPolicy>(frame_count);
+    case Kind::kMidpoint:
+      return std::make_unique<MidpointPolicy>(frame_count);
+    case Kind::kClock:
+    default:
+      return std::make_unique<ClockPolicy>(frame_count);
+  }
+}
+
+#endif  // EVICTION_POLICY_HPP
@@ -0,0 +1,109 @@
+#ifndef HUGE_PAGES_HPP
+#define HUGE_PAGES_HPP
+
+#include <glog/logging.h>
+#include <linux/mman.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// Backing of large anonymous regions, e.g., the frames of a buffer pool, by
+// huge pages, so that a large pool takes fewer TLB entries and page walks.
+//
+// 2m and 1g take pages of that size from the hugetlbfs pool, which has to be
+// reserved ahead (vm.nr_hugepages, or the hugepages= boot parameter for 1 GB
+// pages). They are never swapped or given back to the OS in parts. thp asks
+// the kernel for transparent huge pages (madvise mode). A region that cannot
+// be backed as selected falls back to transparent huge pages, and then to base
+// pages. The backing of the regions mapped next is chosen once per run with
+// SetDefault, like the eviction policy; off is the default.
+class HugePages {
+ public:
+  enum class Kind { kOff, kTransparent, k2M, k1G };
+
+  // Backing names: off, thp, 2m and 1g.
+  static bool Parse(const std::string &name, Kind &kind) {
+    static const std::pair<const char *, Kind> kNames[] = {
+        {"off", Kind::kOff}, {"thp", Kind::kTransparent}, {"2m", Kind::k2M}, {"1g", Kind::k1G}};
+    for (auto &n : kNames) {
+      if (name == n.first) {
+        kind = n.second;
+        return true;
+      }
+    }
+    return false;
+  }
+  static const char *Name(Kind kind) {
+    switch (kind) {
+      case Kind::kTransparent: return "thp";
+      case Kind::k2M: return "2m";
+      case Kind::k1G: return "1g";
+      default: return "off";
+    }
+  }
+  static void SetDefault(Kind kind) { default_kind = kind; }
+  static Kind GetDefault() { return default_kind; }
+
+  // Whether pages of the region can be discarded one by one with
+  // madvise(MADV_DONTNEED); not so for hugetlbfs pages.
+  static bool CanDiscard(Kind backing) { return backing != Kind::k2M && backing != Kind::k1G; }
+
+  // Map len bytes of zeroed anonymous memory, backed as selected. Base and
+  // transparent huge pages are only backed once touched. Returns the backing
+  // the region got in backing, which Unmap needs.
+  static void *Map(size_t len, Kind &backing) {
+    backing = default_kind;
+    if (backing == Kind::k2M || backing == Kind::k1G) {
+      // Without MAP_NORESERVE, the mapping fails up front if the pool is short
+      // of pages, instead of faulting later.
+      int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (backing == Kind::k2M ? MAP_HUGE_2MB : MAP_HUGE_1GB);
+      void *addr = mmap(nullptr, RoundUp(len, PageSize(backing)), PROT_READ | PROT_WRITE, flags, -1, 0);
+      if (addr != MAP_FAILED) {
+        return addr;
+      }
+      LOG(WARNING) << "Can't map " << len << " bytes with " << Name(backing) << " huge pages (" << strerror(errno)
+                   << "), using transparent huge pages instead.";
+      backing = Kind::kTransparent;
+    }
+
+    const int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+    if (backing == Kind::kOff) {
+      void *addr = mmap(nullptr, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+      PCHECK(addr != MAP_FAILED) << "Can't map " << len << " bytes";
+      return addr;
+    }
+    // Transparent huge pages only back 2 MB aligned ranges, so the region is
+    // carved out of a larger mapping.
+    const size_t huge = PageSize(Kind::k2M);
+    const size_t size = RoundUp(len, sysconf(_SC_PAGESIZE));
+    char *raw = static_cast<char *>(mmap(nullptr, size + huge, PROT_READ | PROT_WRITE, flags, -1, 0));
+    PCHECK(raw != MAP_FAILED) << "Can't map " << len << " bytes";
+    char *addr = reinterpret_cast<char *>(RoundUp(reinterpret_cast<uintptr_t>(raw), huge));
+    if (addr > raw) {
+      munmap(raw, addr - raw);
+    }
+    munmap(addr + size, raw + size + huge - (addr + size));
+    if (madvise(addr, size, MADV_HUGEPAGE) != 0) {
+      LOG(WARNING) << "Transparent huge pages are not available (" << strerror(errno) << "), using base pages.";
+      backing = Kind::kOff;
+    }
+    return addr;
+  }
+
+  static void Unmap(void *addr, size_t len, Kind backing) {
+    munmap(addr, backing == Kind::kOff || backing == Kind::kTransparent ? len : RoundUp(len, PageSize(backing)));
+  }
+
+  // Size of the huge pages of a backing: 1 GB for 1g, 2 MB for the others.
+  static size_t PageSize(Kind kind) { return kind == Kind::k1G ? size_t{1} << 30 : size_t{1} << 21; }
+
+ private:
+  static size_t RoundUp(size_t n, size_t unit) { return (n + unit - 1) / unit * unit; }
+
+  static inline Kind default_kind = Kind::kOff;
+};
+
+#endif  // HUGE_PAGES_HPP
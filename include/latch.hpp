@@ -0,0 +1,93 @@
+#ifndef LATCH_HPP
+#define LATCH_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <immintrin.h>
+
+// Optimistic version latch for optimistic lock coupling (OLC).
+//
+// Structure of the latch word:
+// ---62 bits---|---1 bit---|---1 bit---|
+//    Version   |  Locked   | Obsolete  |
+//
+// Readers remember the version, read the protected data and then validate
+// that the version did not change. Writers set the locked bit; releasing the
+// write latch clears it and bumps the version, which invalidates all
+// concurrent optimistic readers.
+class OptLatch {
+ public:
+  OptLatch() = default;
+
+  // Re-initialize the latch, e.g., after a page was (re)loaded into a frame.
+  inline void Reset() noexcept { word.store(kInitial, std::memory_order_release); }
+
+  // The latch word, to be restored with Restore when the memory of the latch
+  // was discarded meanwhile.
+  inline uint64_t Save() const noexcept { return word.load(std::memory_order_acquire); }
+
+  // Continue from a saved latch word, unlocked and with a newer version than
+  // any reader saw, so that readers that validate against the old word
+  // restart. Restoring 0, i.e. nothing saved, gives the initial word.
+  inline void Restore(uint64_t saved) noexcept {
+    word.store(((saved & ~kObsolete) | kLocked) + kLocked, std::memory_order_release);
+  }
+
+  inline uint64_t ReadLockOrRestart(bool &need_restart) const noexcept {
+    uint64_t version = word.load(std::memory_order_acquire);
+    if (IsLocked(version) || IsObsolete(version)) {
+      _mm_pause();
+      need_restart = true;
+    }
+    return version;
+  }
+
+  inline void CheckOrRestart(uint64_t start_read, bool &need_restart) const noexcept {
+    ReadUnlockOrRestart(start_read, need_restart);
+  }
+
+  inline void ReadUnlockOrRestart(uint64_t start_read, bool &need_restart) const noexcept {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    need_restart = (start_read != word.load(std::memory_order_relaxed));
+  }
+
+  inline void UpgradeToWriteLockOrRestart(uint64_t &version, bool &need_restart) noexcept {
+    if (word.compare_exchange_strong(version, version + kLocked,
+                                     std::memory_order_acquire)) {
+      version = version + kLocked;
+    } else {
+      _mm_pause();
+      need_restart = true;
+    }
+  }
+
+  inline void WriteLockOrRestart(bool &need_restart) noexcept {
+    uint64_t version = ReadLockOrRestart(need_restart);
+    if (need_restart) return;
+    UpgradeToWriteLockOrRestart(version, need_restart);
+  }
+
+  inline void WriteUnlock() noexcept { word.fetch_add(kLocked, std::memory_order_release); }
+
+  inline void WriteUnlockObsolete() noexcept {
+    word.fetch_add(kLocked | kObsolete, std::memory_order_release);
+  }
+
+  inline bool IsLocked() const noexcept {
+    return IsLocked(word.load(std::memory_order_relaxed));
+  }
+
+ private:
+  static constexpr uint64_t kObsolete = 0b01;
+  static constexpr uint64_t kLocked = 0b10;
+  static constexpr uint64_t kInitial = 0b100;
+
+  static inline bool IsLocked(uint64_t version) noexcept { return (version & kLocked) == kLocked; }
+  static inline bool IsObsolete(uint64_t version) noexcept { return version & kObsolete; }
+
+  std::atomic<uint64_t> word{kInitial};
+};
+
+static_assert(sizeof(OptLatch) == sizeof(uint64_t));
+
+#endif  // LATCH_HPP
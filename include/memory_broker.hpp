@@ -0,0 +1,241 @@
+#ifndef MEMORY_BROKER_HPP
+#define MEMORY_BROKER_HPP
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "eviction_policy.hpp"
+
+// Keys of the pages a pool evicted last, to count the misses that more frames
+// would have saved: a miss on a page evicted among the last capacity ones
+// would have been a hit with capacity more frames (a ghost hit). Thread-safe;
+// a capacity of 0 turns it off.
+class GhostCache {
+ public:
+  void SetCapacity(size_t capacity) {
+    std::lock_guard<std::mutex> guard(latch);
+    this->capacity.store(capacity, std::memory_order_relaxed);
+    while (ghosts.Size() > capacity) {
+      ghosts.PopFront();
+    }
+  }
+  void Evicted(uint64_t key) {
+    if (capacity.load(std::memory_order_relaxed) == 0) {
+      return;
+    }
+    std::lock_guard<std::mutex> guard(latch);
+    ghosts.PushBack(key);
+    while (ghosts.Size() > capacity.load(std::memory_order_relaxed)) {
+      ghosts.PopFront();
+    }
+  }
+  void Missed(uint64_t key) {
+    if (capacity.load(std::memory_order_relaxed) == 0) {
+      return;
+    }
+    std::lock_guard<std::mutex> guard(latch);
+    if (ghosts.Erase(key)) {
+      hits.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+  uint64_t GetHits() const { return hits.load(std::memory_order_relaxed); }
+
+ private:
+  std::mutex latch;
+  std::atomic<size_t> capacity{0};
+  GhostList ghosts;
+  std::atomic<uint64_t> hits{0};
+};
+
+// A buffer pool whose size a MemoryBroker manages. The pool is created with
+// the most frames it may ever use; its capacity is the number it uses now.
+// Frames out of use give their memory back to the OS.
+class ResizablePool {
+ public:
+  virtual ~ResizablePool() = default;
+  virtual BufferStats GetStats() const = 0;
+  virtual uint32_t GetMaxCapacity() const = 0;
+  // A pool that applies changes later returns the capacity it was set to.
+  virtual uint32_t GetCapacity() const = 0;
+  // Use capacity frames from now on. Shrinking evicts pages, and stops early
+  // if the frames left are pinned. A pool may apply the change later, e.g.,
+  // between operations of the thread that owns it.
+  virtual void SetCapacity(uint32_t capacity) = 0;
+  virtual GhostCache &GetGhostCache() = 0;
+};
+
+// Splits a budget of frames among the buffer pools of the process and moves
+// frames to where they save the most I/O while the workload runs.
+//
+// Every interval the broker takes the ghost hits of each pool since the last
+// round as its marginal gain: the misses step more frames would have saved.
+// step frames then move from the pool with the lowest gain to the one with
+// the highest, if that saves clearly more misses than it costs. Budget not
+// handed out yet goes to the pool with the highest gain first.
+//
+// The broker is process-wide, like the I/O backend: Enable it before the
+// pools are created, and have their owners Register them.
+class MemoryBroker {
+ public:
+  // A pool's current share, see GetAllocation.
+  struct Share {
+    std::string name;
+    uint32_t capacity;
+    uint64_t ghost_hits;  // In the last round
+    BufferStats stats;
+  };
+
+  // @budget: frames of all pools together
+  // @step: frames moved at a time
+  // @interval: time between two rounds
+  MemoryBroker(uint64_t budget, uint32_t step, std::chrono::milliseconds interval)
+      : budget(budget), step(step), interval(interval) {
+    worker = std::thread(&MemoryBroker::Run, this);
+  }
+  ~MemoryBroker() {
+    {
+      std::lock_guard<std::mutex> guard(latch);
+      stop = true;
+    }
+    wakeup.notify_all();
+    worker.join();
+  }
+
+  uint64_t GetBudget() const { return budget; }
+
+  // Manage pool. The budget is split evenly among the pools again, as far as
+  // their maximum sizes allow.
+  void Register(const std::string &name, ResizablePool *pool) {
+    std::lock_guard<std::mutex> guard(latch);
+    pool->GetGhostCache().SetCapacity(step);
+    pools.push_back({name, pool, pool->GetGhostCache().GetHits(), 0});
+    uint32_t share = static_cast<uint32_t>(std::max<uint64_t>(budget / pools.size(), kMinCapacity));
+    // Shrink first, so that the budget is not exceeded while growing.
+    for (auto &p : pools) {
+      if (p.pool->GetCapacity() > share) p.pool->SetCapacity(share);
+    }
+    for (auto &p : pools) {
+      if (p.pool->GetCapacity() < share) p.pool->SetCapacity(std::min(share, p.pool->GetMaxCapacity()));
+    }
+  }
+
+  // Stop managing pool, before it is freed. Its frames go to the other pools
+  // in the next rounds.
+  void Unregister(ResizablePool *pool) {
+    std::lock_guard<std::mutex> guard(latch);
+    pools.erase(std::remove_if(pools.begin(), pools.end(), [&](const Entry &e) { return e.pool == pool; }),
+                pools.end());
+  }
+
+  std::vector<Share> GetAllocation() const {
+    std::lock_guard<std::mutex> guard(latch);
+    std::vector<Share> shares;
+    for (auto &p : pools) {
+      shares.push_back({p.name, p.pool->GetCapacity(), p.gain, p.pool->GetStats()});
+    }
+    return shares;
+  }
+
+  uint64_t GetMoves() const { return moves.load(std::memory_order_relaxed); }
+
+  // Process-wide broker, nullptr unless enabled.
+  static void Enable(uint64_t budget, uint32_t step, std::chrono::milliseconds interval) {
+    global.reset(new MemoryBroker(budget, step, interval));
+  }
+  static void Disable() { global.reset(); }
+  static MemoryBroker *Get() { return global.get(); }
+
+ private:
+  // Pools are never shrunk below this, to leave room for the pages they pin
+  // (e.g., prefetch and write-back batches).
+  static constexpr uint32_t kMinCapacity = 256;
+  // The receiving pool must save this much more than the donor loses.
+  static constexpr double kMinAdvantage = 1.25;
+
+  struct Entry {
+    std::string name;
+    ResizablePool *pool;
+    uint64_t last_ghost_hits;
+    uint64_t gain;  // Ghost hits in the last round
+  };
+
+  void Run() {
+    std::unique_lock<std::mutex> guard(latch);
+    while (!wakeup.wait_for(guard, interval, [this] { return stop; })) {
+      Rebalance();
+    }
+  }
+
+  void Rebalance() {
+    if (pools.empty()) {
+      return;
+    }
+    uint64_t allocated = 0;
+    for (auto &p : pools) {
+      uint64_t hits = p.pool->GetGhostCache().GetHits();
+      p.gain = hits - p.last_ghost_hits;
+      p.last_ghost_hits = hits;
+      allocated += p.pool->GetCapacity();
+    }
+
+    Entry *receiver = nullptr;
+    for (auto &p : pools) {
+      if (p.pool->GetCapacity() < p.pool->GetMaxCapacity() && (!receiver || p.gain > receiver->gain)) {
+        receiver = &p;
+      }
+    }
+    if (!receiver || receiver->gain == 0) {
+      return;
+    }
+    auto grow = [&](uint32_t frames) {
+      uint32_t capacity = receiver->pool->GetCapacity();
+      receiver->pool->SetCapacity(std::min(capacity + frames, receiver->pool->GetMaxCapacity()));
+    };
+    if (allocated + step <= budget) {
+      grow(step);
+      return;
+    }
+
+    Entry *donor = nullptr;
+    for (auto &p : pools) {
+      if (&p != receiver && p.pool->GetCapacity() >= kMinCapacity + step && (!donor || p.gain < donor->gain)) {
+        donor = &p;
+      }
+    }
+    if (!donor || receiver->gain < donor->gain * kMinAdvantage + 1) {
+      return;
+    }
+    uint32_t before = donor->pool->GetCapacity();
+    donor->pool->SetCapacity(before - step);
+    uint32_t freed = before - std::min(before, donor->pool->GetCapacity());
+    if (freed > 0) {
+      grow(freed);
+      moves.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  const uint64_t budget;
+  const uint32_t step;
+  const std::chrono::milliseconds interval;
+
+  mutable std::mutex latch;  // Protects pools; held during a round
+  std::condition_variable wakeup;
+  bool stop{false};
+  std::vector<Entry> pools;
+  std::atomic<uint64_t> moves{0};
+  std::thread worker;
+
+  static inline std::unique_ptr<MemoryBroker> global;
+};
+
+#endif  // MEMORY_BROKER_HPP
@@ -0,0 +1,186 @@
+#ifndef NUMA_PARTITIONS_HPP
+#define NUMA_PARTITIONS_HPP
+
+#include <glog/logging.h>
+#include <numa.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "eviction_policy.hpp"
+#include "huge_pages.hpp"
+
+// Splitting of the frames of a buffer pool into one partition per NUMA node.
+// The memory of each partition is bound to its node, and a thread that misses
+// takes a frame of its own node's partition if it can (see PartitionedPolicy),
+// so that the threads of each node mostly hit local memory. Threads are
+// expected to stay on their CPU (see AffinityManager) and to run on every
+// node, or the partitions of the other nodes only fill up once the local one
+// is all pinned.
+//
+// Partitioning is process-wide, like the I/O backend: Enable it before the
+// pools are created. It is a no-op on a single node.
+class NumaPartitions {
+ public:
+  static void Enable() {
+    nodes.clear();
+    if (numa_available() < 0) {
+      LOG(WARNING) << "NUMA is not available, the buffer pools are not partitioned.";
+      return;
+    }
+    bitmask *mems = numa_get_mems_allowed();
+    for (int n = 0; n <= numa_max_node(); ++n) {
+      if (numa_bitmask_isbitset(mems, n)) nodes.push_back(n);
+    }
+    numa_bitmask_free(mems);
+    // Threads on a node without memory of its own count as local to the first.
+    cpu_partitions.assign(numa_num_configured_cpus(), 0);
+    for (size_t p = 0; p < nodes.size(); ++p) {
+      for (int cpu = 0; cpu < static_cast<int>(cpu_partitions.size()); ++cpu) {
+        if (numa_node_of_cpu(cpu) == nodes[p]) cpu_partitions[cpu] = p;
+      }
+    }
+  }
+  static bool Enabled() { return nodes.size() > 1; }
+
+  NumaPartitions() : bounds{0, 0} {}
+  // Partitions of frame_count frames of frame_size bytes, mapped with backing;
+  // a single one if partitioning is off or not wanted for the pool, or if the
+  // pool is too small to give every node a partition. Partitions start at
+  // multiples of the backing's huge page size (2 MB even without huge pages,
+  // for transparent ones), or mbind would fail on the pages they share.
+  NumaPartitions(uint32_t frame_count, size_t frame_size, HugePages::Kind backing, bool partitioned = true)
+      : bounds{0} {
+    const uint64_t granularity = std::max<size_t>(HugePages::PageSize(backing) / frame_size, 1);
+    uint32_t count = partitioned && Enabled() && frame_count >= granularity * nodes.size() ? nodes.size() : 1;
+    for (uint32_t p = 1; p < count; ++p) {
+      bounds.push_back(uint64_t{frame_count} * p / count / granularity * granularity);
+    }
+    bounds.push_back(frame_count);
+  }
+
+  uint32_t GetCount() const { return bounds.size() - 1; }
+  uint32_t Begin(uint32_t partition) const { return bounds[partition]; }
+  uint32_t End(uint32_t partition) const { return bounds[partition + 1]; }
+  uint32_t Size(uint32_t partition) const { return End(partition) - Begin(partition); }
+  // The frames of partition among capacity frames spread over the partitions
+  // in proportion to their sizes.
+  uint32_t Share(uint32_t partition, uint32_t capacity) const {
+    const uint64_t frame_count = bounds.back();
+    return capacity * uint64_t{End(partition)} / frame_count - capacity * uint64_t{Begin(partition)} / frame_count;
+  }
+  uint32_t Of(uint32_t frame) const {
+    uint32_t p = 0;
+    while (frame >= bounds[p + 1]) ++p;
+    return p;
+  }
+  // The partition of the calling thread's node, or the one a LocalScope of
+  // the thread set.
+  uint32_t Local() const {
+    if (GetCount() == 1) return 0;
+    if (scoped_local < GetCount()) return scoped_local;
+    int cpu = sched_getcpu();
+    return cpu >= 0 && cpu < static_cast<int>(cpu_partitions.size()) ? cpu_partitions[cpu] : 0;
+  }
+
+  // Makes the calling thread take the frames of partition first, e.g., to
+  // evict the pages of a given partition.
+  class LocalScope {
+   public:
+    explicit LocalScope(uint32_t partition) { scoped_local = partition; }
+    ~LocalScope() { scoped_local = kNoPartition; }
+  };
+
+  // Bind the memory of each partition of the frames at base, before it is
+  // first touched.
+  void Bind(void *base, size_t frame_size) const {
+    for (uint32_t p = 0; GetCount() > 1 && p < GetCount(); ++p) {
+      numa_tonode_memory(static_cast<char *>(base) + frame_size * Begin(p), frame_size * (End(p) - Begin(p)),
+                         nodes[p]);
+    }
+  }
+
+ private:
+  std::vector<uint32_t> bounds;  // Of partition p: [bounds[p], bounds[p + 1])
+
+  static constexpr uint32_t kNoPartition = ~uint32_t{0};
+
+  static inline std::vector<int> nodes;  // Node of each partition
+  static inline std::vector<uint32_t> cpu_partitions;  // Partition of each CPU's node
+  static inline thread_local uint32_t scoped_local = kNoPartition;
+};
+
+// Replacement within NUMA partitions: every partition has a policy of its own
+// over its frames, of the kind selected with EvictionPolicy::SetDefault.
+// Victim offers the frames of the calling thread's partition first, and those
+// of the other partitions only if none of the local frames can be taken.
+class PartitionedPolicy : public EvictionPolicy {
+ public:
+  explicit PartitionedPolicy(const NumaPartitions &partitions) : partitions(partitions) {
+    for (uint32_t p = 0; p < partitions.GetCount(); ++p) {
+      policies.push_back(EvictionPolicy::Make(partitions.End(p) - partitions.Begin(p)));
+    }
+  }
+  const char *Name() const override { return policies[0]->Name(); }
+
+  void Admit(uint32_t frame, uint64_t key, uint16_t weight) override {
+    uint32_t p = partitions.Of(frame);
+    policies[p]->Admit(frame - partitions.Begin(p), key, weight);
+  }
+  void Access(uint32_t frame, uint16_t weight) override {
+    uint32_t p = partitions.Of(frame);
+    policies[p]->Access(frame - partitions.Begin(p), weight);
+  }
+  uint32_t Victim(const std::function<bool(uint32_t)> &claim) override {
+    const uint32_t local = partitions.Local();
+    for (uint32_t i = 0; i < policies.size(); ++i) {
+      uint32_t p = (local + i) % policies.size();
+      uint32_t begin = partitions.Begin(p);
+      uint32_t frame = policies[p]->Victim([&](uint32_t f) { return claim(begin + f); });
+      if (frame != kNoFrame) {
+        return begin + frame;
+      }
+    }
+    return kNoFrame;
+  }
+  void Evicted(uint32_t frame) override {
+    uint32_t p = partitions.Of(frame);
+    policies[p]->Evicted(frame - partitions.Begin(p));
+  }
+  void Free(uint32_t frame) override {
+    uint32_t p = partitions.Of(frame);
+    policies[p]->Free(frame - partitions.Begin(p));
+  }
+  void Withdraw(uint32_t frame) override {
+    uint32_t p = partitions.Of(frame);
+    policies[p]->Withdraw(frame - partitions.Begin(p));
+  }
+  // The next frames of every partition, as the cleaner cannot tell which
+  // partition the next misses go to.
+  void Upcoming(uint32_t count, std::vector<uint32_t> &frames) override {
+    for (uint32_t p = 0; p < policies.size(); ++p) {
+      size_t first = frames.size();
+      policies[p]->Upcoming(std::max<uint32_t>(count / policies.size(), 1), frames);
+      for (size_t i = first; i < frames.size(); ++i) {
+        frames[i] += partitions.Begin(p);
+      }
+    }
+  }
+  // Split in proportion to the partition sizes.
+  void SetCapacity(uint32_t capacity) override {
+    const uint32_t frame_count = partitions.End(partitions.GetCount() - 1);
+    for (uint32_t p = 0; p < policies.size(); ++p) {
+      uint32_t size = partitions.End(p) - partitions.Begin(p);
+      policies[p]->SetCapacity(std::max<uint32_t>(uint64_t{capacity} * size / frame_count, 1));
+    }
+  }
+
+ private:
+  const NumaPartitions partitions;
+  std::vector<std::unique_ptr<EvictionPolicy>> policies;
+};
+
+#endif  // NUMA_PARTITIONS_HPP
@@ -0,0 +1,85 @@
+#ifndef PERF_COUNTERS_HPP
+#define PERF_COUNTERS_HPP
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstring>
+
+// Data TLB misses of the calling thread, counted by the CPU through
+// perf_event_open(2). A dTLB miss costs a page walk, which huge pages (see
+// HugePages) save. Counting needs kernel.perf_event_paranoid <= 2 (or
+// CAP_PERFMON); events the CPU or the kernel do not offer are reported as
+// unavailable.
+class TlbCounters {
+ public:
+  struct Counts {
+    bool available{false};
+    uint64_t load_misses{0};
+    uint64_t store_misses{0};
+
+    Counts &operator+=(const Counts &c) {
+      available = available || c.available;
+      load_misses += c.load_misses;
+      store_misses += c.store_misses;
+      return *this;
+    }
+  };
+
+  TlbCounters()
+      : load_fd(Open(PERF_COUNT_HW_CACHE_OP_READ)), store_fd(Open(PERF_COUNT_HW_CACHE_OP_WRITE)) {}
+  ~TlbCounters() {
+    for (int fd : {load_fd, store_fd}) {
+      if (fd >= 0) close(fd);
+    }
+  }
+
+  void Start() {
+    for (int fd : {load_fd, store_fd}) {
+      if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+      }
+    }
+  }
+
+  // The misses since Start.
+  Counts Stop() {
+    Counts counts;
+    counts.available = load_fd >= 0;
+    counts.load_misses = Read(load_fd);
+    counts.store_misses = Read(store_fd);
+    return counts;
+  }
+
+ private:
+  static int Open(uint64_t op) {
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (op << 8) | (uint64_t{PERF_COUNT_HW_CACHE_RESULT_MISS} << 16);
+    attr.disabled = 1;
+    attr.exclude_hv = 1;
+    return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+  }
+  static uint64_t Read(int fd) {
+    uint64_t value = 0;
+    if (fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+      if (read(fd, &value, sizeof(value)) != sizeof(value)) value = 0;
+    }
+    return value;
+  }
+
+  int load_fd;
+  int store_fd;
+
+  TlbCounters(const TlbCounters &) = delete;
+  TlbCounters &operator=(const TlbCounters &) = delete;
+};
+
+#endif  // PERF_COUNTERS_HPP
@@ -1,11 +1,15 @@
 #ifndef TYPES_H
 #define TYPES_H
+#include <atomic>
 #include <cstdint>
+#include <limits>
+#include "latch.hpp"
 class BufferManager;
 using pagenum_t = uint32_t;
 using pageid_t = uint64_t;
 using fileid_t = uint16_t;
 using record_t = uint64_t;
+using lsn_t = uint64_t;  // Log sequence number, see Wal
 namespace ycsbc{
 struct Pair {
   uint64_t key{};
@@ -74,19 +78,24 @@ struct PageId {
 #define PAGE_WRITE 1
 #define PAGE_READ 2
 #define PAGE_DATA_SIZE \
-  (PAGE_SIZE - sizeof(page_id) - sizeof(flag_bytes) - sizeof(pin_count) - sizeof(last_used))
+  (PAGE_SIZE - sizeof(page_id) - sizeof(latch) - sizeof(flag_bytes) - sizeof(pin_count) - sizeof(last_used))
 // Representation of a page in memory. The buffer has an array of Pages to
 // accommodate DataPages and DirectoryPages.
 struct [[nodiscard]] alignas(ALIGNMENT) Page {
-  enum flag_idx { is_dirty = 0 };
+  enum flag_idx { is_dirty = 0, is_loading = 1, is_writing = 2 };
 
   // ID of the page held in page_data
   PageId page_id;
 
-  // Pin count - the number of users of this page
-  uint16_t pin_count{0};
+  // Version latch protecting page_data, see OptLatch
+  OptLatch latch;
 
-  uint16_t last_used{0};
+  // Pin count - the number of users of this page. A pinned page is never
+  // evicted.
+  std::atomic<uint16_t> pin_count{0};
+
+  // Reference (usage) count for CLOCK
+  std::atomic<uint16_t> last_used{0};
 
   bool flag_bytes[8 - sizeof(pin_count) - sizeof(last_used)]{false};  // Also used for padding
 
@@ -98,21 +107,57 @@ struct [[nodiscard]] alignas(ALIGNMENT) Page {
 
   // Helper functions
   [[nodiscard]] inline char *GetRealPage() noexcept { return page_data; }
-  inline void SetUsed(uint16_t access_type) { last_used = access_type; }
-  inline void SetIdle() { --last_used; }
-  inline void SetDirty(bool dirty) noexcept { flag_bytes[is_dirty] = dirty; }
+  inline void SetUsed(uint16_t access_type) {
+    last_used.store(access_type, std::memory_order_relaxed);
+  }
+  // Decrement the reference count unless it already dropped to zero.
+  inline void SetIdle() {
+    auto used = last_used.load(std::memory_order_relaxed);
+    while (used > 0 && !last_used.compare_exchange_weak(
+                           used, used - 1, std::memory_order_relaxed)) {
+    }
+  }
+  inline void SetDirty(bool dirty) noexcept {
+    __atomic_store_n(&flag_bytes[is_dirty], dirty, __ATOMIC_RELEASE);
+  }
+  // Set while the page is being read from storage into this frame.
+  inline void SetLoading(bool loading) noexcept {
+    __atomic_store_n(&flag_bytes[is_loading], loading, __ATOMIC_RELEASE);
+  }
+  inline bool IsLoading() const noexcept {
+    return __atomic_load_n(&flag_bytes[is_loading], __ATOMIC_ACQUIRE);
+  }
+  // Set while the page is being written back from this frame, from before its
+  // dirty flag is cleared.
+  inline void SetWriting(bool writing) noexcept {
+    __atomic_store_n(&flag_bytes[is_writing], writing, __ATOMIC_RELEASE);
+  }
+  inline bool IsWriting() const noexcept {
+    return __atomic_load_n(&flag_bytes[is_writing], __ATOMIC_ACQUIRE);
+  }
   inline PageId GetPageId() const noexcept { return page_id; }
-  inline uint16_t IsUsed() const noexcept { return (last_used > 0); }
-  inline uint16_t IsDirty() const noexcept { return flag_bytes[is_dirty]; }
+  inline uint16_t IsUsed() const noexcept {
+    return (last_used.load(std::memory_order_relaxed) > 0);
+  }
+  inline uint16_t IsDirty() const noexcept {
+    return __atomic_load_n(&flag_bytes[is_dirty], __ATOMIC_ACQUIRE);
+  }
   inline void IncPinCount() noexcept {
-    assert(pin_count < std::numeric_limits<decltype(pin_count)>::max());
-    pin_count += 1;
+    [[maybe_unused]] auto old = pin_count.fetch_add(1, std::memory_order_acquire);
+    assert(old < std::numeric_limits<uint16_t>::max());
   }
   inline void DecPinCount() noexcept {
-    assert(pin_count);
-    pin_count -= 1;
+    [[maybe_unused]] auto old = pin_count.fetch_sub(1, std::memory_order_release);
+    assert(old);
+  }
+  // Pin an unused frame exclusively (0 -> 1); fails if anyone else holds a pin.
+  inline bool TryPinUnused() noexcept {
+    uint16_t expected = 0;
+    return pin_count.compare_exchange_strong(expected, 1, std::memory_order_acquire);
   }
-  inline auto GetPinCount() const noexcept { return pin_count; }
+  inline auto GetPinCount() const noexcept { return pin_count.load(std::memory_order_acquire); }
+  // Drop all pins of a frame whose page leaves the buffer pool with its file.
+  inline void ResetPinCount() noexcept { pin_count.store(0, std::memory_order_release); }
   // Prevent unintentional copies
   Page(const Page &) = delete;
   Page(Page &&) = delete;
@@ -123,18 +168,6 @@ struct [[nodiscard]] alignas(ALIGNMENT) Page {
 static_assert(sizeof(Page) == PAGE_SIZE,
               "Actual aligned size of Page does not match PAGE_SIZE");
 
-#define BTREE_ORDER                                                \
-  ((int)((sizeof(decltype(std::declval<Page>().page_data)) - 16) / \
-             (sizeof(ycsbc::Pair) + 4) - 2))
-// #define BTREE_ORDER 45 // Btree of order m
-#define MAX_CHILDREN (BTREE_ORDER + 2)  // Every node has at most m children
-#define MAX_DATA \
-  (BTREE_ORDER + 1)  // Non-leaf nodes with k children contains k-1 keys
-
-// Every non-leaf has at least ceil(m/2) children (except root)
-constexpr int MIN_NUM_CHILDREN =
-    (BTREE_ORDER % 2) ? ((BTREE_ORDER / 2) + 1) : (BTREE_ORDER / 2);
-
 #define ROOT_PAGE_NUM (1)  // todo: maybe not needed
 
 #endif
@@ -0,0 +1,244 @@
+#ifndef URING_ENGINE_HPP
+#define URING_ENGINE_HPP
+
+#include <glog/logging.h>
+#include <liburing.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+// Asynchronous page I/O through io_uring.
+//
+// io_uring instances are not thread-safe, so every thread submits through its
+// own ring (see Local()). Files and buffer-pool frames are registered
+// process-wide with RegisterFile() and RegisterBuffers(); every ring picks up
+// the registrations lazily, after which requests on them use fixed files and
+// fixed buffers. With sqpoll a kernel thread polls the submission queue, with
+// iopoll completions are polled from the device (requires O_DIRECT).
+struct UringOptions {
+  unsigned queue_depth{256};
+  bool sqpoll{false};
+  bool iopoll{false};
+};
+
+class UringEngine {
+ public:
+  using Options = UringOptions;
+
+  // Select io_uring for all page I/O. Must be called before any I/O is issued.
+  static void Enable(const Options &opts) {
+    options = opts;
+    enabled = true;
+  }
+  static bool Enabled() { return enabled; }
+
+  // Process-wide registration of files and buffer regions.
+  static void RegisterFile(int fd) {
+    std::lock_guard<std::mutex> guard(registry_latch);
+    auto slot = std::find(files.begin(), files.end(), -1);
+    if (slot != files.end()) {
+      *slot = fd;
+    } else {
+      files.push_back(fd);
+    }
+    generation++;
+  }
+
+  static void UnregisterFile(int fd) {
+    std::lock_guard<std::mutex> guard(registry_latch);
+    std::replace(files.begin(), files.end(), fd, -1);
+    generation++;
+  }
+
+  static void RegisterBuffers(void *base, size_t len) {
+    std::lock_guard<std::mutex> guard(registry_latch);
+    // A single registered buffer can be at most 1 GB.
+    constexpr size_t kMaxRegisteredBuffer = 1ul << 30;
+    for (size_t off = 0; off < len; off += kMaxRegisteredBuffer) {
+      buffers.push_back(iovec{static_cast<char *>(base) + off,
+                              std::min(kMaxRegisteredBuffer, len - off)});
+    }
+    generation++;
+  }
+
+  static void UnregisterBuffers(void *base, size_t len) {
+    std::lock_guard<std::mutex> guard(registry_latch);
+    auto *begin = static_cast<char *>(base);
+    buffers.erase(std::remove_if(buffers.begin(), buffers.end(),
+                                 [&](const iovec &v) {
+                                   auto *p = static_cast<char *>(v.iov_base);
+                                   return p >= begin && p < begin + len;
+                                 }),
+                  buffers.end());
+    generation++;
+  }
+
+  // The ring of the calling thread.
+  static UringEngine &Local() {
+    thread_local UringEngine engine(options);
+    return engine;
+  }
+
+  // Queue a read/write of len bytes at offset. Nothing is issued before
+  // SubmitAndWait().
+  void PrepRead(int fd, void *buf, size_t len, off_t offset) {
+    Prep(fd, buf, len, offset, false);
+  }
+
+  void PrepWrite(int fd, const void *buf, size_t len, off_t offset) {
+    Prep(fd, const_cast<void *>(buf), len, offset, true);
+  }
+
+  // Submit all queued requests and reap their completions. Returns false if
+  // any of them failed or a write transferred fewer bytes than requested
+  // (short reads are legal at the end of a file).
+  bool SubmitAndWait() {
+    while (pending > 0) {
+      int ret = io_uring_submit_and_wait(&ring, 1);
+      CHECK(ret >= 0 || ret == -EINTR) << "io_uring_submit_and_wait: " << strerror(-ret);
+      Reap();
+    }
+    bool ok = !failed;
+    failed = false;
+    return ok;
+  }
+
+  // Result (bytes transferred or -errno) of the last completed request.
+  int LastResult() const { return last_result; }
+
+  UringEngine(const UringEngine &) = delete;
+  UringEngine &operator=(const UringEngine &) = delete;
+
+  ~UringEngine() {
+    SubmitAndWait();
+    io_uring_queue_exit(&ring);
+  }
+
+ private:
+  explicit UringEngine(const Options &opts) {
+    io_uring_params params{};
+    if (opts.sqpoll) {
+      params.flags |= IORING_SETUP_SQPOLL;
+      params.sq_thread_idle = 2000;  // ms
+    }
+    if (opts.iopoll) {
+      params.flags |= IORING_SETUP_IOPOLL;
+    }
+    int ret = io_uring_queue_init_params(opts.queue_depth, &ring, &params);
+    CHECK(ret == 0) << "io_uring_queue_init_params: " << strerror(-ret);
+  }
+
+  // Re-register files and buffers if the registry changed since the last call.
+  void Sync() {
+    if (registered_generation == generation.load(std::memory_order_acquire)) {
+      return;
+    }
+    SubmitAndWait();  // Requests in flight may refer to the old registration
+    std::lock_guard<std::mutex> guard(registry_latch);
+    if (!ring_files.empty()) io_uring_unregister_files(&ring);
+    if (!ring_buffers.empty()) io_uring_unregister_buffers(&ring);
+    ring_files = files;
+    ring_buffers = buffers;
+    if (!ring_files.empty()) {
+      int ret = io_uring_register_files(&ring, ring_files.data(), ring_files.size());
+      LOG_IF(WARNING, ret) << "io_uring_register_files: " << strerror(-ret);
+      if (ret) ring_files.clear();
+    }
+    if (!ring_buffers.empty()) {
+      int ret = io_uring_register_buffers(&ring, ring_buffers.data(), ring_buffers.size());
+      LOG_IF(WARNING, ret) << "io_uring_register_buffers: " << strerror(-ret);
+      if (ret) ring_buffers.clear();
+    }
+    registered_generation = generation.load(std::memory_order_relaxed);
+  }
+
+  int FileIndex(int fd) const {
+    auto it = std::find(ring_files.begin(), ring_files.end(), fd);
+    return it == ring_files.end() ? -1 : it - ring_files.begin();
+  }
+
+  int BufferIndex(const void *buf, size_t len) const {
+    auto *p = static_cast<const char *>(buf);
+    for (size_t i = 0; i < ring_buffers.size(); ++i) {
+      auto *base = static_cast<const char *>(ring_buffers[i].iov_base);
+      if (p >= base && p + len <= base + ring_buffers[i].iov_len) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  void Prep(int fd, void *buf, size_t len, off_t offset, bool write) {
+    Sync();
+    io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+    if (!sqe) {  // Submission queue is full
+      bool ok = SubmitAndWait();
+      failed = failed || !ok;
+      sqe = io_uring_get_sqe(&ring);
+    }
+    int file_idx = FileIndex(fd);
+    int buf_idx = BufferIndex(buf, len);
+    int target = file_idx >= 0 ? file_idx : fd;
+    if (buf_idx >= 0) {
+      if (write) {
+        io_uring_prep_write_fixed(sqe, target, buf, len, offset, buf_idx);
+      } else {
+        io_uring_prep_read_fixed(sqe, target, buf, len, offset, buf_idx);
+      }
+    } else {
+      if (write) {
+        io_uring_prep_write(sqe, target, buf, len, offset);
+      } else {
+        io_uring_prep_read(sqe, target, buf, len, offset);
+      }
+    }
+    if (file_idx >= 0) {
+      sqe->flags |= IOSQE_FIXED_FILE;
+    }
+    io_uring_sqe_set_data64(sqe, write ? (len | kWriteFlag) : len);
+    pending++;
+  }
+
+  void Reap() {
+    io_uring_cqe *cqe;
+    unsigned head;
+    unsigned reaped = 0;
+    io_uring_for_each_cqe(&ring, head, cqe) {
+      uint64_t data = io_uring_cqe_get_data64(cqe);
+      bool short_write = (data & kWriteFlag) &&
+                         static_cast<uint64_t>(cqe->res) != (data & ~kWriteFlag);
+      if (cqe->res < 0 || short_write) {
+        LOG_IF(ERROR, cqe->res < 0) << "io_uring request failed: " << strerror(-cqe->res);
+        failed = true;
+      }
+      last_result = cqe->res;
+      reaped++;
+    }
+    io_uring_cq_advance(&ring, reaped);
+    pending -= reaped;
+  }
+
+  static constexpr uint64_t kWriteFlag = 1ull << 63;
+
+  io_uring ring;
+  unsigned pending{0};
+  int last_result{0};
+  bool failed{false};
+  uint64_t registered_generation{0};
+  std::vector<int> ring_files;
+  std::vector<iovec> ring_buffers;
+
+  static inline Options options{};
+  static inline bool enabled{false};
+  static inline std::mutex registry_latch;
+  static inline std::vector<int> files;
+  static inline std::vector<iovec> buffers;
+  static inline std::atomic<uint64_t> generation{0};
+};
+
+#endif  // URING_ENGINE_HPP